@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+  Per thread slab allocator for fixed size objects, not thread safe.
+
+  Objects live in slabs of PER_SLAB slots, slabs are never moved or freed while the pool lives,
+  so an object's address is stable and can go into an SQE's user_data.
+  Released slots go on an intrusive free list (the link lives in the dead object's storage),
+  so once the pool has grown to the peak number of live objects create/release never touch malloc.
+
+  Every object has to be released before the pool is destroyed, the pool doesn't track live objects.
+  */
+template<typename TYPE, size_t PER_SLAB = 64>
+class slab_pool
+{
+    union slot
+    {
+        slot *next_free;
+        alignas(TYPE) unsigned char storage[sizeof(TYPE)];
+    };
+
+public:
+    slab_pool() = default;
+    slab_pool(const slab_pool&) = delete;
+    slab_pool& operator=(const slab_pool&) = delete;
+
+    template<typename... ARGS>
+    TYPE* create(ARGS&&... args)
+    {
+        if (!m_free)
+            add_slab();
+
+        slot *s = m_free;
+        m_free = s->next_free;
+        m_in_use++;
+        return new (s->storage) TYPE(std::forward<ARGS>(args)...);
+    }
+
+    void release(TYPE *obj)
+    {
+        if (!obj)
+            return;
+
+        obj->~TYPE();
+        slot *s = reinterpret_cast<slot*>(obj);
+        s->next_free = m_free;
+        m_free = s;
+        m_in_use--;
+    }
+
+    size_t in_use() const { return m_in_use; }
+    size_t capacity() const { return m_slabs.size() * PER_SLAB; }
+    size_t resident_bytes() const { return m_slabs.size() * PER_SLAB * sizeof(slot); }
+
+private:
+    void add_slab()
+    {
+        m_slabs.emplace_back(new slot[PER_SLAB]);
+        slot *slab = m_slabs.back().get();
+        // thread the new slots onto the free list in address order
+        for (size_t i = PER_SLAB; i > 0; i--)
+        {
+            slab[i - 1].next_free = m_free;
+            m_free = &slab[i - 1];
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<slot[]>> m_slabs;
+    slot *m_free = nullptr;
+    size_t m_in_use = 0;
+};
+
+/**
+  Append only string storage, not thread safe.
+
+  intern() copies a string in once and hands back a string_view that stays valid for the life
+  of the arena, asking for the same string again returns the copy already there.
+  Meant for the handful of strings shared by lots of requests (file name, description),
+  the lookup is a linear scan so it is not a general purpose string table.
+  */
+class string_arena
+{
+public:
+    string_arena(size_t chunk_size = 4096)
+        : m_chunk_size(chunk_size)
+    {
+    }
+
+    std::string_view intern(std::string_view str)
+    {
+        for (std::string_view existing : m_strings)
+        {
+            if (existing == str)
+                return existing;
+        }
+
+        char *dst = allocate(str.size());
+        if (!str.empty())
+            ::memcpy(dst, str.data(), str.size());
+        m_strings.emplace_back(dst, str.size());
+        return m_strings.back();
+    }
+
+    size_t resident_bytes() const { return m_resident; }
+
+private:
+    char* allocate(size_t sz)
+    {
+        if (m_chunks.empty() || m_used + sz > m_chunk_cap)
+        {
+            m_chunk_cap = std::max(m_chunk_size, sz);
+            m_chunks.emplace_back(new char[m_chunk_cap]);
+            m_resident += m_chunk_cap;
+            m_used = 0;
+        }
+        char *dst = m_chunks.back().get() + m_used;
+        m_used += sz;
+        return dst;
+    }
+
+private:
+    size_t m_chunk_size = 4096;
+    size_t m_chunk_cap = 0;
+    size_t m_used = 0;
+    size_t m_resident = 0;
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    std::vector<std::string_view> m_strings;
+};
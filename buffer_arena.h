@@ -0,0 +1,230 @@
+#pragma once
+
+#include <linux/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <string_view>
+#include <vector>
+
+#include "cpu_placement.h"
+#include "log.h"
+
+/**
+  One big mapping carved into fixed size I/O slots, meant to be registered with io_uring in one shot.
+
+  The mapping is backed by the biggest pages we can get, falling back in order:
+      1g    MAP_HUGETLB | MAP_HUGE_1GB, needs 1GiB pages reserved (hugepagesz=1G hugepages=N on the kernel cmd line)
+      2m    MAP_HUGETLB | MAP_HUGE_2MB, needs /proc/sys/vm/nr_hugepages > 0
+      thp   anonymous memory aligned to 2MiB with MADV_HUGEPAGE, transparent huge pages permitting
+      none  plain 4KiB pages
+  so a box without reserved huge pages still works, just with more TLB misses.
+
+  register_with() hands the kernel the whole arena as one fixed buffer (one per GiB or so, the per buffer limit,
+  each a whole number of slots so no slot straddles two), pinning it once instead of per I/O. Slots are then used with prep_read_fixed/prep_write_fixed and buf_index().
+  If registration fails (RLIMIT_MEMLOCK is the usual suspect) the slots still work with plain reads/writes.
+
+  Not thread safe, one arena per ring thread.
+  */
+class buffer_arena
+{
+public:
+    enum page_kind { NORMAL, THP, HUGE_2M, HUGE_1G };
+
+    static const char* to_str(page_kind kind)
+    {
+        switch (kind) {
+        case NORMAL: return "none";
+        case THP: return "thp";
+        case HUGE_2M: return "2m";
+        case HUGE_1G: return "1g";
+        };
+        return "UNHANDLED";
+    }
+
+    static bool from_str(std::string_view str, page_kind &kind)
+    {
+        if (str == "none") kind = NORMAL;
+        else if (str == "thp") kind = THP;
+        else if (str == "2m") kind = HUGE_2M;
+        else if (str == "1g") kind = HUGE_1G;
+        else return false;
+        return true;
+    }
+
+    /**
+      At least slot_cnt slots of slot_size bytes, more if rounding up to the page size leaves room.
+      best is the biggest page kind to try, node >= 0 binds the pages to that NUMA node.
+      */
+    buffer_arena(size_t slot_size, uint32_t slot_cnt, page_kind best = HUGE_2M, int node = -1)
+        : m_slot_size(slot_size)
+    {
+        size_t want = slot_size * slot_cnt;
+
+        for (int kind = best; kind >= NORMAL && !m_base; kind--)
+        {
+            map(static_cast<page_kind>(kind), want);
+        }
+
+        if (!m_base)
+        {
+            ERROR << "failed to map a buffer arena of " << want << " bytes" << ENDL;
+            return;
+        }
+
+        bind_to_node(m_base, m_bytes, node);
+
+        uint32_t cnt = m_bytes / m_slot_size;
+        m_free.reserve(cnt);
+        for (uint32_t i = cnt; i > 0; i--)
+            m_free.push_back(i - 1);
+        m_slot_cnt = cnt;
+
+        DEBUG(1) << "buffer arena: " << m_bytes << " bytes, pages: " << to_str(m_kind) << ", slots: " << cnt << ENDL;
+    }
+
+    ~buffer_arena()
+    {
+        if (m_base)
+            ::munmap(m_base, m_bytes);
+    }
+
+    buffer_arena(const buffer_arena&) = delete;
+    buffer_arena& operator=(const buffer_arena&) = delete;
+
+    bool is_valid() const { return m_base != nullptr; }
+
+    // nullptr when every slot is in use
+    char* acquire()
+    {
+        if (m_free.empty())
+            return nullptr;
+        uint32_t slot = m_free.back();
+        m_free.pop_back();
+        return m_base + static_cast<size_t>(slot) * m_slot_size;
+    }
+
+    void release(char *buffer)
+    {
+        if (buffer)
+            m_free.push_back((buffer - m_base) / m_slot_size);
+    }
+
+    /**
+      Register the arena with ring as fixed buffers, one iovec per as many whole slots as fit in a GiB,
+      so a slot's I/O never crosses into the next iovec. Call once per ring, before any fixed I/O.
+      */
+    template<class RING>
+    bool register_with(RING &ring)
+    {
+        // a slot bigger than the kernel takes in one buffer can't be registered at all
+        if (!m_base || m_slot_size > REGISTER_MAX)
+            return false;
+
+        m_register_span = REGISTER_MAX / m_slot_size * m_slot_size;
+        size_t used = static_cast<size_t>(m_slot_cnt) * m_slot_size;
+        std::vector<iovec> iovs;
+        for (size_t off = 0; off < used; off += m_register_span)
+        {
+            iovec iov;
+            iov.iov_base = m_base + off;
+            iov.iov_len = std::min(m_register_span, used - off);
+            iovs.push_back(iov);
+        }
+
+        m_registered = ring.register_buffers(iovs.data(), iovs.size());
+        return m_registered;
+    }
+
+    bool registered() const { return m_registered; }
+
+    // the fixed buffer index for a slot, -1 when the arena isn't registered
+    int buf_index(const char *buffer) const
+    {
+        if (!m_registered)
+            return -1;
+        return (buffer - m_base) / m_register_span;
+    }
+
+    page_kind kind() const { return m_kind; }
+    size_t slot_size() const { return m_slot_size; }
+    uint32_t slot_cnt() const { return m_slot_cnt; }
+    uint32_t in_use() const { return m_slot_cnt - m_free.size(); }
+    size_t bytes() const { return m_bytes; }
+
+private:
+    static constexpr size_t SZ_2M = 2UL * 1024 * 1024;
+    static constexpr size_t SZ_1G = 1024UL * 1024 * 1024;
+    // biggest buffer the kernel accepts in one registration iovec
+    static constexpr size_t REGISTER_MAX = SZ_1G;
+
+    static size_t round_up(size_t val, size_t to) { return (val + to - 1) / to * to; }
+
+    void map(page_kind kind, size_t want)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        size_t bytes = 0;
+
+        switch (kind) {
+        case HUGE_1G:
+            bytes = round_up(want, SZ_1G);
+            flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+            break;
+        case HUGE_2M:
+            bytes = round_up(want, SZ_2M);
+            flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+            break;
+        case THP:
+            bytes = round_up(want, SZ_2M);
+            break;
+        case NORMAL:
+            bytes = round_up(want, 4096);
+            break;
+        };
+
+        if (kind == THP)
+        {
+            // THP only kicks in for 2MiB aligned ranges, over allocate and trim to get the alignment
+            char *raw = static_cast<char*>(::mmap(nullptr, bytes + SZ_2M, PROT_READ | PROT_WRITE, flags, -1, 0));
+            if (raw == MAP_FAILED)
+                return;
+            char *aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(raw), SZ_2M));
+            if (aligned > raw)
+                ::munmap(raw, aligned - raw);
+            ::munmap(aligned + bytes, raw + SZ_2M - aligned);
+
+            if (::madvise(aligned, bytes, MADV_HUGEPAGE))
+            {
+                DEBUG(1) << "madvise(MADV_HUGEPAGE): " << ::strerror(errno) << ENDL;
+                ::munmap(aligned, bytes);
+                return;
+            }
+            m_base = aligned;
+        }
+        else
+        {
+            void *ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (ptr == MAP_FAILED)
+            {
+                DEBUG(1) << "mmap " << to_str(kind) << " pages failed: " << ::strerror(errno) << ENDL;
+                return;
+            }
+            m_base = static_cast<char*>(ptr);
+        }
+
+        m_bytes = bytes;
+        m_kind = kind;
+    }
+
+private:
+    char *m_base = nullptr;
+    size_t m_bytes = 0;
+    size_t m_slot_size = 0;
+    uint32_t m_slot_cnt = 0;
+    page_kind m_kind = NORMAL;
+    bool m_registered = false;
+    size_t m_register_span = 0; // bytes per registered iovec, a multiple of m_slot_size
+    std::vector<uint32_t> m_free;
+};
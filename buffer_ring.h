@@ -0,0 +1,131 @@
+#pragma once
+
+#include <liburing.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "buffer_arena.h"
+#include "log.h"
+
+/**
+  A provided buffer ring: cnt buffers of buf_size bytes, carved out of a buffer_arena, that the kernel
+  picks from for IOSQE_BUFFER_SELECT ops on group (multishot recv).
+
+  The kernel takes buffers in ring order, the CQE says which one it used (buffer id in the upper 16 bits of
+  cqe->flags). The buffer belongs to us until recycle() puts it back on the ring, so data can be parsed
+  in place and even written out of it, no copy into a per connection buffer.
+  When every buffer is held the kernel ends multishot recvs with -ENOBUFS, which is the backpressure:
+  nothing more is read off the sockets until buffers come back.
+
+  A bundle recv's CQE covers several buffers, full ones and then the one the data ended in. Only the first
+  id is in the CQE, the others are whatever followed it on the ring, which is not id order once buffers
+  come back in any order. So we remember what was added after each buffer, for_each() walks a CQE's buffers.
+
+  cnt has to be a power of 2, at most 32768. Not thread safe, one per ring.
+  */
+class buffer_ring
+{
+public:
+    buffer_ring(uint32_t cnt, size_t buf_size, buffer_arena::page_kind pages = buffer_arena::NORMAL, int node = -1)
+        : m_arena(buf_size * cnt, 1, pages, node), // one slot holding every buffer
+          m_cnt(cnt),
+          m_buf_size(buf_size)
+    {
+    }
+
+    ~buffer_ring()
+    {
+        if (m_free)
+            m_free(m_owner, m_br, m_cnt, m_group);
+    }
+
+    buffer_ring(const buffer_ring&) = delete;
+    buffer_ring& operator=(const buffer_ring&) = delete;
+
+    // register with ring as group and hand it every buffer, the ring has to outlive us
+    template<class RING>
+    bool setup(RING &ring, uint16_t group)
+    {
+        if (!m_arena.is_valid() || m_cnt == 0 || (m_cnt & (m_cnt - 1)) || m_cnt > 32768)
+        {
+            ERROR << "buffer ring needs a power of 2 buffers up to 32768: " << m_cnt << ENDL;
+            return false;
+        }
+
+        m_br = ring.setup_buf_ring(m_cnt, group);
+        if (!m_br)
+            return false;
+
+        m_group = group;
+        m_owner = &ring;
+        m_free = [](void *owner, io_uring_buf_ring *br, uint32_t cnt, uint16_t group) {
+            static_cast<RING*>(owner)->free_buf_ring(br, cnt, group);
+        };
+
+        m_base = m_arena.acquire();
+        m_next.resize(m_cnt);
+        for (uint32_t bid = 0; bid < m_cnt; bid++)
+        {
+            io_uring_buf_ring_add(m_br, buffer(bid), m_buf_size, bid, io_uring_buf_ring_mask(m_cnt), bid);
+            m_next[bid] = bid + 1;
+        }
+        io_uring_buf_ring_advance(m_br, m_cnt);
+        m_last = m_cnt - 1;
+        m_available = m_cnt;
+        return true;
+    }
+
+    static uint16_t buffer_id(uint32_t cqe_flags) { return cqe_flags >> IORING_CQE_BUFFER_SHIFT; }
+
+    char* buffer(uint16_t bid) { return m_base + static_cast<size_t>(bid) * m_buf_size; }
+
+    // a CQE came back holding one of our buffers
+    void taken() { m_available--; }
+
+    /**
+      The res bytes of a recv CQE that picked bid first, f(bid, len) for each buffer they're in.
+      A plain recv has the one, a bundle as many as it filled. Each is taken() on the way.
+      */
+    template<class F>
+    void for_each(uint16_t bid, uint32_t res, F f)
+    {
+        while (res)
+        {
+            uint32_t len = res < m_buf_size ? res : m_buf_size;
+            m_available--;
+            f(bid, len);
+            res -= len;
+            bid = m_next[bid];
+        }
+    }
+
+    // hand bid back to the kernel, it goes on the ring after the last one we handed back
+    void recycle(uint16_t bid)
+    {
+        io_uring_buf_ring_add(m_br, buffer(bid), m_buf_size, bid, io_uring_buf_ring_mask(m_cnt), 0);
+        io_uring_buf_ring_advance(m_br, 1);
+        m_next[m_last] = bid;
+        m_last = bid;
+        m_available++;
+    }
+
+    uint16_t group() const { return m_group; }
+    uint32_t cnt() const { return m_cnt; }
+    uint32_t available() const { return m_available; }
+    size_t buf_size() const { return m_buf_size; }
+
+private:
+    buffer_arena m_arena;
+    char *m_base = nullptr;
+    io_uring_buf_ring *m_br = nullptr;
+    uint32_t m_cnt = 0;
+    uint32_t m_available = 0;
+    size_t m_buf_size = 0;
+    std::vector<uint16_t> m_next; // the buffer added to the ring after this one, m_next[m_last] is next to go
+    uint16_t m_last = 0;
+    uint16_t m_group = 0;
+    // the ring is a template, remember how to give the ring back without making this one too
+    void *m_owner = nullptr;
+    void (*m_free)(void *owner, io_uring_buf_ring *br, uint32_t cnt, uint16_t group) = nullptr;
+};
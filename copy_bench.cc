@@ -0,0 +1,493 @@
+#include "log.h"
+#include "misc.h"
+#include "string_view.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+/**
+  copy_bench: runs copy_file_simple over every combination of the settings given and writes one row per run
+  as CSV or JSON lines, so runs can be compared against each other instead of by eye.
+
+  Each list option takes comma separated values, every combination is run --repeat times:
+      --dirs=/dev/shm/bench,/var/tmp/bench   where the input and spool files go, tmpfs vs disk
+      --sizes=64k,1m,4k-64m:5                input file sizes, MIN-MAX:N is N sizes spread geometrically
+      --engines=uring,sync,aio,raw           copy_file_simple's --engine, io_uring vs the baselines
+      --cnt=  --each=  --thread-cnt=  --buffer-kb=  --sqpoll=false,true  --huge-pages=2m,none
+  The input file for each size is random bytes, made once per dir. The spool is deleted before every run.
+
+  The numbers come from copy_file_simple's --report line (throughput, p50/p99/p99.9/max latency,
+  user/sys CPU, context switches), --syscalls=true also runs it under strace -f -c and adds the total
+  syscall and io_uring_enter counts (strace slows the run down, compare those rows with each other only).
+  */
+
+namespace
+{
+
+struct sweep
+{
+    std::string bin = "./copy_file_simple";
+    std::vector<std::string> dirs{"/dev/shm/copy_bench"};
+    std::vector<uint64_t> sizes{1024 * 1024};
+    std::vector<std::string> engines{"uring"};
+    std::vector<std::string> cnts{"100"};
+    std::vector<std::string> eaches{"25"};
+    std::vector<std::string> thread_cnts{"1"};
+    std::vector<std::string> buffer_kbs{"64"};
+    std::vector<std::string> sqpolls{"false"};
+    std::vector<std::string> huge_pages{"2m"};
+    uint32_t repeat = 1;
+    bool syscalls = false;
+    bool json = false;
+    std::string out_path;
+};
+
+// one run's results, values are already JSON text (numbers, true/false or quoted strings)
+using row = std::vector<std::pair<std::string, std::string>>;
+
+const char *COLUMNS[] = {
+    "dir", "engine", "file_size", "cnt", "each", "thread_cnt", "buffer_kb", "sqpoll", "huge_pages", "run", "status",
+    "copies", "bytes", "elapsed_ns", "mb_per_sec", "p50_ns", "p99_ns", "p999_ns", "max_ns",
+    "user_us", "sys_us", "max_rss_kb", "vol_ctx", "invol_ctx", "syscalls", "io_uring_enter",
+};
+
+std::vector<std::string> split_list(std::string_view val)
+{
+    std::vector<std::string> out;
+    while (!val.empty())
+    {
+        std::string_view item = remove_before(val, ",");
+        if (!item.empty())
+            out.emplace_back(item);
+    }
+    return out;
+}
+
+// 4096, 64k, 1m, 2g
+bool parse_size(std::string_view str, uint64_t &bytes)
+{
+    uint64_t mult = 1;
+    if (!str.empty())
+    {
+        switch (str.back()) {
+        case 'k': case 'K': mult = 1024; break;
+        case 'm': case 'M': mult = 1024 * 1024; break;
+        case 'g': case 'G': mult = 1024 * 1024 * 1024; break;
+        };
+        if (mult > 1)
+            str.remove_suffix(1);
+    }
+    if (!aton(str, bytes))
+        return false;
+    bytes *= mult;
+    return bytes > 0;
+}
+
+// 64k,1m or MIN-MAX:N
+bool parse_sizes(std::string_view val, std::vector<uint64_t> &sizes)
+{
+    sizes.clear();
+    for (auto &item : split_list(val))
+    {
+        std::string_view spec(item);
+        if (spec.find('-') == std::string_view::npos)
+        {
+            uint64_t bytes = 0;
+            if (!parse_size(spec, bytes))
+                return false;
+            sizes.push_back(bytes);
+            continue;
+        }
+
+        std::string_view low = remove_before(spec, "-");
+        std::string_view high = remove_before(spec, ":");
+        uint64_t min = 0;
+        uint64_t max = 0;
+        uint32_t cnt = spec.empty() ? 2 : aton(spec);
+        if (!parse_size(low, min) || !parse_size(high, max) || min > max || cnt < 2)
+            return false;
+
+        double step = std::pow(static_cast<double>(max) / min, 1.0 / (cnt - 1));
+        for (uint32_t i = 0; i < cnt; i++)
+            sizes.push_back(i + 1 == cnt ? max : static_cast<uint64_t>(min * std::pow(step, i)));
+    }
+    return !sizes.empty();
+}
+
+bool make_dir(const std::string &dir)
+{
+    if (::mkdir(dir.c_str(), 0755) && errno != EEXIST)
+    {
+        ERROR << "mkdir " << dir << ": " << ::strerror(errno) << ENDL;
+        return false;
+    }
+    return true;
+}
+
+// random bytes so nothing along the way can shortcut zeros, left in place for the next bench run
+bool make_input(const std::string &path, uint64_t size)
+{
+    struct stat sb;
+    if (0 == ::stat(path.c_str(), &sb) && static_cast<uint64_t>(sb.st_size) == size)
+        return true;
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        ERROR << "open " << path << ": " << ::strerror(errno) << ENDL;
+        return false;
+    }
+
+    std::vector<uint64_t> block(64 * 1024 / sizeof(uint64_t));
+    uint64_t state = 0x9e3779b97f4a7c15ULL ^ size;
+    for (uint64_t done = 0; done < size;)
+    {
+        for (auto &word : block)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            word = state;
+        }
+        size_t len = std::min<uint64_t>(block.size() * sizeof(uint64_t), size - done);
+        ssize_t ret = ::write(fd, block.data(), len);
+        if (ret <= 0)
+        {
+            ERROR << "write " << path << ": " << ::strerror(errno) << ENDL;
+            ::close(fd);
+            return false;
+        }
+        done += ret;
+    }
+    ::close(fd);
+    return true;
+}
+
+// the flat one line objects copy_file_simple --report writes, key -> raw value text
+void parse_report(std::string_view line, row &out)
+{
+    line = line.substr(0, line.rfind('}'));
+    if (!line.empty() && line.front() == '{')
+        line.remove_prefix(1);
+    while (!line.empty())
+    {
+        std::string_view item = remove_before(line, ",");
+        std::string_view key = remove_before(item, ":");
+        if (key.size() >= 2 && key.front() == '"')
+            key = key.substr(1, key.size() - 2);
+        out.emplace_back(key, item);
+    }
+}
+
+// total and io_uring_enter call counts from strace -c output, the calls column is the 4th
+void parse_strace(const std::string &path, row &out)
+{
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> tokens;
+        std::string_view rest(line);
+        while (!rest.empty())
+        {
+            std::string_view tok = remove_before(rest, " ");
+            if (!tok.empty())
+                tokens.emplace_back(tok);
+        }
+        if (tokens.size() < 5)
+            continue;
+        if (tokens.back() == "total")
+            out.emplace_back("syscalls", tokens[3]);
+        else if (tokens.back() == "io_uring_enter")
+            out.emplace_back("io_uring_enter", tokens[3]);
+    }
+}
+
+std::string quoted(std::string_view str)
+{
+    return "\"" + std::string(str) + "\"";
+}
+
+std::string lookup(const row &r, std::string_view key)
+{
+    for (auto &[name, val] : r)
+    {
+        if (name == key)
+            return val;
+    }
+    return "";
+}
+
+void emit(int fd, const row &r, bool json)
+{
+    std::string line;
+    for (const char *col : COLUMNS)
+    {
+        std::string val = lookup(r, col);
+        if (json)
+        {
+            if (val.empty())
+                continue;
+            line.append(line.empty() ? "{" : ",").append(quoted(col)).append(":").append(val);
+        }
+        else
+        {
+            if (col != COLUMNS[0])
+                line.push_back(',');
+            if (val.size() >= 2 && val.front() == '"')
+                val = val.substr(1, val.size() - 2);
+            line.append(val);
+        }
+    }
+    line.append(json ? "}\n" : "\n");
+    if (::write(fd, line.data(), line.size()) < 0)
+        ERROR << "write: " << ::strerror(errno) << ENDL;
+}
+
+void emit_header(int fd)
+{
+    std::string line;
+    for (const char *col : COLUMNS)
+        line.append(line.empty() ? "" : ",").append(col);
+    line.push_back('\n');
+    if (::write(fd, line.data(), line.size()) < 0)
+        ERROR << "write: " << ::strerror(errno) << ENDL;
+}
+
+/**
+  Fork/exec one copy_file_simple run and wait for it, its output goes to dir/copy_bench.log.
+  Returns the exit status, -1 if it couldn't be started.
+  */
+int run_one(const sweep &cfg, const std::vector<std::string> &args, const std::string &dir)
+{
+    std::vector<std::string> argv_str;
+    if (cfg.syscalls)
+    {
+        argv_str = {"strace", "-f", "-c", "-o", dir + "/copy_bench.strace"};
+    }
+    argv_str.push_back(cfg.bin);
+    argv_str.insert(argv_str.end(), args.begin(), args.end());
+
+    std::vector<char*> argv;
+    for (auto &arg : argv_str)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    std::string log_path = dir + "/copy_bench.log";
+    pid_t pid = ::fork();
+    if (pid < 0)
+    {
+        ERROR << "fork: " << ::strerror(errno) << ENDL;
+        return -1;
+    }
+    if (0 == pid)
+    {
+        int fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            ::dup2(fd, STDOUT_FILENO);
+            ::dup2(fd, STDERR_FILENO);
+            ::close(fd);
+        }
+        ::execvp(argv[0], argv.data());
+        ::_exit(127);
+    }
+
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            ERROR << "waitpid: " << ::strerror(errno) << ENDL;
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+}
+
+int32_t main (int argc, char **argv)
+{
+    sweep cfg;
+
+    for (int i = 1; i < argc; i++)
+    {
+        auto[key, val] = split(argv[i], '=');
+        if (key == "--bin"sv)
+        {
+            cfg.bin = val;
+        }
+        else if (key == "--dirs"sv)
+        {
+            cfg.dirs = split_list(val);
+        }
+        else if (key == "--sizes"sv)
+        {
+            if (!parse_sizes(val, cfg.sizes))
+            {
+                ERROR << "--sizes wants sizes like 4096,64k,1m or MIN-MAX:N: " << val << ENDL;
+                return 1;
+            }
+        }
+        else if (key == "--cnt"sv)
+        {
+            cfg.cnts = split_list(val);
+        }
+        else if (key == "--each"sv)
+        {
+            cfg.eaches = split_list(val);
+        }
+        else if (key == "--thread-cnt"sv)
+        {
+            cfg.thread_cnts = split_list(val);
+        }
+        else if (key == "--buffer-kb"sv)
+        {
+            cfg.buffer_kbs = split_list(val);
+        }
+        else if (key == "--engines"sv)
+        {
+            cfg.engines = split_list(val);
+        }
+        else if (key == "--sqpoll"sv)
+        {
+            cfg.sqpolls = split_list(val);
+        }
+        else if (key == "--huge-pages"sv)
+        {
+            cfg.huge_pages = split_list(val);
+        }
+        else if (key == "--repeat"sv)
+        {
+            cfg.repeat = std::max<uint32_t>(aton(val), 1);
+        }
+        else if (key == "--syscalls"sv)
+        {
+            cfg.syscalls = (val == "true"sv);
+        }
+        else if (key == "--format"sv)
+        {
+            cfg.json = (val == "json"sv);
+        }
+        else if (key == "--out"sv)
+        {
+            cfg.out_path = val;
+        }
+        else if (key == "--debug"sv)
+        {
+            s_debug_level = aton(val);
+        }
+        else
+        {
+            ERROR << "unknown option: " << argv[i] << ENDL;
+            return 1;
+        }
+    }
+
+    int out_fd = STDOUT_FILENO;
+    if (!cfg.out_path.empty())
+    {
+        out_fd = ::open(cfg.out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0)
+        {
+            ERROR << "open " << cfg.out_path << ": " << ::strerror(errno) << ENDL;
+            return 1;
+        }
+    }
+    if (!cfg.json)
+        emit_header(out_fd);
+
+    uint32_t failures = 0;
+    for (auto &dir : cfg.dirs)
+    {
+        if (!make_dir(dir))
+            return 1;
+
+        std::string spool = dir + "/copy_bench.spool";
+        std::string report = dir + "/copy_bench.report";
+        for (uint64_t size : cfg.sizes)
+        {
+            std::string input = dir + "/copy_bench.in." + std::to_string(size);
+            if (!make_input(input, size))
+                return 1;
+
+            for (auto &engine : cfg.engines)
+            for (auto &cnt : cfg.cnts)
+            for (auto &each : cfg.eaches)
+            for (auto &threads : cfg.thread_cnts)
+            for (auto &buffer_kb : cfg.buffer_kbs)
+            for (auto &sqpoll : cfg.sqpolls)
+            for (auto &pages : cfg.huge_pages)
+            for (uint32_t run = 0; run < cfg.repeat; run++)
+            {
+                ::unlink(spool.c_str());
+                ::unlink(report.c_str());
+
+                std::vector<std::string> args = {
+                    "--input=" + input, "--output=" + spool, "--engine=" + engine, "--cnt=" + cnt, "--each=" + each,
+                    "--thread-cnt=" + threads, "--buffer-kb=" + buffer_kb, "--sqpoll=" + sqpoll,
+                    "--huge-pages=" + pages, "--report=" + report,
+                };
+
+                TRACE << "dir: " << dir << ", size: " << size << ", engine: " << engine << ", cnt: " << cnt << ", each: " << each
+                      << ", threads: " << threads << ", buffer kb: " << buffer_kb << ", sqpoll: " << sqpoll
+                      << ", pages: " << pages << ", run: " << run << ENDL;
+
+                int status = run_one(cfg, args, dir);
+
+                row r;
+                r.emplace_back("dir", quoted(dir));
+                r.emplace_back("run", std::to_string(run));
+                r.emplace_back("status", std::to_string(status));
+
+                std::ifstream in(report);
+                std::string line;
+                if (status == 0 && std::getline(in, line))
+                {
+                    parse_report(line, r);
+                }
+                else
+                {
+                    // keep the row so the failure shows up next to the runs that worked
+                    failures++;
+                    ERROR << "run failed, status: " << status << ", see " << dir << "/copy_bench.log" << ENDL;
+                    r.emplace_back("engine", quoted(engine));
+                    r.emplace_back("file_size", std::to_string(size));
+                    r.emplace_back("cnt", cnt);
+                    r.emplace_back("each", each);
+                    r.emplace_back("thread_cnt", threads);
+                    r.emplace_back("buffer_kb", buffer_kb);
+                    r.emplace_back("sqpoll", sqpoll);
+                    r.emplace_back("huge_pages", quoted(pages));
+                }
+                if (cfg.syscalls)
+                    parse_strace(dir + "/copy_bench.strace", r);
+
+                emit(out_fd, r, cfg.json);
+            }
+        }
+        ::unlink(spool.c_str());
+        ::unlink(report.c_str());
+    }
+
+    if (out_fd != STDOUT_FILENO)
+        ::close(out_fd);
+
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <aio.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "get_nanoseconds.h"
+#include "hash.h"
+#include "log.h"
+#include "spool.h"
+#include "time_tracker.h"
+
+/**
+  Baseline copy engines, the same workload as copy_file_simple's io_uring workers so the two can be compared:
+  copy N of the input lands at spool offset N * record_size as meta data, name, description then the file,
+  and each copy's start to finish time goes into the same time_tracker.
+
+     sync  a pool of threads * each threads doing blocking pread/pwrite, one copy at a time each,
+           the same number of copies in flight as the io_uring engine
+     aio   POSIX AIO (aio_read/aio_write/aio_suspend), each thread keeps each copies in flight
+     raw   each thread maps its own ring with the bare io_uring_setup/io_uring_enter syscalls, the way
+           copy_file.cc does, no liburing, but submitting in batches rather than entering once per SQE
+
+  All three drive the same copy_state, only how the reads and writes get issued differs.
+  Copies are handed out from one shared counter, there is no stealing to do.
+
+  O_DIRECT isn't used, spool records start at arbitrary offsets and O_DIRECT writes need block alignment.
+  glibc's POSIX AIO is itself a user space thread pool, which is part of what it is a baseline for.
+  */
+
+enum copy_engine_kind { ENGINE_URING, ENGINE_SYNC, ENGINE_AIO, ENGINE_RAW };
+
+inline const char* to_str(copy_engine_kind val)
+{
+    switch (val) {
+    case ENGINE_URING: return "uring";
+    case ENGINE_SYNC: return "sync";
+    case ENGINE_AIO: return "aio";
+    case ENGINE_RAW: return "raw";
+    };
+    return "UNHANDLED";
+}
+
+inline bool from_str(std::string_view str, copy_engine_kind &val)
+{
+    for (copy_engine_kind kind : {ENGINE_URING, ENGINE_SYNC, ENGINE_AIO, ENGINE_RAW})
+    {
+        if (str == to_str(kind))
+        {
+            val = kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+// what every copy shares
+struct copy_spec
+{
+    int input_fd = -1;
+    int spool_fd = -1;
+    uint64_t record_size = 0;
+    std::string_view file_name;
+    std::string_view file_desc;
+    size_t buffer_sz = 64 * 1024;
+    uint32_t cnt = 0;
+    uint32_t each = 1;
+    time_tracker *times = nullptr;
+    std::atomic<uint32_t> *remaining = nullptr; // counted down as copies finish, for the metrics
+};
+
+// the next I/O a copy wants
+struct copy_io
+{
+    enum kind { READ, WRITE, DONE };
+
+    kind op = DONE;
+    int fd = -1;
+    char *buf = nullptr;
+    size_t len = 0;
+    uint64_t off = 0;
+};
+
+/**
+  One copy as a state machine: read a buffer, write it, repeat until EOF, then write the meta data.
+  next() takes the result of the last I/O (bytes or -errno) and says what to do next,
+  short writes are continued, DONE ends it, failed() says how.
+  */
+class copy_state
+{
+public:
+    enum STATE { READING, WRITING, WRITING_META, COMPLETED, FAILED };
+
+    explicit copy_state(size_t buffer_sz)
+        : m_buffer(buffer_sz)
+    {
+    }
+
+    copy_io start(const copy_spec &spec, uint32_t index)
+    {
+        m_spec = &spec;
+        m_index = index;
+        m_state = READING;
+        m_in_off = 0;
+        m_hash = 0;
+        m_start_ns = get_nanoseconds();
+        return read();
+    }
+
+    copy_io next(int res)
+    {
+        if (res < 0 || (res == 0 && m_state != READING))
+        {
+            ERROR << "copy " << m_index << " failed: " << (res < 0 ? ::strerror(-res) : "wrote 0 bytes") << ENDL;
+            m_state = FAILED;
+            finished();
+            return copy_io{};
+        }
+
+        switch (m_state) {
+        case READING:
+            if (res == 0)
+                return write_meta();
+            m_hash = compute_hash(std::string_view(m_buffer.data(), res), m_hash);
+            m_state = WRITING;
+            m_write = copy_io{copy_io::WRITE, m_spec->spool_fd, m_buffer.data(), static_cast<size_t>(res), file_start() + m_in_off};
+            m_in_off += res;
+            return m_write;
+        case WRITING:
+        case WRITING_META:
+            if (static_cast<size_t>(res) < m_write.len)
+            {
+                m_write.buf += res;
+                m_write.len -= res;
+                m_write.off += res;
+                return m_write;
+            }
+            if (m_state == WRITING)
+                return read();
+            m_state = COMPLETED;
+            m_spec->times->add_delta(get_nanoseconds() - m_start_ns);
+            finished();
+            return copy_io{};
+        case COMPLETED:
+        case FAILED:
+            break;
+        };
+        return copy_io{};
+    }
+
+    bool failed() const { return m_state == FAILED; }
+
+private:
+    uint64_t record_start() const { return m_index * m_spec->record_size; }
+    uint64_t file_start() const { return record_start() + spool_header_size(m_spec->file_name, m_spec->file_desc); }
+
+    void finished()
+    {
+        if (m_spec->remaining)
+            (*m_spec->remaining)--;
+    }
+
+    copy_io read()
+    {
+        m_state = READING;
+        return copy_io{copy_io::READ, m_spec->input_fd, m_buffer.data(), m_buffer.size(), m_in_off};
+    }
+
+    copy_io write_meta()
+    {
+        file_meta_data meta;
+        meta.file_size = m_in_off;
+        meta.file_hash = m_hash;
+        meta.file_name_len = m_spec->file_name.size();
+        meta.file_desc_len = m_spec->file_desc.size();
+
+        // one write for all three parts, the io_uring engine issues three
+        spool_header(m_meta, meta, m_spec->file_name, m_spec->file_desc);
+
+        m_state = WRITING_META;
+        m_write = copy_io{copy_io::WRITE, m_spec->spool_fd, m_meta.data(), m_meta.size(), record_start()};
+        return m_write;
+    }
+
+private:
+    const copy_spec *m_spec = nullptr;
+    std::vector<char> m_buffer;
+    std::string m_meta;
+    copy_io m_write;
+    STATE m_state = COMPLETED;
+    uint32_t m_index = 0;
+    uint64_t m_in_off = 0;
+    uint64_t m_hash = 0;
+    uint64_t m_start_ns = 0;
+};
+
+// blocking pread/pwrite, one copy at a time per thread
+class sync_engine
+{
+public:
+    void run(const copy_spec &spec, std::atomic<uint32_t> &next)
+    {
+        copy_state copy(spec.buffer_sz);
+        for (uint32_t index = next++; index < spec.cnt; index = next++)
+        {
+            copy_io io = copy.start(spec, index);
+            while (io.op != copy_io::DONE)
+            {
+                ssize_t ret = io.op == copy_io::READ ?
+                    ::pread(io.fd, io.buf, io.len, io.off) :
+                    ::pwrite(io.fd, io.buf, io.len, io.off);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                io = copy.next(ret < 0 ? -errno : ret);
+            }
+            m_failed += copy.failed();
+        }
+    }
+
+    uint32_t failed() const { return m_failed; }
+
+private:
+    uint32_t m_failed = 0;
+};
+
+// POSIX AIO, up to each copies in flight, aio_suspend waits for any of them
+class aio_engine
+{
+public:
+    void run(const copy_spec &spec, std::atomic<uint32_t> &next)
+    {
+        struct slot
+        {
+            explicit slot(size_t buffer_sz) : copy(buffer_sz) {}
+            copy_state copy;
+            aiocb cb{};
+            bool busy = false;
+        };
+
+        std::vector<std::unique_ptr<slot>> slots;
+        for (uint32_t i = 0; i < spec.each; i++)
+            slots.emplace_back(new slot(spec.buffer_sz));
+        std::vector<const aiocb*> waiting;
+
+        bool more = true;
+        while (true)
+        {
+            waiting.clear();
+            for (auto &sl : slots)
+            {
+                if (!sl->busy && more)
+                {
+                    uint32_t index = next++;
+                    if (index >= spec.cnt)
+                        more = false;
+                    else
+                        sl->busy = issue(*sl, sl->copy.start(spec, index));
+                }
+                if (sl->busy)
+                    waiting.push_back(&sl->cb);
+            }
+            if (waiting.empty())
+                break;
+
+            if (::aio_suspend(waiting.data(), waiting.size(), nullptr) && errno != EINTR)
+            {
+                ERROR << "aio_suspend: " << ::strerror(errno) << ENDL;
+                return;
+            }
+
+            for (auto &sl : slots)
+            {
+                if (!sl->busy)
+                    continue;
+                int err = ::aio_error(&sl->cb);
+                if (err == EINPROGRESS)
+                    continue;
+                ssize_t ret = ::aio_return(&sl->cb);
+                sl->busy = issue(*sl, sl->copy.next(err ? -err : ret));
+            }
+        }
+    }
+
+    uint32_t failed() const { return m_failed; }
+
+private:
+    template<typename SLOT>
+    bool issue(SLOT &sl, const copy_io &io)
+    {
+        if (io.op == copy_io::DONE)
+        {
+            m_failed += sl.copy.failed();
+            return false;
+        }
+
+        sl.cb = aiocb{};
+        sl.cb.aio_fildes = io.fd;
+        sl.cb.aio_buf = io.buf;
+        sl.cb.aio_nbytes = io.len;
+        sl.cb.aio_offset = io.off;
+        int ret = io.op == copy_io::READ ? ::aio_read(&sl.cb) : ::aio_write(&sl.cb);
+        if (ret)
+        {
+            ERROR << "aio submit: " << ::strerror(errno) << ENDL;
+            return issue(sl, sl.copy.next(-errno));
+        }
+        return true;
+    }
+
+    uint32_t m_failed = 0;
+};
+
+/**
+  The bare syscall ring from copy_file.cc cleaned up: io_uring_setup, mmap the SQ/CQ rings and the SQE array,
+  fill SQEs and publish the tail with a release store, io_uring_enter to submit and wait, read CQEs up to
+  the acquire loaded tail and release the new head.
+  */
+class raw_ring
+{
+public:
+    explicit raw_ring(uint32_t entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_ring_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (m_ring_fd < 0)
+        {
+            ERROR << "io_uring_setup: " << ::strerror(errno) << ENDL;
+            return;
+        }
+
+        m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_len = m_cq_len = std::max(m_sq_len, m_cq_len);
+
+        m_sq_ptr = map(m_sq_len, IORING_OFF_SQ_RING);
+        m_cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq_ptr : map(m_cq_len, IORING_OFF_CQ_RING);
+        m_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(static_cast<void*>(map(m_sqes_len, IORING_OFF_SQES)));
+        if (!m_sq_ptr || !m_cq_ptr || !m_sqes)
+            return;
+
+        m_sq_tail = reinterpret_cast<unsigned*>(m_sq_ptr + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned*>(m_sq_ptr + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned*>(m_sq_ptr + params.sq_off.array);
+        m_sq_entries = params.sq_entries;
+        m_cq_head = reinterpret_cast<unsigned*>(m_cq_ptr + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(m_cq_ptr + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned*>(m_cq_ptr + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(m_cq_ptr + params.cq_off.cqes);
+        m_local_tail = *m_sq_tail;
+        m_valid = true;
+    }
+
+    ~raw_ring()
+    {
+        if (m_sqes)
+            ::munmap(m_sqes, m_sqes_len);
+        if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+            ::munmap(m_cq_ptr, m_cq_len);
+        if (m_sq_ptr)
+            ::munmap(m_sq_ptr, m_sq_len);
+        if (m_ring_fd >= 0)
+            ::close(m_ring_fd);
+    }
+
+    bool is_valid() const { return m_valid; }
+
+    // queue a read or write, it goes to the kernel on the next enter()
+    bool push(const copy_io &io, uint64_t user_data)
+    {
+        if (m_local_tail - m_submitted_tail >= m_sq_entries)
+            return false;
+
+        unsigned idx = m_local_tail & m_sq_mask;
+        io_uring_sqe *sqe = &m_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = io.op == copy_io::READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = io.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(io.buf);
+        sqe->len = io.len;
+        sqe->off = io.off;
+        sqe->user_data = user_data;
+        m_sq_array[idx] = idx;
+        m_local_tail++;
+        return true;
+    }
+
+    // submit everything pushed and wait for at least min_complete CQEs
+    int enter(uint32_t min_complete)
+    {
+        unsigned to_submit = m_local_tail - m_submitted_tail;
+        std::atomic_ref<unsigned>(*m_sq_tail).store(m_local_tail, std::memory_order_release);
+        while (true)
+        {
+            long ret = ::syscall(__NR_io_uring_enter, m_ring_fd, to_submit, min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0)
+            {
+                m_submitted_tail += ret;
+                return ret;
+            }
+            if (errno != EINTR)
+            {
+                ERROR << "io_uring_enter: " << ::strerror(errno) << ENDL;
+                return -errno;
+            }
+        }
+    }
+
+    // fn(user_data, res) for every CQE ready
+    template<typename FN>
+    uint32_t reap(FN fn)
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = std::atomic_ref<unsigned>(*m_cq_tail).load(std::memory_order_acquire);
+        uint32_t cnt = 0;
+        for (; head != tail; head++, cnt++)
+        {
+            io_uring_cqe *cqe = &m_cqes[head & m_cq_mask];
+            fn(cqe->user_data, cqe->res);
+        }
+        std::atomic_ref<unsigned>(*m_cq_head).store(head, std::memory_order_release);
+        return cnt;
+    }
+
+private:
+    char* map(size_t len, off_t what)
+    {
+        void *ptr = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, what);
+        if (ptr == MAP_FAILED)
+        {
+            ERROR << "mmap ring: " << ::strerror(errno) << ENDL;
+            return nullptr;
+        }
+        return static_cast<char*>(ptr);
+    }
+
+private:
+    int m_ring_fd = -1;
+    bool m_valid = false;
+    char *m_sq_ptr = nullptr;
+    char *m_cq_ptr = nullptr;
+    size_t m_sq_len = 0;
+    size_t m_cq_len = 0;
+    size_t m_sqes_len = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    unsigned *m_sq_tail = nullptr;
+    unsigned *m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned *m_cq_head = nullptr;
+    unsigned *m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+    unsigned m_local_tail = 0;      // SQEs pushed
+    unsigned m_submitted_tail = 0;  // SQEs the kernel has taken
+};
+
+// each copies in flight on a raw_ring per thread, user_data is the slot index
+class raw_engine
+{
+public:
+    void run(const copy_spec &spec, std::atomic<uint32_t> &next)
+    {
+        raw_ring ring(std::max<uint32_t>(spec.each, 2));
+        if (!ring.is_valid())
+        {
+            m_failed++;
+            return;
+        }
+
+        std::vector<std::unique_ptr<copy_state>> slots;
+        for (uint32_t i = 0; i < spec.each; i++)
+            slots.emplace_back(new copy_state(spec.buffer_sz));
+
+        uint32_t inflight = 0;
+        auto issue = [&](uint32_t slot, const copy_io &io) {
+            if (io.op == copy_io::DONE)
+            {
+                m_failed += slots[slot]->failed();
+                return false;
+            }
+            // one op per slot and as many SQEs as slots, there is always room
+            ring.push(io, slot);
+            inflight++;
+            return true;
+        };
+
+        for (uint32_t slot = 0; slot < slots.size(); slot++)
+        {
+            uint32_t index = next++;
+            if (index < spec.cnt)
+                issue(slot, slots[slot]->start(spec, index));
+        }
+
+        while (inflight)
+        {
+            if (ring.enter(1) < 0)
+                return;
+
+            ring.reap([&](uint64_t slot, int res) {
+                inflight--;
+                if (issue(slot, slots[slot]->next(res)))
+                    return;
+                uint32_t index = next++;
+                if (index < spec.cnt)
+                    issue(slot, slots[slot]->start(spec, index));
+            });
+        }
+    }
+
+    uint32_t failed() const { return m_failed; }
+
+private:
+    uint32_t m_failed = 0;
+};
+
+/**
+  Run cnt copies on one of the baseline engines with thread_cnt threads (threads * each for sync).
+  Returns how many copies failed.
+  */
+inline uint32_t run_copy_engine(copy_engine_kind kind, const copy_spec &spec, uint32_t thread_cnt)
+{
+    std::atomic<uint32_t> next{0};
+    std::atomic<uint32_t> failed{0};
+
+    auto run = [&](auto engine) {
+        engine.run(spec, next);
+        failed += engine.failed();
+    };
+
+    uint32_t threads = kind == ENGINE_SYNC ? thread_cnt * spec.each : thread_cnt;
+    std::vector<std::thread> pool;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        switch (kind) {
+        case ENGINE_SYNC: pool.emplace_back(run, sync_engine()); break;
+        case ENGINE_AIO: pool.emplace_back(run, aio_engine()); break;
+        case ENGINE_RAW: pool.emplace_back(run, raw_engine()); break;
+        case ENGINE_URING: break;
+        };
+    }
+    for (auto &thrd : pool)
+        thrd.join();
+
+    return failed;
+}
@@ -1,12 +1,18 @@
+#include "arena.h"
+#include "buffer_arena.h"
 #include "commas.h"
+#include "copy_engines.h"
+#include "cpu_placement.h"
 #include "get_nanoseconds.h"
 #include "hash.h"
 #include "io_uring_wrapper.h"
 #include "log.h"
+#include "metrics.h"
 #include "misc.h"
 #include "scoped_lock.h"
 #include "string_view.h"
 #include "time_tracker.h"
+#include "work_stealing_deque.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -15,9 +21,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <iostream>
 #include <string>
@@ -28,37 +37,22 @@
 using std::string, std::string_view, std::vector;
 using namespace std::literals;
 
-#define BUFFER_SZ 64 * 1024
+size_t s_buffer_sz = 64 * 1024; // per copy read/write size, --buffer-kb
 
 
-time_tracker s_times(10000);
+time_tracker s_times;
 
-/**
- A fixed length meta data written before each file
- Between the fixed length data and the file data we write variable 
- length vals like file name and description
-  */
-struct file_meta_data
-{
-public:
-    uint64_t file_size = 0;
-    uint64_t file_hash = 0;
-    time_t   write_time = 0;
-    uint16_t file_name_len = 0;
-    uint16_t file_desc_len = 0;
-    // some room built into the fixed length buffer for future uses like tags
-    uint16_t future_1_len = 0;
-    uint16_t future_2_len = 0;
-    uint16_t future_3_len = 0;
-    uint16_t future_4_len = 0;
-};
+class copy_worker;
 
 class client_request
 {
 private:
+    static constexpr log_module s_log_module = LOG_COPY;
+
     enum STATE {READING_CLIENT_INPUT, WRITING_TO_FILE, WRITING_META, COMPLETED, FAILED};
     STATE m_state = READING_CLIENT_INPUT;
-    char m_buffer[BUFFER_SZ];
+    char *m_buffer = nullptr; // s_buffer_sz slot from the worker's buffer_arena
+    int m_buf_index = -1;     // fixed buffer index of m_buffer, -1 when the arena isn't registered
     off_t m_offset = 0;
     off_t m_output_offset = 0;
     uint64_t m_bytes_written = 0;
@@ -66,28 +60,59 @@ private:
     int  m_output_fd = -1;
     uint32_t m_index = 0;
     io_uring_wrapper<client_request> *m_file_uring = nullptr;
+    copy_worker *m_worker = nullptr;
+    uint32_t m_inflight = 0; // SQEs we are still waiting on, can't be recycled until 0
     uint64_t m_start_ns = 0;
     uint64_t m_end_ns = 0;
 
     file_meta_data m_meta;
-    std::string m_file_name;
-    std::string m_file_desc;
+    std::string_view m_file_name; // interned in the worker's arena
+    std::string_view m_file_desc;
     uint64_t m_meta_bytes_to_write = 0;
 
     uint64_t meta_size() const { return sizeof(file_meta_data) + m_file_name.size() + m_file_desc.size(); } 
     uint64_t file_start() const { return m_output_offset + meta_size(); }
 
+    void finish(STATE state);
+
+    bool done() const { return m_state == COMPLETED || m_state == FAILED; }
+
+    bool prep_read()
+    {
+        bool ok = m_buf_index < 0 ?
+            m_file_uring->prep_read(m_input_fd, m_buffer, s_buffer_sz, m_offset, this) :
+            m_file_uring->prep_read_fixed(m_input_fd, m_buffer, s_buffer_sz, m_offset, m_buf_index, this);
+        m_inflight += ok;
+        return ok;
+    }
+
+    // buf_index only for writes out of m_buffer, the meta data isn't in the registered arena
+    bool prep_write(const char *buffer, size_t len, off_t offset, int buf_index = -1)
+    {
+        bool ok = buf_index < 0 ?
+            m_file_uring->prep_write(m_output_fd, buffer, len, offset, this) :
+            m_file_uring->prep_write_fixed(m_output_fd, buffer, len, offset, buf_index, this);
+        m_inflight += ok;
+        return ok;
+    }
+
 public:
     client_request(std::string_view file_name,
                    std::string_view file_desc,
                    int input_fd,
                    uint32_t index,
                    io_uring_wrapper<client_request> *file_uring,
+                   copy_worker *worker,
+                   char *buffer,
+                   int buf_index,
                    int output_fd = -1,
                    off_t output_offset = 0)
-        : m_input_fd(dup(input_fd)),
+        : m_buffer(buffer),
+          m_buf_index(buf_index),
+          m_input_fd(input_fd), // reads are positioned, every copy can share the one fd
           m_index(index),
           m_file_uring(file_uring),
+          m_worker(worker),
           m_output_fd(output_fd),
           m_output_offset(output_offset),
           m_file_name(file_name),
@@ -96,13 +121,32 @@ public:
         m_start_ns = get_nanoseconds();
     }
 
+    // false when the first read couldn't be prepped, the copy is FAILED then with nothing in flight
     bool start_io_uring()
     {
         m_state = READING_CLIENT_INPUT;
-        return m_file_uring && m_file_uring->prep_read(m_input_fd, m_buffer, BUFFER_SZ, m_offset, this);
+        if (m_file_uring && prep_read())
+            return true;
+        finish(FAILED);
+        return false;
     }
 
     uint32_t process_io_uring(int res)
+    {
+        m_inflight--;
+        uint32_t events = process_result(res);
+
+        // last use of this, the slot may be handed to a new copy right away
+        if (done() && !m_inflight)
+            recycle();
+
+        return events;
+    }
+
+private:
+    void recycle();
+
+    uint32_t process_result(int res)
     {
         if (!m_file_uring)
             return 0;
@@ -112,32 +156,28 @@ public:
             switch (m_state) {
             case READING_CLIENT_INPUT:
                 // Read successful. Write to stdout.
-                DEBUG(2) << "writing " << res << " bytes to m_output_fd: " << m_output_fd << ENDL;
+                DEBUGF(2, "writing {} bytes to m_output_fd: {}", res, m_output_fd);
 
                 m_meta.file_hash = compute_hash(std::string_view(m_buffer, res), m_meta.file_hash);
 
                 // could be writing to a spool or similar so have to pass the exact offset to write at instead of just -1 for the end
-                m_file_uring->prep_write(m_output_fd,
-                                         m_buffer,
-                                         res,
-                                         file_start() + m_offset,
-                                         this);
+                prep_write(m_buffer, res, file_start() + m_offset, m_buf_index);
                 m_state = WRITING_TO_FILE;
                 m_offset += res;
                 break;
             case WRITING_TO_FILE:
                 m_bytes_written += res;
-                DEBUG(2) << "reading up to " << BUFFER_SZ << " bytes from m_input_fd: " << m_input_fd << ENDL;
-                m_file_uring->prep_read(m_input_fd, m_buffer, BUFFER_SZ, m_offset, this);
+                DEBUGF(2, "reading up to {} bytes from m_input_fd: {}", s_buffer_sz, m_input_fd);
+                prep_read();
                 m_state = READING_CLIENT_INPUT;
                 break;
             case WRITING_META:
                 m_meta_bytes_to_write -= res;
                 if (0 == m_meta_bytes_to_write)
                 {
-                    m_state = COMPLETED;
                     m_end_ns = get_nanoseconds();
                     s_times.add_delta(m_end_ns - m_start_ns);
+                    finish(COMPLETED);
                 }
                 return 0; // no new events so ret 0
             };
@@ -149,7 +189,7 @@ public:
             case READING_CLIENT_INPUT:
             {
                 // reached EOF
-                DEBUG(2) << "EOF for m_input_fd: " << m_input_fd << ", bytes written: " << m_bytes_written << ", starting meta data, hash: " << m_meta.file_hash << ENDL;
+                DEBUGF(2, "EOF for m_input_fd: {}, bytes written: {}, starting meta data, hash: {}", m_input_fd, m_bytes_written, m_meta.file_hash);
                 // no more data to read, start writing the meta data
                 // should we combine meta parts into single buffer and write once or issue N prep_writes??
                 m_meta.file_size = m_bytes_written;
@@ -160,17 +200,17 @@ public:
 
                 
                 // write file meta struct
-                m_file_uring->prep_write(m_output_fd, (char*)&m_meta, sizeof(m_meta), off_set, this);
+                prep_write((char*)&m_meta, sizeof(m_meta), off_set);
                 off_set += sizeof(m_meta);
                 m_meta_bytes_to_write += sizeof(m_meta);
 
                 // write file name
-                m_file_uring->prep_write(m_output_fd, m_file_name.data(), m_file_name.size(), off_set, this);
+                prep_write(m_file_name.data(), m_file_name.size(), off_set);
                 off_set += m_file_name.size();
                 m_meta_bytes_to_write += m_file_name.size();
 
                 // write file desc
-                m_file_uring->prep_write(m_output_fd, m_file_desc.data(), m_file_desc.size(), off_set, this);
+                prep_write(m_file_desc.data(), m_file_desc.size(), off_set);
                 m_meta_bytes_to_write += m_file_desc.size();
 
                 m_state = WRITING_META;
@@ -179,12 +219,12 @@ public:
             }
             case WRITING_TO_FILE:
                 ERROR << "Failed writing to file: res == 0" << ENDL;
-                m_state = FAILED;
+                finish(FAILED);
                 break;
 
             case WRITING_META:
                 ERROR << "Failed writing meta data: res == 0" << ENDL;
-                m_state = FAILED;
+                finish(FAILED);
                 break;
             };
 
@@ -194,66 +234,437 @@ public:
         {
             // Error reading file
             ERROR << ::strerror(abs(res)) << ENDL;
-            m_state = FAILED;
+            finish(FAILED);
             return 0;
         }
         return 0;
     }
 
+public:
     char* buffer() { return m_buffer; }
 };
 
-void uring_thread(uint32_t cnt,
-                  uint32_t each,
-                  const char* file_name,
-                  const char* file_desc,
-                  uint64_t file_size,
-                  int input_fd,
-                  int spool_fd,
-                  uint64_t block_offset)
+/**
+  State shared by all the copy threads.
+
+  Copy N lands at spool offset N * record_size, so any thread can run any copy
+  and the spool layout doesn't depend on who ran what.
+  */
+struct copy_scheduler
 {
-    uint64_t start = get_nanoseconds();
+    uint32_t each = 25;
+    const char *file_name = nullptr;
+    const char *file_desc = nullptr;
+    uint64_t file_size = 0;
+    uint64_t record_size = 0;
+    int input_fd = -1;
+    int spool_fd = -1;
+    bool sqpoll = false;
+    bool io_stats = false;
+    buffer_arena::page_kind pages = buffer_arena::HUGE_2M;
 
-    // 100 total file copies takes around .14 seconds
-    // 200 increases it to .34 seconds, more than double
-    // 300 takes it to .57 seconds
-    // 400 takes around .75 seconds, seems like congestion slows things down
+    std::vector<copy_worker*> workers;
+    std::atomic<uint32_t> remaining{0}; // copies not finished yet, across all threads
+    std::atomic<uint32_t> failed{0};    // finished with an error
+};
 
-    io_uring_wrapper<client_request> file_uring(cnt * 10);
-    if (!file_uring.is_valid())
+/**
+  One per thread, owns a ring plus a deque of copy indexes that have not been started.
+
+  The worker starts copies from the bottom of its own deque, keeping up to <each> in flight.
+  When it runs dry it steals from the top of the other workers' deques.
+  If there is nothing to steal it parks in wait_events() on its own ring,
+  whoever queues more work (or finishes the last copy) wakes it with a MSG_RING.
+
+  The deque has a fixed capacity, the rest of the worker's range [m_next, m_last)
+  is pushed as the deque drains, so memory stays bounded for large --cnt values.
+  A worker that can't get its ring or buffers leaves its range to the others, they claim it a copy at a time.
+  */
+class copy_worker
+{
+public:
+    // what other threads (the metrics exporter) may look at, published once per pass of the run loop
+    struct gauges
     {
-        return;
+        std::atomic<uint64_t> copies{0};
+        std::atomic<uint64_t> stolen{0};
+        std::atomic<uint32_t> active{0};
+        std::atomic<uint32_t> buffers_in_use{0};
+        std::atomic<uint32_t> buffer_slots{0};
+    };
+
+    copy_worker(copy_scheduler *sched, uint32_t id, uint32_t first, uint32_t last, const thread_placement &placement)
+        : m_sched(sched),
+          m_id(id),
+          m_next(first),
+          m_last(last),
+          m_jobs(std::max<uint32_t>(sched->each * 4, 256)),
+          m_placement(placement)
+    {
+        // owned here rather than by the ring so it can be read before the ring exists and after it is gone
+        if (sched->io_stats)
+            m_io_stats = std::make_unique<io_uring_stats>();
     }
 
-    if (0 > spool_fd)
+    uint32_t id() const { return m_id; }
+    const gauges& published() const { return m_gauges; }
+    const io_uring_stats* io_stats() const { return m_io_stats.get(); }
+
+    void run()
     {
-        ERROR << "spool_fd is invalid: " << spool_fd << ENDL;
-        return;
+        // 100 total file copies takes around .14 seconds
+        // 200 increases it to .34 seconds, more than double
+        // 300 takes it to .57 seconds
+        // 400 takes around .75 seconds, seems like congestion slows things down
+
+        // pin before the ring and the request buffers exist so their pages come from our node
+        apply_placement(m_placement);
+
+        io_uring_wrapper<client_request> file_uring(m_sched->each * 10, m_sched->sqpoll, m_placement.sq_cpu);
+        if (file_uring.is_valid() && m_placement.pinned())
+        {
+            file_uring.set_iowq_affinity(m_placement.cpus);
+        }
+        if (m_io_stats)
+        {
+            file_uring.enable_stats(m_io_stats.get());
+        }
+
+        // one s_buffer_sz slot per copy in flight, registered with the ring in one go
+        buffer_arena buffers(s_buffer_sz, m_sched->each, m_sched->pages, m_placement.node);
+        if (file_uring.is_valid() && buffers.is_valid())
+        {
+            buffers.register_with(file_uring);
+        }
+
+        if (!file_uring.is_valid() || !buffers.is_valid() || 0 > m_sched->spool_fd)
+        {
+            ERROR << "worker " << m_id << " can't run, leaving " << m_last - m_next << " copies to the others" << ENDL;
+            // nobody parks while has_work() says our range isn't done, so there's no one to wake
+            m_orphaned.store(true, std::memory_order_release);
+            return;
+        }
+
+        m_file_uring = &file_uring;
+        m_buffers = &buffers;
+        m_ring_fd = file_uring.ring_fd();
+
+        // every copy shares these, keep one copy per thread instead of two std::strings per request
+        m_file_name = m_strings.intern(m_sched->file_name);
+        m_file_desc = m_strings.intern(m_sched->file_desc);
+
+        while (true)
+        {
+            publish();
+            refill();
+
+            uint32_t index = 0;
+            bool started = false;
+            // failed copies can hold their buffer a little past copy_done, so check the arena too
+            while (m_active < m_sched->each && m_buffers->in_use() < m_buffers->slot_cnt() && take(index))
+            {
+                start_copy(index);
+                started = true;
+            }
+
+            if (started)
+                file_uring.submit();
+
+            // failed copies can still have writes in flight after they are counted as done
+            if (m_active || file_uring.pending())
+            {
+                file_uring.process_events();
+                continue;
+            }
+
+            if (0 == m_sched->remaining)
+                break;
+
+            park();
+        }
+
+        TRACE << "worker " << m_id << " done, node: " << m_placement.node << ", copies: " << m_copies << ", stolen: " << m_stolen << ", messages: " << file_uring.messages()
+              << ", request slots: " << m_requests.capacity() << ", resident: " << commas(m_requests.resident_bytes() + m_strings.resident_bytes())
+              << ", buffer pages: " << buffer_arena::to_str(buffers.kind()) << (buffers.registered() ? " registered" : "")
+              << ", buffer bytes: " << commas(buffers.bytes()) << ENDL;
+        publish();
+
+        if (m_requests.in_use())
+        {
+            // shouldn't happen, we don't leave the loop while the ring has anything pending
+            ERROR << "worker " << m_id << " exiting with " << m_requests.in_use() << " requests in use" << ENDL;
+        }
+
+        m_ring_fd = -1;
+        m_file_uring = nullptr;
+        m_buffers = nullptr;
+    }
+
+    bool steal(uint32_t &index)
+    {
+        if (m_jobs.steal(index))
+            return true;
+        if (!m_orphaned.load(std::memory_order_acquire))
+            return false;
+
+        // our run() is gone, any thread takes the range straight from m_next
+        uint32_t next = m_next.load();
+        while (next < m_last)
+        {
+            if (m_next.compare_exchange_weak(next, next + 1))
+            {
+                index = next;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // all of req's I/O has completed, its slot can be reused
+    void recycle(client_request *req)
+    {
+        m_buffers->release(req->buffer());
+        m_requests.release(req);
+    }
+
+    bool has_work() const { return m_jobs.size() || m_next < m_last; }
+
+    void copy_done(bool failed)
+    {
+        m_active--;
+        if (failed)
+            m_sched->failed++;
+        if (1 == m_sched->remaining--)
+        {
+            // that was the last copy anywhere, let the parked workers exit
+            wake_parked();
+        }
+    }
+
+private:
+    static constexpr log_module s_log_module = LOG_COPY;
+
+    // push more of our range into the deque, the owner is the only thread allowed to push
+    void refill()
+    {
+        if (m_next == m_last || m_jobs.size() >= m_sched->each)
+            return;
+
+        bool pushed = false;
+        while (m_next < m_last && m_jobs.push(m_next))
+        {
+            m_next++;
+            pushed = true;
+        }
+
+        if (pushed)
+            wake_parked();
+    }
+
+    bool take(uint32_t &index)
+    {
+        if (m_jobs.pop(index))
+            return true;
+
+        if (m_next < m_last)
+        {
+            index = m_next++;
+            return true;
+        }
+
+        size_t cnt = m_sched->workers.size();
+        for (size_t i = 1; i < cnt; i++)
+        {
+            copy_worker *victim = m_sched->workers[(m_id + i) % cnt];
+            if (victim->steal(index))
+            {
+                m_stolen++;
+                return true;
+            }
+        }
+        return false;
     }
 
-    off_t output_offset = block_offset;
+    void start_copy(uint32_t index)
+    {
+        char *buffer = m_buffers->acquire();
+        client_request *req = m_requests.create(m_file_name,
+                                                m_file_desc,
+                                                m_sched->input_fd,
+                                                index,
+                                                m_file_uring,
+                                                this,
+                                                buffer,
+                                                m_buffers->buf_index(buffer),
+                                                m_sched->spool_fd,
+                                                index * m_sched->record_size);
+        m_active++;
+        m_copies++;
+        if (!req->start_io_uring())
+        {
+            // no completion is coming to recycle it, finish() already counted it done
+            ERROR << "copy " << index << " failed: can't prep its first read" << ENDL;
+            recycle(req);
+        }
+    }
 
-    vector<client_request*> requests;
+    void publish()
+    {
+        m_gauges.copies.store(m_copies, std::memory_order_relaxed);
+        m_gauges.stolen.store(m_stolen, std::memory_order_relaxed);
+        m_gauges.active.store(m_active, std::memory_order_relaxed);
+        m_gauges.buffers_in_use.store(m_buffers->in_use(), std::memory_order_relaxed);
+        m_gauges.buffer_slots.store(m_buffers->slot_cnt(), std::memory_order_relaxed);
+    }
 
-    while (requests.size() != cnt)
+    void park()
     {
-        for (uint32_t i = 0; i < each && requests.size() < cnt; i++)
+        m_parked = true;
+        // pairs with the fence in wake_parked, either we see their work or they see us parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        for (copy_worker *worker : m_sched->workers)
         {
-            requests.push_back(new client_request(file_name, file_desc, input_fd, requests.size(), &file_uring, spool_fd, output_offset));
-            requests.back()->start_io_uring();
-            if (spool_fd != -1)
+            if (worker->has_work())
             {
-                output_offset += file_size;
+                m_parked = false;
+                return;
             }
         }
 
-        file_uring.submit();
+        if (0 == m_sched->remaining)
+        {
+            m_parked = false;
+            return;
+        }
+
+        DEBUG(2) << "worker " << m_id << " parking" << ENDL;
+        m_file_uring->wait_events();
+        m_parked = false;
+    }
 
-        while (file_uring.pending())
+    void wake_parked()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool sent = false;
+        for (copy_worker *worker : m_sched->workers)
         {
-            file_uring.process_events();
+            if (worker != this && worker->m_parked.exchange(false))
+            {
+                sent = m_file_uring->prep_wakeup(worker->m_ring_fd) || sent;
+            }
         }
+
+        if (sent)
+            m_file_uring->submit();
     }
+
+private:
+    copy_scheduler *m_sched = nullptr;
+    uint32_t m_id = 0;
+    std::atomic<uint32_t> m_next{0};
+    uint32_t m_last = 0;
+    work_stealing_deque<uint32_t> m_jobs;
+    thread_placement m_placement;
+    io_uring_wrapper<client_request> *m_file_uring = nullptr;
+    buffer_arena *m_buffers = nullptr;
+    std::atomic<int> m_ring_fd{-1};
+    std::atomic<bool> m_parked{false};
+    std::atomic<bool> m_orphaned{false}; // run() gave up, see steal()
+    slab_pool<client_request> m_requests;
+    string_arena m_strings;
+    std::string_view m_file_name;
+    std::string_view m_file_desc;
+    uint32_t m_active = 0; // copies in flight on our ring
+    uint64_t m_copies = 0;
+    uint64_t m_stolen = 0;
+    gauges m_gauges;
+    std::unique_ptr<io_uring_stats> m_io_stats;
+};
+
+// copy_*, what the copy engine has done so far, for the metrics exporter
+void append_copy_metrics(const copy_scheduler &sched, uint64_t file_size, std::string &out)
+{
+    hdr_histogram times = s_times.snapshot();
+
+    metric_header(out, "copy_done_total", "counter", "copies finished");
+    metric_value(out, "copy_done_total", "", times.total());
+    metric_header(out, "copy_bytes_total", "counter", "file bytes copied");
+    metric_value(out, "copy_bytes_total", "", times.total() * file_size);
+    metric_header(out, "copy_remaining", "gauge", "copies not finished yet");
+    metric_value(out, "copy_remaining", "", sched.remaining.load(std::memory_order_relaxed));
+    metric_header(out, "copy_latency_ns", "summary", "start to finish of one copy");
+    metric_summary(out, "copy_latency_ns", "", times);
+
+    auto per_worker = [&](std::string_view name, std::string_view type, std::string_view help, auto get) {
+        metric_header(out, name, type, help);
+        for (auto worker : sched.workers)
+            metric_value(out, name, "worker=\"" + std::to_string(worker->id()) + "\"", get(worker->published()));
+    };
+    per_worker("copy_worker_active", "gauge", "copies in flight on the worker's ring",
+               [](const copy_worker::gauges &g) { return g.active.load(std::memory_order_relaxed); });
+    per_worker("copy_worker_started_total", "counter", "copies the worker started",
+               [](const copy_worker::gauges &g) { return g.copies.load(std::memory_order_relaxed); });
+    per_worker("copy_worker_stolen_total", "counter", "copies the worker stole from others",
+               [](const copy_worker::gauges &g) { return g.stolen.load(std::memory_order_relaxed); });
+    per_worker("copy_buffers_in_use", "gauge", "buffer arena slots in use",
+               [](const copy_worker::gauges &g) { return g.buffers_in_use.load(std::memory_order_relaxed); });
+    per_worker("copy_buffers", "gauge", "buffer arena slots",
+               [](const copy_worker::gauges &g) { return g.buffer_slots.load(std::memory_order_relaxed); });
+}
+
+/**
+  One JSON object per run appended to path, for copy_bench and anything else comparing runs:
+  the run's settings, what got copied, throughput, latency percentiles and our own rusage.
+  */
+void write_report(const std::string &path, const std::string &config, uint64_t file_size, uint64_t elapsed_ns)
+{
+    hdr_histogram times = s_times.snapshot();
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+
+    auto field = [](std::string &out, std::string_view name, uint64_t val) {
+        out.append(",\"").append(name).append("\":").append(std::to_string(val));
+    };
+
+    std::string line = "{" + config;
+    field(line, "file_size", file_size);
+    field(line, "copies", times.total());
+    field(line, "bytes", times.total() * file_size);
+    field(line, "elapsed_ns", elapsed_ns);
+    field(line, "mb_per_sec", elapsed_ns ? times.total() * file_size * 1000000000 / elapsed_ns / 1024 / 1024 : 0);
+    field(line, "p50_ns", times.value_at_percentile(50));
+    field(line, "p99_ns", times.value_at_percentile(99));
+    field(line, "p999_ns", times.value_at_percentile(99.9));
+    field(line, "max_ns", times.max());
+    field(line, "user_us", usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec);
+    field(line, "sys_us", usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec);
+    field(line, "max_rss_kb", usage.ru_maxrss);
+    field(line, "vol_ctx", usage.ru_nvcsw);
+    field(line, "invol_ctx", usage.ru_nivcsw);
+    line.append("}\n");
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || ::write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+        ERROR << "failed to write report " << path << ": " << ::strerror(errno) << ENDL;
+    if (fd >= 0)
+        ::close(fd);
+}
+
+void client_request::recycle()
+{
+    m_worker->recycle(this);
+}
+
+void client_request::finish(STATE state)
+{
+    if (m_state == COMPLETED || m_state == FAILED)
+        return;
+
+    m_state = state;
+    if (m_worker)
+        m_worker->copy_done(state == FAILED);
 }
 
 int32_t main (int argc, char **argv)
@@ -268,8 +679,25 @@ int32_t main (int argc, char **argv)
     uint32_t event_cnt = 1000;
     uint32_t thread_cnt = 1;
     bool spool_it = true;
+    bool sqpoll = false;
+    bool io_stats = false;
+    std::string metrics_file;
+    std::string metrics_socket;
+    uint32_t metrics_ms = 1000;
+    std::string report_path;
+    copy_engine_kind engine = ENGINE_URING;
     int spool_fd = -1;
+    std::string placement;
+    buffer_arena::page_kind pages = buffer_arena::HUGE_2M;
     uint64_t file_size = 0;
+    std::string log_path;
+    uint32_t log_flush_ms = 100;
+    bool log_sync = false;
+    std::string log_control;
+    uint64_t log_rotate_mb = 0;
+    uint32_t log_rotate_secs = 0;
+    uint32_t log_keep = 0;
+    bool log_compress = false;
 
     for (int i = 1; i < argc; i++)
     {
@@ -314,6 +742,107 @@ int32_t main (int argc, char **argv)
         {
             each = aton(val);
         }
+        else if (key == "--placement"sv)
+        {
+            placement = val;
+        }
+        else if (key == "--sqpoll"sv)
+        {
+            sqpoll = (val == "true"sv);
+        }
+        else if (key == "--io-stats"sv)
+        {
+            io_stats = (val == "true"sv);
+        }
+        else if (key == "--metrics-file"sv)
+        {
+            metrics_file = val;
+        }
+        else if (key == "--metrics-socket"sv)
+        {
+            metrics_socket = val;
+        }
+        else if (key == "--metrics-ms"sv)
+        {
+            metrics_ms = aton(val);
+        }
+        else if (key == "--buffer-kb"sv)
+        {
+            s_buffer_sz = std::max<size_t>(aton(val), 4) * 1024;
+        }
+        else if (key == "--report"sv)
+        {
+            report_path = val;
+        }
+        else if (key == "--engine"sv)
+        {
+            if (!from_str(val, engine))
+            {
+                ERROR << "--engine must be one of uring, sync, aio or raw: " << val << ENDL;
+                return 0;
+            }
+        }
+        else if (key == "--huge-pages"sv)
+        {
+            if (!buffer_arena::from_str(val, pages))
+            {
+                ERROR << "--huge-pages must be one of 1g, 2m, thp or none: " << val << ENDL;
+                return 0;
+            }
+        }
+        else if (key == "--log"sv)
+        {
+            log_path = val;
+        }
+        else if (key == "--log-flush-ms"sv)
+        {
+            log_flush_ms = std::max<uint32_t>(aton(val), 1);
+        }
+        else if (key == "--log-sync"sv)
+        {
+            log_sync = (val == "true"sv);
+        }
+        else if (key == "--log-control"sv)
+        {
+            log_control = val;
+        }
+        else if (key == "--log-rotate-mb"sv)
+        {
+            log_rotate_mb = aton(val);
+        }
+        else if (key == "--log-rotate-secs"sv)
+        {
+            log_rotate_secs = aton(val);
+        }
+        else if (key == "--log-keep"sv)
+        {
+            log_keep = aton(val);
+        }
+        else if (key == "--log-compress"sv)
+        {
+            log_compress = (val == "true"sv);
+        }
+        else if (key == "--debug-modules"sv)
+        {
+            if (!set_log_levels(val))
+            {
+                ERROR << "--debug-modules wants module=level[,module=level], modules: general, wrapper, log_file, copy, http: " << val << ENDL;
+                return 0;
+            }
+        }
+    }
+
+    if (!log_path.empty())
+    {
+        // everything logged so far went to stderr, from here on it goes to the file via the log writer thread
+        auto slash = log_path.rfind('/');
+        std::string log_dir = slash == std::string::npos ? "." : log_path.substr(0, slash);
+        std::string log_name = slash == std::string::npos ? log_path : log_path.substr(slash + 1);
+        set_error_log_flush(log_flush_ms, log_sync);
+        if (!log_control.empty())
+            set_error_log_control(log_control.c_str());
+        set_error_log_rotation(log_rotate_mb * 1024 * 1024, log_rotate_secs, log_keep, log_compress);
+        set_error_log_name(log_dir.c_str(), log_name.c_str());
     }
 
     if (file_name.empty())
@@ -325,14 +854,14 @@ int32_t main (int argc, char **argv)
     if (input_fd < 0)
     {
         ERROR << "Failed to open " << input << ", " << ::strerror(errno) << ENDL;
-        return 0;
+        return 1;
     }
 
     struct stat sb;
     if (::fstat(input_fd, &sb) == -1)
     {
         ERROR << "failed to stat input file: " << ::strerror(errno) << ENDL;
-        return 0;
+        return 1;
     }
     file_size = sb.st_size;
 
@@ -342,7 +871,7 @@ int32_t main (int argc, char **argv)
         if (-1 == spool_fd)
         {
             ERROR << "Failed to open spool file: " << output << ", " << ::strerror(errno) << ENDL;
-            return 0;
+            return 1;
         }
     }
 
@@ -350,25 +879,59 @@ int32_t main (int argc, char **argv)
 
     uint64_t start = get_nanoseconds();
 
-    off_t output_offset = 0;
+    copy_scheduler sched;
+    sched.each = each;
+    sched.file_name = file_name.data();
+    sched.file_desc = file_desc.data();
+    sched.file_size = file_size;
+    sched.record_size = file_size + file_name.length() + file_desc.length() + sizeof(file_meta_data);
+    sched.input_fd = input_fd;
+    sched.spool_fd = spool_fd;
+    sched.sqpoll = sqpoll;
+    // the per opcode latencies in the metrics come from the ring stats
+    sched.io_stats = io_stats || !metrics_file.empty() || !metrics_socket.empty();
+    sched.pages = pages;
+    sched.remaining = cnt;
+
+    cpu_topology topology;
+    std::vector<thread_placement> placements;
+    if (!topology.plan(placement, thread_cnt, placements))
+    {
+        ERROR << "bad --placement: " << placement << ENDL;
+        return 0;
+    }
 
-    std::vector<std::thread*> threads;
-    uint32_t cnt_per_thread = cnt / thread_cnt;
-    uint32_t block_size = cnt_per_thread * (file_size + file_name.length() + file_desc.length() + sizeof(file_meta_data));
+    // split the copies up front, remainder spread over the first threads
+    // the split is only a starting point, idle threads steal from busy ones
+    uint32_t first = 0;
+    for (uint32_t t = 0; engine == ENGINE_URING && t < thread_cnt; t++)
+    {
+        uint32_t last = first + cnt / thread_cnt + (t < cnt % thread_cnt ? 1 : 0);
+        sched.workers.push_back(new copy_worker(&sched, t, first, last, placements[t]));
+        first = last;
+    }
 
-    for (uint32_t t = 0; t < thread_cnt; t++)
+    metrics_exporter metrics;
+    if (!metrics_file.empty() || !metrics_socket.empty())
     {
-        threads.push_back(new std::thread(uring_thread,
-                                          cnt_per_thread,
-                                          each,
-                                          file_name.data(), 
-                                          file_desc.data(),
-                                          file_size, 
-                                          input_fd,
-                                          spool_fd,
-                                          output_offset));
+        metrics.add_source([&sched, file_size](std::string &out) {
+            append_copy_metrics(sched, file_size, out);
+        });
+        metrics.add_source([&sched](std::string &out) {
+            std::vector<std::pair<std::string, const io_uring_stats*>> rings;
+            for (auto worker : sched.workers)
+                rings.emplace_back("worker=\"" + std::to_string(worker->id()) + "\"", worker->io_stats());
+            append_io_uring_metrics(out, rings);
+        });
+        metrics.add_source(append_log_metrics);
+        if (!metrics.start(metrics_file, metrics_socket, metrics_ms))
+            return 0;
+    }
 
-        output_offset += block_size;
+    std::vector<std::thread*> threads;
+    for (auto worker : sched.workers)
+    {
+        threads.push_back(new std::thread(&copy_worker::run, worker));
     }
 
     for (auto thrd : threads)
@@ -377,5 +940,52 @@ int32_t main (int argc, char **argv)
             thrd->join();
     }
 
+    if (engine != ENGINE_URING)
+    {
+        copy_spec spec;
+        spec.input_fd = input_fd;
+        spec.spool_fd = spool_fd;
+        spec.record_size = sched.record_size;
+        spec.file_name = file_name;
+        spec.file_desc = file_desc;
+        spec.buffer_sz = s_buffer_sz;
+        spec.cnt = cnt;
+        spec.each = each;
+        spec.times = &s_times;
+        spec.remaining = &sched.remaining;
+        sched.failed = run_copy_engine(engine, spec, thread_cnt);
+    }
+
+    uint64_t elapsed_ns = get_nanoseconds() - start;
+    metrics.stop();
+
     s_times.trace_total_ns(file_size, "ns"sv);
+
+    if (!report_path.empty())
+    {
+        std::string config = "\"engine\":\"" + std::string(to_str(engine)) + "\""
+                           + ",\"cnt\":" + std::to_string(cnt)
+                           + ",\"each\":" + std::to_string(each)
+                           + ",\"thread_cnt\":" + std::to_string(thread_cnt)
+                           + ",\"buffer_kb\":" + std::to_string(s_buffer_sz / 1024)
+                           + ",\"sqpoll\":" + (sqpoll ? "true" : "false")
+                           + ",\"huge_pages\":\"" + buffer_arena::to_str(pages) + "\"";
+        write_report(report_path, config, file_size, elapsed_ns);
+    }
+
+    if (io_stats)
+    {
+        auto totals = std::make_unique<io_uring_stats>();
+        for (auto worker : sched.workers)
+            totals->merge(*worker->io_stats());
+        totals->trace("io"sv);
+    }
+
+    // copy_bench and scripts go by the exit status, copies not made (no thread could start) count too
+    if (sched.failed || sched.remaining)
+    {
+        ERROR << "engine " << to_str(engine) << ": " << sched.failed.load() << " copies failed, " << sched.remaining.load() << " not made" << ENDL;
+        return 1;
+    }
+    return 0;
 }
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "log.h"
+#include "misc.h"
+
+/**
+  Thread / ring placement.
+
+  Each ring thread gets a thread_placement, it pins itself and sets its memory policy
+  before it creates its ring or allocates any buffers, so first touch lands on the right node.
+  The same CPUs are handed to the ring for the SQPOLL thread and the io-wq workers.
+
+  Placement specs, from --placement=<spec>:
+     none             no pinning, the default
+     cpu              thread N pinned to the Nth online CPU, fills a node before moving to the next
+     spread           threads round robin across nodes, each pinned to its own CPU within the node
+     node             threads round robin across nodes, each allowed all the CPUs of its node
+     cpus:0,2,8-11    thread N pinned to the Nth CPU in the list, wraps around
+     nodes:1,0        thread N bound to the Nth node in the list, wraps around
+
+  Topology comes from /sys/devices/system/node, a box without it is treated as a single node.
+  */
+
+struct thread_placement
+{
+    int node = -1;    // -1 leaves the memory policy alone
+    int sq_cpu = -1;  // cpu for the SQPOLL thread, -1 lets the kernel pick
+    cpu_set_t cpus;   // empty leaves the thread unpinned
+
+    thread_placement() { CPU_ZERO(&cpus); }
+
+    bool pinned() const { return CPU_COUNT(&cpus) > 0; }
+};
+
+/**
+  "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}, the format used by the kernel's cpulist files
+  */
+inline bool parse_cpu_list(std::string_view str, std::vector<int> &out)
+{
+    while (!str.empty())
+    {
+        std::string_view item = remove_before(str, ",");
+        if (item.empty() || item == "\n")
+            continue;
+        if (item.back() == '\n')
+            item.remove_suffix(1);
+
+        std::string_view last = item;
+        std::string_view first = remove_before(last, "-");
+        int lo = 0;
+        int hi = 0;
+        if (!aton(first, lo))
+            return false;
+        hi = lo;
+        if (!last.empty() && !aton(last, hi))
+            return false;
+        for (int i = lo; i <= hi; i++)
+            out.push_back(i);
+    }
+    return true;
+}
+
+class cpu_topology
+{
+public:
+    cpu_topology()
+    {
+        std::string online;
+        std::vector<int> nodes;
+        if (read_file("/sys/devices/system/node/online", online) && parse_cpu_list(online, nodes))
+        {
+            for (int node : nodes)
+            {
+                std::string list;
+                std::vector<int> cpus;
+                if (read_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", list) &&
+                    parse_cpu_list(list, cpus) && !cpus.empty())
+                {
+                    m_nodes.push_back(node);
+                    m_node_cpus.push_back(cpus);
+                }
+            }
+        }
+
+        if (m_nodes.empty())
+        {
+            // no NUMA info, treat every online CPU as node 0
+            std::vector<int> cpus;
+            long cnt = ::sysconf(_SC_NPROCESSORS_ONLN);
+            for (long i = 0; i < cnt; i++)
+                cpus.push_back(i);
+            m_nodes.push_back(0);
+            m_node_cpus.push_back(cpus);
+        }
+    }
+
+    size_t node_cnt() const { return m_nodes.size(); }
+
+    int node_of_cpu(int cpu) const
+    {
+        for (size_t n = 0; n < m_nodes.size(); n++)
+        {
+            for (int c : m_node_cpus[n])
+            {
+                if (c == cpu)
+                    return m_nodes[n];
+            }
+        }
+        return -1;
+    }
+
+    const std::vector<int>* cpus_of_node(int node) const
+    {
+        for (size_t n = 0; n < m_nodes.size(); n++)
+        {
+            if (m_nodes[n] == node)
+                return &m_node_cpus[n];
+        }
+        return nullptr;
+    }
+
+    /**
+      Build one placement per thread from a --placement spec, see the top of the file.
+      Returns false (and logs) for a spec that doesn't parse or names CPUs/nodes that don't exist.
+      */
+    bool plan(std::string_view spec, uint32_t thread_cnt, std::vector<thread_placement> &out) const
+    {
+        out.assign(thread_cnt, thread_placement());
+
+        if (spec.empty() || spec == "none")
+            return true;
+
+        std::vector<int> cpus;
+        std::vector<int> nodes;
+
+        if (spec == "cpu")
+        {
+            for (auto &node_cpus : m_node_cpus)
+                cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+        }
+        else if (spec == "spread")
+        {
+            // first CPU of each node, then the second of each node, ...
+            for (size_t i = 0; cpus.size() < thread_cnt; i++)
+            {
+                bool any = false;
+                for (auto &node_cpus : m_node_cpus)
+                {
+                    if (i < node_cpus.size())
+                    {
+                        cpus.push_back(node_cpus[i]);
+                        any = true;
+                    }
+                }
+                if (!any)
+                    break;
+            }
+        }
+        else if (spec == "node")
+        {
+            nodes = m_nodes;
+        }
+        else if (spec.starts_with("cpus:"))
+        {
+            if (!parse_cpu_list(spec.substr(5), cpus))
+                return false;
+        }
+        else if (spec.starts_with("nodes:"))
+        {
+            if (!parse_cpu_list(spec.substr(6), nodes))
+                return false;
+        }
+        else
+        {
+            ERROR << "unknown placement spec: " << spec << ENDL;
+            return false;
+        }
+
+        for (uint32_t t = 0; t < thread_cnt; t++)
+        {
+            thread_placement &tp = out[t];
+            if (!cpus.empty())
+            {
+                int cpu = cpus[t % cpus.size()];
+                tp.node = node_of_cpu(cpu);
+                if (tp.node < 0)
+                {
+                    ERROR << "cpu " << cpu << " is not online" << ENDL;
+                    return false;
+                }
+                CPU_SET(cpu, &tp.cpus);
+                tp.sq_cpu = cpu;
+            }
+            else if (!nodes.empty())
+            {
+                tp.node = nodes[t % nodes.size()];
+                const std::vector<int> *node_cpus = cpus_of_node(tp.node);
+                if (!node_cpus)
+                {
+                    ERROR << "numa node " << tp.node << " has no online cpus" << ENDL;
+                    return false;
+                }
+                for (int cpu : *node_cpus)
+                    CPU_SET(cpu, &tp.cpus);
+                tp.sq_cpu = node_cpus->front();
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool read_file(const std::string &path, std::string &out)
+    {
+        std::ifstream in(path);
+        if (!in)
+            return false;
+        std::getline(in, out);
+        return true;
+    }
+
+private:
+    std::vector<int> m_nodes;
+    std::vector<std::vector<int>> m_node_cpus;
+};
+
+/**
+  A nodemask with just node set, as many longs as it takes, for set_mempolicy/mbind.
+  The kernel reads maxnode - 1 bits of it, hence the + 1.
+  */
+struct node_mask
+{
+    static constexpr int LONG_BITS = sizeof(unsigned long) * 8;
+
+    explicit node_mask(int node)
+        : bits(node / LONG_BITS + 1)
+    {
+        bits[node / LONG_BITS] = 1UL << (node % LONG_BITS);
+    }
+
+    const unsigned long* data() const { return bits.data(); }
+    unsigned long maxnode() const { return bits.size() * LONG_BITS + 1; }
+
+    std::vector<unsigned long> bits;
+};
+
+/**
+  Pin the calling thread and prefer its node for every page it faults in from here on.
+  MPOL_PREFERRED rather than MPOL_BIND so a full node falls back instead of failing the allocation.
+  */
+inline bool apply_placement(const thread_placement &tp)
+{
+    if (tp.pinned())
+    {
+        int ret = ::pthread_setaffinity_np(::pthread_self(), sizeof(tp.cpus), &tp.cpus);
+        if (ret)
+        {
+            ERROR << "pthread_setaffinity_np: " << ::strerror(ret) << ENDL;
+            return false;
+        }
+    }
+
+    if (tp.node >= 0)
+    {
+        node_mask mask(tp.node);
+        if (::syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.maxnode()) < 0)
+        {
+            // no NUMA support in the kernel, nothing to prefer
+            DEBUG(1) << "set_mempolicy: " << ::strerror(errno) << ENDL;
+        }
+    }
+    return true;
+}
+
+/**
+  Move/bind an existing mapping to a node, for memory that was not faulted in by a placed thread.
+  addr must be page aligned.
+  */
+inline bool bind_to_node(void *addr, size_t len, int node)
+{
+    if (node < 0)
+        return true;
+
+    node_mask mask(node);
+    if (::syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask.data(), mask.maxnode(), MPOL_MF_MOVE) < 0)
+    {
+        DEBUG(1) << "mbind: " << ::strerror(errno) << ENDL;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+  HDR style histogram, fixed memory, any percentile.
+
+  Values are bucketed by magnitude (power of two) and then linearly into SUB_BUCKETS slots per magnitude,
+  so every value is kept to within 1/SUB_BUCKETS (< 1%) of what was recorded, over the whole uint64_t range.
+  Values below 2 * SUB_BUCKETS are exact. min, max and the sum are tracked exactly.
+
+  One thread records, any thread can read (counters are relaxed atomics, a reader may see a record half done,
+  the count a little ahead of the buckets, never anything torn). record() is a couple of shifts and two stores.
+  Snapshots merge: merge() adds another histogram's counts into this one.
+  */
+class hdr_histogram
+{
+public:
+    static constexpr uint32_t SUB_BITS = 7;
+    static constexpr uint32_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr uint32_t BUCKET_CNT = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    hdr_histogram() { reset(); }
+
+    hdr_histogram(const hdr_histogram &other) { reset(); merge(other); }
+
+    hdr_histogram& operator=(const hdr_histogram &other)
+    {
+        if (this != &other)
+        {
+            reset();
+            merge(other);
+        }
+        return *this;
+    }
+
+    // single writer
+    void record(uint64_t val, uint64_t cnt = 1)
+    {
+        std::atomic<uint64_t> &bucket = m_counts[index_of(val)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + cnt, std::memory_order_relaxed);
+        m_total.store(m_total.load(std::memory_order_relaxed) + cnt, std::memory_order_relaxed);
+        m_sum.store(m_sum.load(std::memory_order_relaxed) + val * cnt, std::memory_order_relaxed);
+        if (val > m_max.load(std::memory_order_relaxed))
+            m_max.store(val, std::memory_order_relaxed);
+        if (val < m_min.load(std::memory_order_relaxed))
+            m_min.store(val, std::memory_order_relaxed);
+    }
+
+    // not safe against a concurrent record() into this histogram
+    void merge(const hdr_histogram &other)
+    {
+        for (uint32_t i = 0; i < BUCKET_CNT; i++)
+        {
+            uint64_t cnt = other.m_counts[i].load(std::memory_order_relaxed);
+            if (cnt)
+                m_counts[i].store(m_counts[i].load(std::memory_order_relaxed) + cnt, std::memory_order_relaxed);
+        }
+        m_total.store(total() + other.total(), std::memory_order_relaxed);
+        m_sum.store(sum() + other.sum(), std::memory_order_relaxed);
+        if (other.m_max.load(std::memory_order_relaxed) > m_max.load(std::memory_order_relaxed))
+            m_max.store(other.m_max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        if (other.m_min.load(std::memory_order_relaxed) < m_min.load(std::memory_order_relaxed))
+            m_min.store(other.m_min.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        for (auto &cnt : m_counts)
+            cnt.store(0, std::memory_order_relaxed);
+        m_total.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+        m_min.store(UINT64_MAX, std::memory_order_relaxed);
+    }
+
+    uint64_t total() const { return m_total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    uint64_t min() const { return total() ? m_min.load(std::memory_order_relaxed) : 0; }
+    uint64_t mean() const { return total() ? sum() / total() : 0; }
+
+    /**
+      Smallest value such that pct percent of the recorded values are <= it, pct from 0 to 100 (99.9 etc).
+      Reported as the top of the value's bucket, clamped to the exact max.
+      */
+    uint64_t value_at_percentile(double pct) const
+    {
+        uint64_t cnt = total();
+        if (!cnt)
+            return 0;
+
+        uint64_t want = static_cast<uint64_t>(pct / 100.0 * cnt + 0.5);
+        if (want == 0)
+            want = 1;
+        if (want > cnt)
+            want = cnt;
+
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKET_CNT; i++)
+        {
+            seen += m_counts[i].load(std::memory_order_relaxed);
+            if (seen >= want)
+                return std::min(highest_in(i), max());
+        }
+        return max();
+    }
+
+    static uint32_t index_of(uint64_t val)
+    {
+        if (val < 2 * SUB_BUCKETS)
+            return val;
+        uint32_t msb = 63 - __builtin_clzll(val);
+        uint32_t shift = msb - SUB_BITS;
+        return shift * SUB_BUCKETS + (val >> shift);
+    }
+
+    static uint64_t lowest_in(uint32_t idx)
+    {
+        if (idx < 2 * SUB_BUCKETS)
+            return idx;
+        uint32_t shift = idx / SUB_BUCKETS - 1;
+        return static_cast<uint64_t>(idx - shift * SUB_BUCKETS) << shift;
+    }
+
+    static uint64_t highest_in(uint32_t idx)
+    {
+        if (idx < 2 * SUB_BUCKETS)
+            return idx;
+        uint32_t shift = idx / SUB_BUCKETS - 1;
+        return lowest_in(idx) + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[BUCKET_CNT];
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+    std::atomic<uint64_t> m_min;
+};
+
+/**
+  An hdr_histogram per recording thread, merged on read, so threads never share a cache line while recording.
+  The first record() from a thread registers its shard (under a mutex, once), after that it is a thread_local
+  lookup and an hdr_histogram::record(). snapshot() can run at any time from any thread.
+  Shards stay until the sharded_histogram goes away, a thread that exits keeps its counts in the totals.
+  */
+class sharded_histogram
+{
+public:
+    sharded_histogram()
+        : m_id(s_next_id.fetch_add(1, std::memory_order_relaxed))
+    {
+    }
+
+    sharded_histogram(const sharded_histogram&) = delete;
+    sharded_histogram& operator=(const sharded_histogram&) = delete;
+
+    void record(uint64_t val, uint64_t cnt = 1)
+    {
+        shard().record(val, cnt);
+    }
+
+    void snapshot(hdr_histogram &out) const
+    {
+        std::lock_guard<std::mutex> alock(m_mutex);
+        for (auto &shard : m_shards)
+            out.merge(*shard);
+    }
+
+    hdr_histogram snapshot() const
+    {
+        hdr_histogram out;
+        snapshot(out);
+        return out;
+    }
+
+    size_t shard_cnt() const
+    {
+        std::lock_guard<std::mutex> alock(m_mutex);
+        return m_shards.size();
+    }
+
+private:
+    struct cached_shard
+    {
+        uint64_t id;
+        hdr_histogram *shard;
+    };
+
+    hdr_histogram& shard()
+    {
+        // keyed by id rather than this, a new histogram at a dead one's address must not find its shards
+        thread_local std::vector<cached_shard> s_cache;
+        for (auto &cached : s_cache)
+        {
+            if (cached.id == m_id)
+                return *cached.shard;
+        }
+
+        std::lock_guard<std::mutex> alock(m_mutex);
+        m_shards.emplace_back(new hdr_histogram);
+        s_cache.push_back({m_id, m_shards.back().get()});
+        return *m_shards.back();
+    }
+
+private:
+    inline static std::atomic<uint64_t> s_next_id{1};
+
+    uint64_t m_id = 0;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<hdr_histogram>> m_shards;
+};
@@ -0,0 +1,887 @@
+#include "commas.h"
+#include "get_nanoseconds.h"
+#include "hdr_histogram.h"
+#include "http_misc.h"
+#include "http_response.h"
+#include "io_uring_wrapper.h"
+#include "log.h"
+#include "misc.h"
+#include "string_view.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+/**
+  http_load: HTTP/1.1 load generator on one io_uring ring, --conns keep-alive connections to http_server
+  (or anything else answering with Content-Length).
+
+  Each connection runs one request at a time, the http_misc.h client states:
+     CONNECTING -> CONNECTED (idle) -> WRITING_REQUEST -> READING_RESPONSE_HEADERS -> READING_RESPONSE_BODY
+  and back to CONNECTED, or a reconnect when the server closes the connection.
+
+  Closed loop (--rate=0): every connection sends its next request as soon as the last response is in.
+  Open loop (--rate=N): requests are due at a fixed schedule, start + i / N, whether or not the server keeps up.
+  A due request goes out on the next idle connection, when none is idle it waits in a backlog.
+
+  Coordinated omission: a closed loop, or an open loop that times from when a request actually went out,
+  sends less while the server stalls and so never measures the stall. The open loop's latency is timed from
+  when the request was due, the time it sat in the backlog counts. Both are reported, "latency" from the
+  intended send time and "service" from the actual send, the gap between them is the omission.
+  In closed loop mode they are the same thing.
+  */
+
+namespace
+{
+
+struct load_config
+{
+    std::string addr = "127.0.0.1";
+    uint16_t port = 8080;
+    uint32_t conns = 100;
+    uint32_t rate = 0;            // requests per second across all connections, 0 for closed loop
+    uint32_t duration_secs = 10;
+    uint64_t requests = 0;        // stop after this many instead, 0 for --duration only
+    uint32_t drain_secs = 5;      // how long in flight requests get once we stop sending
+    std::string path = "/index.html";
+    std::string put_path = "/upload";
+    uint32_t put_pct = 0;         // percent of requests that are PUTs
+    size_t put_sz = 4 * 1024;
+    size_t recv_sz = 16 * 1024;
+    uint32_t queue_depth = 4096;
+    bool io_stats = false;
+};
+
+struct load_counters
+{
+    uint64_t connects = 0;
+    uint64_t connect_errors = 0;
+    uint64_t reconnects = 0;     // the server closed a keep-alive connection, we opened another
+    uint64_t sent = 0;
+    uint64_t responses = 0;
+    uint64_t ok = 0;             // 2xx
+    uint64_t not_ok = 0;         // everything else the server answered
+    uint64_t errors = 0;         // requests lost to a failed connection or a bad response
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+    uint64_t backlog_max = 0;    // most requests waiting for an idle connection at once
+};
+
+} // namespace
+
+class load_gen;
+class load_conn;
+
+/**
+  What a CQE was for. A connection has a single op in flight at any time, its state says which one.
+  */
+struct load_op
+{
+    enum kind { TIMER, SIGNAL, CONN };
+
+    load_gen *gen = nullptr;
+    load_conn *conn = nullptr;
+    kind op = CONN;
+
+    uint32_t process_io_uring(int res);
+};
+
+using load_ring = io_uring_wrapper<load_op>;
+
+class load_conn
+{
+public:
+    load_conn(load_gen *gen, uint32_t id);
+    ~load_conn();
+
+    bool connect();
+    void send_request(uint64_t intended_ns, bool put);
+    void on_io(int res);
+
+    // something of ours is in flight
+    bool busy() const
+    {
+        return m_state != http_11_state::CONNECTED && m_state != http_11_state::FAILED && m_state != http_11_state::DONE;
+    }
+    uint32_t id() const { return m_id; }
+
+private:
+    static constexpr log_module s_log_module = LOG_HTTP;
+
+    void on_connect(int res);
+    void on_send(int res);
+    void on_recv(int res);
+    bool read_response();
+    void response_done();
+    void send_out();
+    void arm_recv();
+    void lost(std::string_view why, int res = 0);
+    void close_fd();
+
+    load_gen *m_gen = nullptr;
+    uint32_t m_id = 0;
+    int m_fd = -1;
+    load_op m_op;
+    http_11_state m_state = http_11_state::CREATED;
+
+    // the request in flight
+    std::string m_out;             // request head
+    const char *m_send_ptr = nullptr;
+    size_t m_send_left = 0;
+    bool m_body_next = false;      // a PUT body still goes out after the head
+    uint64_t m_intended_ns = 0;
+    uint64_t m_sent_ns = 0;
+
+    // its response
+    std::unique_ptr<char[]> m_buf;
+    size_t m_have = 0;
+    http_parser m_parser{http_parser::RESPONSE};
+    http_response m_resp;
+    uint64_t m_body_left = 0;
+};
+
+class load_gen
+{
+public:
+    explicit load_gen(const load_config &cfg)
+        : m_cfg(cfg),
+          m_ring(cfg.queue_depth)
+    {
+        if (cfg.io_stats)
+            m_ring.enable_stats();
+        m_timer_op.gen = this;
+        m_timer_op.op = load_op::TIMER;
+        m_signal_op.gen = this;
+        m_signal_op.op = load_op::SIGNAL;
+
+        m_payload.assign(cfg.put_sz, 'x');
+        for (size_t i = 0; i < m_payload.size(); i++)
+            m_payload[i] = 'a' + i % 26;
+    }
+
+    ~load_gen()
+    {
+        if (m_signal_fd >= 0)
+            ::close(m_signal_fd);
+    }
+
+    // signals are blocked in every thread and read off a signalfd by the ring, see main()
+    bool start(const sigset_t &signals)
+    {
+        if (!m_ring.is_valid())
+            return false;
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(m_cfg.port);
+        if (::inet_pton(AF_INET, m_cfg.addr.c_str(), &m_addr.sin_addr) != 1)
+        {
+            ERROR << "bad --addr: " << m_cfg.addr << ENDL;
+            return false;
+        }
+
+        m_signal_fd = ::signalfd(-1, &signals, SFD_CLOEXEC);
+        if (m_signal_fd < 0)
+        {
+            ERROR << "signalfd: " << ::strerror(errno) << ENDL;
+            return false;
+        }
+        if (!m_ring.prep_read(m_signal_fd, reinterpret_cast<char*>(&m_siginfo), sizeof(m_siginfo), 0, &m_signal_op))
+            return false;
+
+        m_start_ns = get_nanoseconds();
+        m_end_ns = m_start_ns + m_cfg.duration_secs * 1000000000ULL;
+        m_interval_ns = m_cfg.rate ? std::max<uint64_t>(1000000000ULL / m_cfg.rate, 1) : 0;
+        m_next_due_ns = m_start_ns;
+
+        for (uint32_t i = 0; i < m_cfg.conns; i++)
+        {
+            m_conns.emplace_back(new load_conn(this, i));
+            if (!m_conns.back()->connect())
+                return false;
+        }
+        arm_timer(m_start_ns);
+        return m_ring.submit() >= 0;
+    }
+
+    void run()
+    {
+        TRACE << "connecting " << m_cfg.conns << " to " << m_cfg.addr << ":" << m_cfg.port
+              << (m_cfg.rate ? ", rate: " + std::to_string(m_cfg.rate) + "/s" : ", closed loop"s)
+              << ", duration: " << m_cfg.duration_secs << "s"
+              << ", GET " << m_cfg.path << ", PUT " << m_cfg.put_pct << "% of " << m_cfg.put_sz << " bytes" << ENDL;
+
+        while (!m_done)
+            m_ring.wait_events();
+        m_elapsed_ns = (m_stop_ns ? m_stop_ns : get_nanoseconds()) - m_start_ns;
+
+        uint32_t lost = 0;
+        for (auto &conn : m_conns)
+            lost += conn->busy();
+        if (lost)
+            WARN << lost << " requests still had no response after --drain-secs" << ENDL;
+    }
+
+    void report()
+    {
+        uint64_t per_sec = m_elapsed_ns ? m_latency.total() * 1000000000ULL / m_elapsed_ns : 0;
+        TRACE << "requests: " << commas(m_counters.sent) << ", responses: " << commas(m_counters.responses)
+              << ", 2xx: " << commas(m_counters.ok) << ", other status: " << m_counters.not_ok
+              << ", errors: " << m_counters.errors << ", in " << m_elapsed_ns / 1000000 << " ms, req/s: " << commas(per_sec) << ENDL;
+        TRACE << "connects: " << m_counters.connects << ", connect errors: " << m_counters.connect_errors
+              << ", reconnects: " << m_counters.reconnects << ", bytes out: " << commas(m_counters.bytes_out)
+              << ", bytes in: " << commas(m_counters.bytes_in) << ", most requests waiting for a connection: " << m_counters.backlog_max << ENDL;
+        trace_histogram("latency (from intended send) us"sv, m_latency);
+        trace_histogram("service (from actual send) us"sv, m_service);
+        if (m_ring.stats())
+            m_ring.stats()->trace("http_load"sv);
+    }
+
+    /**
+      One JSON object per run appended to path, the same idea as copy_file_simple's --report:
+      settings, throughput, both sets of percentiles and our own rusage.
+      */
+    void write_report(const std::string &path)
+    {
+        rusage usage{};
+        ::getrusage(RUSAGE_SELF, &usage);
+
+        auto field = [](std::string &out, std::string_view name, uint64_t val) {
+            out.append(",\"").append(name).append("\":").append(std::to_string(val));
+        };
+
+        std::string line = "{\"conns\":" + std::to_string(m_cfg.conns);
+        field(line, "rate", m_cfg.rate);
+        field(line, "put_pct", m_cfg.put_pct);
+        field(line, "put_size", m_cfg.put_sz);
+        field(line, "requests", m_counters.sent);
+        field(line, "responses", m_counters.responses);
+        field(line, "ok", m_counters.ok);
+        field(line, "errors", m_counters.errors + m_counters.not_ok);
+        field(line, "elapsed_ns", m_elapsed_ns);
+        field(line, "req_per_sec", m_elapsed_ns ? m_latency.total() * 1000000000ULL / m_elapsed_ns : 0);
+        field(line, "p50_ns", m_latency.value_at_percentile(50));
+        field(line, "p99_ns", m_latency.value_at_percentile(99));
+        field(line, "p999_ns", m_latency.value_at_percentile(99.9));
+        field(line, "max_ns", m_latency.max());
+        field(line, "service_p50_ns", m_service.value_at_percentile(50));
+        field(line, "service_p99_ns", m_service.value_at_percentile(99));
+        field(line, "service_p999_ns", m_service.value_at_percentile(99.9));
+        field(line, "service_max_ns", m_service.max());
+        field(line, "user_us", usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec);
+        field(line, "sys_us", usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec);
+        line.append("}\n");
+
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0 || ::write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+            ERROR << "failed to write report " << path << ": " << ::strerror(errno) << ENDL;
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    uint32_t on_timer(int res)
+    {
+        m_timer_armed = false;
+        if (res < 0 && res != -ETIME)
+            ERROR << "timeout: " << ::strerror(-res) << ENDL;
+        tick(get_nanoseconds());
+        return 1;
+    }
+
+    uint32_t on_signal(int res)
+    {
+        if (res < 0)
+        {
+            ERROR << "signalfd read: " << ::strerror(-res) << ENDL;
+        }
+        else
+        {
+            TRACE << "got signal " << m_siginfo.ssi_signo << ", stopping" << ENDL;
+        }
+        stop(get_nanoseconds());
+        check_done();
+        return 1;
+    }
+
+    // the connection is up or finished a request, give it the next one
+    void conn_idle(load_conn *conn)
+    {
+        uint64_t now = get_nanoseconds();
+        if (m_stopping || now >= m_end_ns || (m_cfg.requests && m_issued >= m_cfg.requests))
+        {
+            stop(now);
+            check_done();
+            return;
+        }
+
+        if (!m_cfg.rate)
+        {
+            issue(conn, now);
+        }
+        else if (!m_backlog.empty())
+        {
+            uint64_t due = m_backlog.front();
+            m_backlog.pop_front();
+            issue(conn, due);
+        }
+        else
+        {
+            m_idle.push_back(conn);
+        }
+    }
+
+    // the connection is gone for good
+    void conn_failed(load_conn *)
+    {
+        if (++m_failed == m_conns.size())
+        {
+            ERROR << "every connection failed" << ENDL;
+            stop(get_nanoseconds());
+        }
+        check_done();
+    }
+
+    void completed(uint64_t intended_ns, uint64_t sent_ns, uint64_t now)
+    {
+        m_latency.record(now - intended_ns);
+        m_service.record(now - sent_ns);
+    }
+
+    bool stopping() const { return m_stopping; }
+    load_ring& ring() { return m_ring; }
+    const sockaddr_in& addr() const { return m_addr; }
+    const load_config& cfg() const { return m_cfg; }
+    load_counters& counters() { return m_counters; }
+    std::string_view payload() const { return m_payload; }
+
+private:
+    static constexpr log_module s_log_module = LOG_HTTP;
+
+    void issue(load_conn *conn, uint64_t intended_ns)
+    {
+        bool put = (m_issued % 100) < m_cfg.put_pct;
+        m_issued++;
+        conn->send_request(intended_ns, put);
+    }
+
+    // queue everything that's due by now, hand out what we can and sleep until the next one is due
+    void tick(uint64_t now)
+    {
+        if (!m_stopping && (now >= m_end_ns || (m_cfg.requests && m_issued + m_backlog.size() >= m_cfg.requests)))
+            stop(now);
+
+        if (m_stopping)
+        {
+            if (now >= m_drain_end_ns)
+            {
+                m_done = true;
+                return;
+            }
+            check_done();
+            if (!m_done)
+                arm_timer(m_drain_end_ns);
+            return;
+        }
+
+        if (m_cfg.rate)
+        {
+            while (m_next_due_ns <= now && (!m_cfg.requests || m_issued + m_backlog.size() < m_cfg.requests))
+            {
+                m_backlog.push_back(m_next_due_ns);
+                m_next_due_ns += m_interval_ns;
+            }
+            m_counters.backlog_max = std::max<uint64_t>(m_counters.backlog_max, m_backlog.size());
+
+            while (!m_backlog.empty() && !m_idle.empty())
+            {
+                load_conn *conn = m_idle.back();
+                m_idle.pop_back();
+                uint64_t due = m_backlog.front();
+                m_backlog.pop_front();
+                issue(conn, due);
+            }
+            arm_timer(std::min(m_next_due_ns, m_end_ns));
+        }
+        else
+        {
+            arm_timer(m_end_ns);
+        }
+    }
+
+    void stop(uint64_t now)
+    {
+        if (m_stopping)
+            return;
+        m_stopping = true;
+        m_stop_ns = now;
+        m_drain_end_ns = now + m_cfg.drain_secs * 1000000000ULL;
+        m_backlog.clear();
+        m_idle.clear();
+        if (!m_timer_armed)
+            arm_timer(m_drain_end_ns);
+    }
+
+    void check_done()
+    {
+        if (!m_stopping)
+            return;
+        for (auto &conn : m_conns)
+        {
+            if (conn->busy())
+                return;
+        }
+        m_done = true;
+    }
+
+    void arm_timer(uint64_t when_ns)
+    {
+        uint64_t now = get_nanoseconds();
+        uint64_t ns = when_ns > now ? when_ns - now : 0;
+        m_ts.tv_sec = ns / 1000000000;
+        m_ts.tv_nsec = ns % 1000000000;
+        m_timer_armed = m_ring.prep_timeout(&m_ts, 0, &m_timer_op);
+    }
+
+private:
+    load_config m_cfg;
+    load_ring m_ring;
+    sockaddr_in m_addr{};
+    load_op m_timer_op;
+    load_op m_signal_op;
+    __kernel_timespec m_ts{};
+    bool m_timer_armed = false;
+    int m_signal_fd = -1;
+    signalfd_siginfo m_siginfo{};
+
+    std::vector<std::unique_ptr<load_conn>> m_conns;
+    std::vector<load_conn*> m_idle;   // open loop, connections with nothing to send
+    std::deque<uint64_t> m_backlog;   // open loop, due times of requests waiting for a connection
+    uint32_t m_failed = 0;
+    std::string m_payload;            // every PUT sends this
+
+    uint64_t m_start_ns = 0;
+    uint64_t m_end_ns = 0;
+    uint64_t m_stop_ns = 0;
+    uint64_t m_drain_end_ns = 0;
+    uint64_t m_elapsed_ns = 0;
+    uint64_t m_interval_ns = 0;
+    uint64_t m_next_due_ns = 0;
+    uint64_t m_issued = 0;
+    bool m_stopping = false;
+    bool m_done = false;
+
+    hdr_histogram m_latency;  // from when the request was due
+    hdr_histogram m_service;  // from when it went out
+    load_counters m_counters;
+
+    static void trace_histogram(std::string_view label, const hdr_histogram &times)
+    {
+        if (!times.total())
+            return;
+        TRACE << label << ": min " << commas(times.min() / 1000)
+              << ", p50 " << commas(times.value_at_percentile(50) / 1000)
+              << ", p90 " << commas(times.value_at_percentile(90) / 1000)
+              << ", p99 " << commas(times.value_at_percentile(99) / 1000)
+              << ", p99.9 " << commas(times.value_at_percentile(99.9) / 1000)
+              << ", p99.99 " << commas(times.value_at_percentile(99.99) / 1000)
+              << ", max " << commas(times.max() / 1000)
+              << ", mean " << commas(times.mean() / 1000) << ENDL;
+    }
+};
+
+uint32_t load_op::process_io_uring(int res)
+{
+    if (op == TIMER)
+        return gen->on_timer(res);
+    if (op == SIGNAL)
+        return gen->on_signal(res);
+
+    conn->on_io(res);
+    return 1;
+}
+
+load_conn::load_conn(load_gen *gen, uint32_t id)
+    : m_gen(gen),
+      m_id(id),
+      m_buf(new char[gen->cfg().recv_sz])
+{
+    m_op.gen = gen;
+    m_op.conn = this;
+    m_op.op = load_op::CONN;
+}
+
+load_conn::~load_conn()
+{
+    close_fd();
+}
+
+bool load_conn::connect()
+{
+    m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+    {
+        ERROR << "socket: " << ::strerror(errno) << ENDL;
+        return false;
+    }
+    int one = 1;
+    ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    m_state = http_11_state::CONNECTING;
+    m_have = 0;
+    m_parser.reset();
+    return m_gen->ring().prep_connect(m_fd, reinterpret_cast<const sockaddr*>(&m_gen->addr()), sizeof(sockaddr_in), &m_op);
+}
+
+void load_conn::send_request(uint64_t intended_ns, bool put)
+{
+    const load_config &cfg = m_gen->cfg();
+    m_out.clear();
+    if (put)
+    {
+        m_out.append("PUT ").append(cfg.put_path).append(" HTTP/1.1\r\nHost: ").append(cfg.addr)
+             .append("\r\nX-File-Desc: http_load\r\nContent-Length: ").append(std::to_string(cfg.put_sz)).append("\r\n\r\n");
+    }
+    else
+    {
+        m_out.append("GET ").append(cfg.path).append(" HTTP/1.1\r\nHost: ").append(cfg.addr).append("\r\n\r\n");
+    }
+
+    m_intended_ns = intended_ns;
+    m_sent_ns = get_nanoseconds();
+    m_state = http_11_state::WRITING_REQUEST;
+    m_send_ptr = m_out.data();
+    m_send_left = m_out.size();
+    m_body_next = put && cfg.put_sz;
+    m_gen->counters().sent++;
+    send_out();
+}
+
+void load_conn::send_out()
+{
+    if (!m_gen->ring().prep_send(m_fd, m_send_ptr, m_send_left, MSG_NOSIGNAL, &m_op))
+        lost("prep_send"sv);
+}
+
+void load_conn::arm_recv()
+{
+    if (!m_gen->ring().prep_recv(m_fd, m_buf.get() + m_have, m_gen->cfg().recv_sz - m_have, 0, &m_op))
+        lost("prep_recv"sv);
+}
+
+void load_conn::on_io(int res)
+{
+    DEBUGF(3, "conn: {}, res: {}, state: {}", m_id, res, to_str(m_state));
+    switch (m_state) {
+    case http_11_state::CONNECTING:
+        on_connect(res);
+        break;
+    case http_11_state::WRITING_REQUEST:
+        on_send(res);
+        break;
+    case http_11_state::READING_RESPONSE_HEADERS:
+    case http_11_state::READING_RESPONSE_BODY:
+        on_recv(res);
+        break;
+    default:
+        ERROR << "conn " << m_id << " completion in state " << to_str(m_state) << ENDL;
+        break;
+    };
+}
+
+void load_conn::on_connect(int res)
+{
+    if (res < 0)
+    {
+        WARN << "connect: " << ::strerror(-res) << ENDL;
+        m_gen->counters().connect_errors++;
+        close_fd();
+        m_state = http_11_state::FAILED;
+        m_gen->conn_failed(this);
+        return;
+    }
+    m_gen->counters().connects++;
+    m_state = http_11_state::CONNECTED;
+    m_gen->conn_idle(this);
+}
+
+void load_conn::on_send(int res)
+{
+    if (res <= 0)
+    {
+        lost("send"sv, res);
+        return;
+    }
+    m_gen->counters().bytes_out += res;
+    m_send_ptr += res;
+    m_send_left -= res;
+    if (!m_send_left && m_body_next)
+    {
+        std::string_view body = m_gen->payload();
+        m_send_ptr = body.data();
+        m_send_left = body.size();
+        m_body_next = false;
+    }
+
+    if (m_send_left)
+    {
+        send_out();
+        return;
+    }
+    m_state = http_11_state::READING_RESPONSE_HEADERS;
+    arm_recv();
+}
+
+void load_conn::on_recv(int res)
+{
+    if (res <= 0)
+    {
+        lost(res ? "recv"sv : "server closed the connection mid response"sv, res);
+        return;
+    }
+    m_gen->counters().bytes_in += res;
+    m_have += res;
+
+    if (m_state == http_11_state::READING_RESPONSE_HEADERS && !read_response())
+        return;
+
+    // body bytes are only counted, not kept
+    uint64_t body = std::min<uint64_t>(m_have, m_body_left);
+    m_body_left -= body;
+    if (m_have > body)
+    {
+        // one request at a time, the server has no business sending more than we asked for
+        lost("bytes after the response"sv);
+        return;
+    }
+    m_have = 0;
+
+    if (m_body_left)
+        arm_recv();
+    else
+        response_done();
+}
+
+// false when the head isn't all there yet or the connection was lost over it
+bool load_conn::read_response()
+{
+    for (;;)
+    {
+        http_11_action action = parse_response(m_parser, std::string_view(m_buf.get(), m_have), m_resp);
+        if (action == http_11_action::WAIT)
+        {
+            if (m_have == m_gen->cfg().recv_sz)
+                lost("response head bigger than --recv-kb"sv);
+            else
+                arm_recv();
+            return false;
+        }
+        if (action == http_11_action::FAIL || m_resp.chunked || (!m_resp.has_content_length && m_resp.status >= 200))
+        {
+            lost("unusable response head"sv);
+            return false;
+        }
+
+        ::memmove(m_buf.get(), m_buf.get() + m_resp.header_len, m_have - m_resp.header_len);
+        m_have -= m_resp.header_len;
+        // an interim 100 Continue, the real response follows
+        if (m_resp.status >= 200)
+            break;
+    }
+
+    m_state = http_11_state::READING_RESPONSE_BODY;
+    m_body_left = m_resp.content_length;
+    return true;
+}
+
+void load_conn::response_done()
+{
+    load_counters &counters = m_gen->counters();
+    counters.responses++;
+    if (m_resp.status / 100 == 2)
+        counters.ok++;
+    else
+        counters.not_ok++;
+    m_gen->completed(m_intended_ns, m_sent_ns, get_nanoseconds());
+
+    if (!m_resp.keep_alive)
+    {
+        close_fd();
+        if (m_gen->stopping())
+        {
+            m_state = http_11_state::DONE;
+            m_gen->conn_idle(this);
+            return;
+        }
+        counters.reconnects++;
+        if (!connect())
+            lost("reconnect"sv);
+        return;
+    }
+
+    m_state = http_11_state::CONNECTED;
+    m_gen->conn_idle(this);
+}
+
+// the request in flight is lost with the connection, open a new one unless we're winding down
+void load_conn::lost(std::string_view why, int res)
+{
+    if (res < 0)
+    {
+        WARN << "conn " << m_id << " " << why << ": " << ::strerror(-res) << ENDL;
+    }
+    else
+    {
+        WARN << "conn " << m_id << " " << why << ENDL;
+    }
+    m_gen->counters().errors++;
+    close_fd();
+
+    if (!m_gen->stopping() && m_state != http_11_state::CONNECTING)
+    {
+        m_gen->counters().reconnects++;
+        if (connect())
+            return;
+    }
+    m_state = http_11_state::FAILED;
+    m_gen->conn_failed(this);
+}
+
+void load_conn::close_fd()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+int32_t main(int argc, char **argv)
+{
+    load_config cfg;
+    std::string report_path;
+
+    for (int i = 1; i < argc; i++)
+    {
+        auto[key, val] = split(argv[i], '=');
+        if (key == "--addr"sv)
+        {
+            cfg.addr = val;
+        }
+        else if (key == "--port"sv)
+        {
+            cfg.port = aton(val);
+        }
+        else if (key == "--conns"sv)
+        {
+            cfg.conns = std::max<uint32_t>(aton(val), 1);
+        }
+        else if (key == "--rate"sv)
+        {
+            cfg.rate = aton(val);
+        }
+        else if (key == "--duration"sv)
+        {
+            cfg.duration_secs = aton(val);
+        }
+        else if (key == "--requests"sv)
+        {
+            cfg.requests = aton(val);
+        }
+        else if (key == "--drain-secs"sv)
+        {
+            cfg.drain_secs = aton(val);
+        }
+        else if (key == "--path"sv)
+        {
+            cfg.path = val;
+        }
+        else if (key == "--put-path"sv)
+        {
+            cfg.put_path = val;
+        }
+        else if (key == "--put-pct"sv)
+        {
+            cfg.put_pct = std::min<uint32_t>(aton(val), 100);
+        }
+        else if (key == "--put-kb"sv)
+        {
+            cfg.put_sz = static_cast<size_t>(aton(val)) * 1024;
+        }
+        else if (key == "--recv-kb"sv)
+        {
+            cfg.recv_sz = std::max<size_t>(aton(val), 1) * 1024;
+        }
+        else if (key == "--queue-depth"sv)
+        {
+            cfg.queue_depth = aton(val);
+        }
+        else if (key == "--io-stats"sv)
+        {
+            cfg.io_stats = (val == "true"sv);
+        }
+        else if (key == "--report"sv)
+        {
+            report_path = val;
+        }
+        else if (key == "--debug"sv)
+        {
+            s_debug_level = aton(val);
+        }
+        else if (key == "--debug-modules"sv)
+        {
+            if (!set_log_levels(val))
+            {
+                ERROR << "--debug-modules wants module=level[,module=level], modules: general, wrapper, log_file, copy, http: " << val << ENDL;
+                return 1;
+            }
+        }
+        else
+        {
+            ERROR << "unknown option: " << argv[i] << ENDL;
+            return 1;
+        }
+    }
+
+    // every connection holds a socket, the ring a CQE per connection plus the timer and signalfd
+    rlimit nofile{};
+    ::getrlimit(RLIMIT_NOFILE, &nofile);
+    if (nofile.rlim_cur < cfg.conns + 64)
+    {
+        nofile.rlim_cur = std::min<rlim_t>(cfg.conns + 64, nofile.rlim_max);
+        ::setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    cfg.queue_depth = std::max(cfg.queue_depth, cfg.conns + 2);
+
+    // blocked before the log writer thread exists so it inherits the mask, the ring reads them off a signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    ::signal(SIGPIPE, SIG_IGN);
+
+    load_gen gen(cfg);
+    if (!gen.start(signals))
+        return 1;
+    gen.run();
+    gen.report();
+    if (!report_path.empty())
+        gen.write_report(report_path);
+    return 0;
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "http_misc.h"
+
+/**
+  Finding line ends in a received buffer: compare a block of bytes against '\n' at once and walk the bits of
+  the resulting mask, 16 bytes a block with SSE2 (always there on x86-64) or 32 with AVX2 when the CPU has it.
+  The choice is made once at startup and once per parse() call, the build doesn't need -mavx2.
+  Elsewhere the blocks are 16 bytes checked one at a time.
+  */
+namespace http_scan
+{
+
+#if defined(__x86_64__)
+
+inline uint32_t newlines_sse2(const char *p)
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+}
+
+__attribute__((target("avx2")))
+inline uint32_t newlines_avx2(const char *p)
+{
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+}
+
+inline bool pick_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+inline const bool s_avx2 = pick_avx2();
+
+#else
+
+inline const bool s_avx2 = false;
+
+#endif
+
+// a bit per '\n' in the len (< 32) bytes at p, the short block at the end of the buffer
+inline uint32_t newlines_tail(const char *p, size_t len)
+{
+    uint32_t mask = 0;
+    for (size_t i = 0; i < len; i++)
+        mask |= static_cast<uint32_t>(p[i] == '\n') << i;
+    return mask;
+}
+
+} // namespace http_scan
+
+/**
+  Incremental HTTP/1.x head parser, requests or responses.
+
+  parse() is handed the head received so far, starting at the same byte every time and only ever longer,
+  whether that's the front of one receive buffer or the pieces of a split head gathered somewhere.
+  Complete lines are parsed as they show up and never looked at again, a head arriving a few bytes at a time
+  costs about what one arriving all at once does. Line ends are found a block at a time (see http_scan).
+  Positions are kept as offsets, so the buffer may move between calls (a std::string that grew), the
+  string_views handed out after DONE point into the buffer given to that last call and live as long as it does.
+
+  Every line has to end in CRLF. Anything past MAX_HEADERS headers, obsolete line folding or a header
+  line without a colon is a FAIL. reset() before the next head.
+  */
+class http_parser
+{
+public:
+    enum kind { REQUEST, RESPONSE };
+
+    static constexpr uint32_t MAX_HEADERS = 64;
+
+    struct header
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    explicit http_parser(kind k) : m_kind(k) {}
+
+    void reset()
+    {
+        m_pos = 0;
+        m_lines = 0;
+        m_header_cnt = 0;
+        m_head_len = 0;
+    }
+
+    // DONE once the blank line ending the head is in, WAIT for more bytes, FAIL when it isn't HTTP/1.x
+    http_11_action parse(std::string_view buf)
+    {
+#if defined(__x86_64__)
+        if (http_scan::s_avx2)
+            return parse_avx2(buf);
+#endif
+        return parse_blocks<16>(buf);
+    }
+
+    // everything below is valid after DONE
+
+    // request line, status line, headers and the blank line
+    size_t head_len() const { return m_head_len; }
+
+    std::string_view method() const { return view(m_first[0]); }
+    std::string_view target() const { return view(m_first[1]); }
+    uint32_t status() const { return m_status; }
+    uint32_t minor_version() const { return m_minor; }
+
+    uint32_t header_cnt() const { return m_header_cnt; }
+    header get_header(uint32_t idx) const
+    {
+        return header{view(m_headers[idx].name), view(m_headers[idx].value)};
+    }
+
+private:
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    http_11_action parse_avx2(std::string_view buf) { return parse_blocks<32>(buf); }
+#endif
+
+    template<size_t WIDTH>
+    static uint32_t newlines(const char *p)
+    {
+#if defined(__x86_64__)
+        if constexpr (WIDTH == 32)
+            return http_scan::newlines_avx2(p);
+        else
+            return http_scan::newlines_sse2(p);
+#else
+        return http_scan::newlines_tail(p, WIDTH);
+#endif
+    }
+
+    // walk the '\n's a block at a time from the first line we haven't parsed, each one ends a line
+    template<size_t WIDTH>
+    __attribute__((always_inline))
+    http_11_action parse_blocks(std::string_view buf)
+    {
+        const char *base = buf.data();
+        const char *end = base + buf.size();
+        const char *line = base + m_pos;
+
+        for (const char *block = line; block < end; block += WIDTH)
+        {
+            uint32_t mask = end - block >= static_cast<ptrdiff_t>(WIDTH) ? newlines<WIDTH>(block)
+                                                                           : http_scan::newlines_tail(block, end - block);
+            while (mask)
+            {
+                const char *eol = block + __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                if (eol == line || eol[-1] != '\r')
+                    return http_11_action::FAIL;
+                uint32_t start = line - base;
+                uint32_t len = eol - 1 - line;
+                line = eol + 1;
+                m_pos = line - base;
+
+                if (m_lines++ == 0)
+                {
+                    if (!first_line(std::string_view(base + start, len)))
+                        return http_11_action::FAIL;
+                }
+                else if (len == 0)
+                {
+                    m_head_len = m_pos;
+                    m_buf = buf;
+                    return http_11_action::DONE;
+                }
+                else if (!header_line(base + start, len, start))
+                {
+                    return http_11_action::FAIL;
+                }
+            }
+        }
+        return http_11_action::WAIT;
+    }
+
+    struct span
+    {
+        uint32_t off = 0;
+        uint32_t len = 0;
+    };
+
+    struct header_span
+    {
+        span name;
+        span value;
+    };
+
+    std::string_view view(span s) const { return m_buf.substr(s.off, s.len); }
+
+    static bool version(std::string_view str, uint32_t &minor)
+    {
+        if (str.size() != 8 || str.substr(0, 7) != "HTTP/1." || str[7] < '0' || str[7] > '9')
+            return false;
+        minor = str[7] - '0';
+        return true;
+    }
+
+    // GET /path HTTP/1.1 or HTTP/1.1 200 OK, offsets are from the start of the buffer which is where this line starts
+    bool first_line(std::string_view line)
+    {
+        size_t sp1 = line.find(' ');
+        if (sp1 == std::string_view::npos || sp1 == 0)
+            return false;
+        size_t sp2 = line.find(' ', sp1 + 1);
+
+        if (m_kind == REQUEST)
+        {
+            if (sp2 == std::string_view::npos || sp2 == sp1 + 1 || !version(line.substr(sp2 + 1), m_minor))
+                return false;
+            m_first[0] = span{0, static_cast<uint32_t>(sp1)};
+            m_first[1] = span{static_cast<uint32_t>(sp1 + 1), static_cast<uint32_t>(sp2 - sp1 - 1)};
+            return true;
+        }
+
+        if (!version(line.substr(0, sp1), m_minor))
+            return false;
+        std::string_view code = line.substr(sp1 + 1, sp2 == std::string_view::npos ? std::string_view::npos : sp2 - sp1 - 1);
+        if (code.size() != 3)
+            return false;
+        m_status = 0;
+        for (char c : code)
+        {
+            if (c < '0' || c > '9')
+                return false;
+            m_status = m_status * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    bool header_line(const char *line, uint32_t len, uint32_t start)
+    {
+        // obsolete line folding, RFC 9112 says reject it
+        if (*line == ' ' || *line == '\t' || m_header_cnt == MAX_HEADERS)
+            return false;
+
+        const char *colon = static_cast<const char*>(::memchr(line, ':', len));
+        if (!colon || colon == line)
+            return false;
+
+        uint32_t name_len = colon - line;
+        uint32_t val = name_len + 1;
+        while (val < len && (line[val] == ' ' || line[val] == '\t'))
+            val++;
+        uint32_t val_end = len;
+        while (val_end > val && (line[val_end - 1] == ' ' || line[val_end - 1] == '\t'))
+            val_end--;
+
+        m_headers[m_header_cnt++] = header_span{span{start, name_len}, span{start + val, val_end - val}};
+        return true;
+    }
+
+    kind m_kind;
+    uint32_t m_pos = 0;      // start of the first line not parsed yet
+    uint32_t m_lines = 0;
+    uint32_t m_header_cnt = 0;
+    size_t m_head_len = 0;
+    uint32_t m_status = 0;
+    uint32_t m_minor = 1;
+    std::string_view m_buf;  // the buffer DONE was returned for
+    span m_first[2];         // method and target of a request line
+    header_span m_headers[MAX_HEADERS];
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <charconv>
+#include <string_view>
+
+#include "http_misc.h"
+#include "http_parser.h"
+
+/**
+  The parts of an HTTP/1.x request head the server acts on, string_views into the buffer it was parsed from.
+
+  parse_request() feeds the head received so far to the connection's http_parser (http_parser.h), which picks up
+  where it left off, a head split across reads is WAIT until the rest shows up, the caller keeps the bytes
+  and calls again with more.
+  Only the headers we use are looked at: Content-Length, Transfer-Encoding, Connection, Expect and X-File-Desc
+  (the description stored with a PUT in the spool).
+  */
+struct http_request
+{
+    request_type type = request_type::UNHANDLED;
+    std::string_view method;
+    std::string_view target;
+    uint32_t minor_version = 1;
+    uint64_t content_length = 0;
+    bool has_content_length = false;
+    bool chunked = false;
+    bool keep_alive = true;
+    bool expect_continue = false;
+    std::string_view file_desc;
+    size_t header_len = 0; // request line, headers and the blank line
+};
+
+inline bool iequals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        char x = a[i], y = b[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y)
+            return false;
+    }
+    return true;
+}
+
+/**
+  DONE with req filled in, WAIT for more bytes, FAIL when it isn't HTTP/1.x.
+  The parser is reset after DONE and FAIL, ready for the next head.
+  */
+inline http_11_action parse_request(http_parser &parser, std::string_view buf, http_request &req)
+{
+    http_11_action action = parser.parse(buf);
+    if (action == http_11_action::WAIT)
+        return action;
+    if (action == http_11_action::FAIL)
+    {
+        parser.reset();
+        return action;
+    }
+
+    req = http_request{};
+    req.header_len = parser.head_len();
+    req.method = parser.method();
+    req.target = parser.target();
+    req.type = from_str(req.method);
+    req.minor_version = parser.minor_version();
+    req.keep_alive = req.minor_version >= 1;
+
+    for (uint32_t i = 0; i < parser.header_cnt(); i++)
+    {
+        auto [name, value] = parser.get_header(i);
+
+        if (iequals(name, "content-length"))
+        {
+            // not aton(), a bad client shouldn't put errors in our log
+            auto res = std::from_chars(value.data(), value.data() + value.size(), req.content_length);
+            if (res.ec != std::errc{} || res.ptr != value.data() + value.size())
+                action = http_11_action::FAIL;
+            req.has_content_length = true;
+        }
+        else if (iequals(name, "transfer-encoding"))
+        {
+            req.chunked = !iequals(value, "identity");
+        }
+        else if (iequals(name, "connection"))
+        {
+            if (iequals(value, "close"))
+                req.keep_alive = false;
+            else if (iequals(value, "keep-alive"))
+                req.keep_alive = true;
+        }
+        else if (iequals(name, "expect"))
+        {
+            req.expect_continue = iequals(value, "100-continue");
+        }
+        else if (iequals(name, "x-file-desc"))
+        {
+            req.file_desc = value;
+        }
+    }
+    parser.reset();
+    return action;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <charconv>
+#include <string_view>
+
+#include "http_misc.h"
+#include "http_parser.h"
+#include "http_request.h"
+
+/**
+  The parts of an HTTP/1.x response head a client needs to find the end of the body and whether the
+  connection stays open. Same deal as parse_request(): the client's http_parser picks up where it left off.
+  A chunked body is reported, not decoded, the load generator only talks to servers that send Content-Length.
+  */
+struct http_response
+{
+    uint32_t status = 0;
+    uint32_t minor_version = 1;
+    uint64_t content_length = 0;
+    bool has_content_length = false;
+    bool chunked = false;
+    bool keep_alive = true;
+    size_t header_len = 0; // status line, headers and the blank line
+};
+
+/**
+  DONE with resp filled in, WAIT for more bytes, FAIL when it isn't HTTP/1.x.
+  The parser is reset after DONE and FAIL, ready for the next head.
+  */
+inline http_11_action parse_response(http_parser &parser, std::string_view buf, http_response &resp)
+{
+    http_11_action action = parser.parse(buf);
+    if (action == http_11_action::WAIT)
+        return action;
+    if (action == http_11_action::FAIL)
+    {
+        parser.reset();
+        return action;
+    }
+
+    resp = http_response{};
+    resp.header_len = parser.head_len();
+    resp.status = parser.status();
+    resp.minor_version = parser.minor_version();
+    resp.keep_alive = resp.minor_version >= 1;
+
+    for (uint32_t i = 0; i < parser.header_cnt(); i++)
+    {
+        auto [name, value] = parser.get_header(i);
+
+        if (iequals(name, "content-length"))
+        {
+            auto len = std::from_chars(value.data(), value.data() + value.size(), resp.content_length);
+            if (len.ec != std::errc{} || len.ptr != value.data() + value.size())
+                action = http_11_action::FAIL;
+            resp.has_content_length = true;
+        }
+        else if (iequals(name, "transfer-encoding"))
+        {
+            resp.chunked = !iequals(value, "identity");
+        }
+        else if (iequals(name, "connection"))
+        {
+            if (iequals(value, "close"))
+                resp.keep_alive = false;
+            else if (iequals(value, "keep-alive"))
+                resp.keep_alive = true;
+        }
+    }
+    parser.reset();
+    return action;
+}
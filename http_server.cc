@@ -0,0 +1,2318 @@
+#include "arena.h"
+#include "cpu_placement.h"
+#include "buffer_arena.h"
+#include "get_nanoseconds.h"
+#include "hash.h"
+#include "http_misc.h"
+#include "http_request.h"
+#include "io_uring_wrapper.h"
+#include "log.h"
+#include "misc.h"
+#include "recv_buffers.h"
+#include "spool.h"
+#include "string_view.h"
+#include "timer_wheel.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <deque>
+#include <latch>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+/**
+  http_server: HTTP/1.1 on --rings io_uring rings, GET files from --root, PUT uploads into the spool.
+
+  Each ring has a thread of its own (placed by --placement, see cpu_placement.h) and a listening socket of its
+  own, all of them bound to the same port with SO_REUSEPORT so the kernel spreads connections over the rings.
+  A connection lives and dies on the ring that accepted it, the rings share nothing but the root, the spool
+  and its append point. A thread pinned to one CPU also sets SO_INCOMING_CPU on its listener, connections whose
+  packets come in on that CPU go to the ring running there.
+
+  Everything is driven by CQEs, a ring's thread only ever blocks in wait_events():
+     - one multishot accept on the ring's listening socket, re-armed if the kernel ends it. With --fixed-files
+       sockets are accepted straight into the ring's fixed file table and never get an fd
+     - one multishot recv per connection, data lands in provided buffer rings (recv_buffers.h), requests are
+       parsed in place and buffers go back to the kernel as soon as they're consumed. Recvs are bundles where
+       the kernel has them, one CQE for everything waiting on the socket. There's a ring of small buffers
+       and one of big ones, a connection moves to the big ones while its recvs are big (a PUT body) and
+       back once they're small again (requests heads)
+     - keep-alive and pipelining: requests are answered one at a time in order, whatever arrives meanwhile
+       waits in the connection's queue of received buffers
+     - GET: openat, then reads of the file into a send buffer and sends, the response head rides along with
+       the first chunk of the file. Sends of --zc-kb and up are zero copy (SEND_ZC) out of the registered send
+       buffers, a buffer goes back to the pool when the kernel's notification says it's done with it.
+       Files of --splice-kb and up skip user space: the head goes out on its own,
+       then linked splices move the file through a per connection pipe into the socket
+     - PUT: the body is written to the spool straight out of the receive buffers, a few writevs in flight
+       while more arrives, the record's meta data ahead of it and its hash last, one record per upload appended
+       in the same format copy_file_simple writes (spool.h)
+     - a connection holding --conn-bufs receive buffers it hasn't got through, a PUT body the spool is behind
+       on or pipelined requests waiting for their turn, stops receiving until it has given back half of them,
+       the socket buffer and TCP hold the sender back meanwhile
+
+  A connection's state is one of http_misc.h's http_11_state:
+     READING_REQUEST_HEADERS -> OPENING_GET_FILE -> READING_GET_FILE <-> WRITING_RESPONSE_BODY
+                             -> OPENING_GET_FILE -> WRITING_RESPONSE_HEADERS -> WRITING_RESPONSE_BODY (splice)
+                             -> READING_REQUEST_BODY (PUT) -> WRITING_RESPONSE_HEADERS
+  and back to READING_REQUEST_HEADERS for the next request on the connection.
+
+  When the buffer ring runs dry the kernel ends recvs with -ENOBUFS, those connections are parked until
+  buffers come back, nothing more is read off their sockets in the meantime.
+
+  A connection the peer has sent nothing on for --idle-timeout-ms while we wait on it, between requests
+  or in the middle of one, is closed. The deadlines live in a timer_wheel ticking off one multishot
+  timeout, pushing a connection's deadline back on every recv is a couple of pointer writes.
+  */
+
+namespace
+{
+
+constexpr size_t MAX_HEAD_BYTES = 16 * 1024;
+constexpr uint32_t SPOOL_WRITES = 4; // body writes a connection has in flight
+constexpr uint32_t SPOOL_IOVS = 16;  // receive buffers a body write covers
+constexpr uint64_t WHEEL_TICK_NS = 100 * 1000000ull; // idle timeouts are this precise
+constexpr uint32_t REFUSE_SLOTS = 64; // fixed file slots past --max-conns, for connections being refused
+constexpr uint32_t ZC_SENDS = 4;      // zero copy sends a connection may have waiting on their notification
+
+struct http_config
+{
+    std::string addr = "127.0.0.1";
+    uint16_t port = 8080;
+    std::string root = ".";
+    std::string spool = "http.spool";
+    uint32_t queue_depth = 4096;
+    uint32_t recv_bufs = 1024;
+    size_t recv_buf_sz = 16 * 1024;
+    uint32_t recv_small_bufs = 2048;
+    size_t recv_small_sz = 2 * 1024; // 0 has every connection receive into the big buffers
+    bool recv_bundle = true;
+    uint32_t send_bufs = 256;
+    size_t send_buf_sz = 64 * 1024;
+    size_t splice_min = 64 * 1024; // GETs of at least this many bytes are spliced, 0 never splices
+    size_t pipe_sz = 256 * 1024;   // asked for, the kernel may give a connection's pipe less
+    size_t zc_min = 16 * 1024;     // sends out of a send buffer of at least this many bytes are zero copy, 0 never
+    uint32_t conn_bufs = 64;       // receive buffers a connection may hold before its recv is paused
+    uint64_t prealloc = 64 << 20;  // spool space reserved ahead of the uploads, 0 doesn't
+    uint64_t max_put = 4ULL << 30; // biggest PUT body taken, 0 takes any the spool's offsets can hold
+    uint32_t send_timeout_ms = 30000; // a send or splice to the socket taking longer hangs up, 0 waits forever
+    uint32_t idle_timeout_ms = 60000; // nothing from a peer we're waiting on for this long hangs up, 0 waits forever
+    uint32_t max_conns = 10000;    // per ring
+    uint32_t rings = 1;
+    std::string placement;         // of the ring threads, a cpu_topology::plan() spec
+    bool fixed_files = true;       // accept into the ring's fixed file table
+    bool incoming_cpu = true;      // SO_INCOMING_CPU on the listener of a ring pinned to one CPU
+    bool io_stats = false;
+};
+
+struct http_counters
+{
+    uint64_t accepted = 0;
+    uint64_t refused = 0;
+    uint64_t closed = 0;
+    uint64_t gets = 0;
+    uint64_t puts = 0;
+    uint64_t errors = 0;     // 4xx and 5xx responses
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t spooled = 0;    // PUT body bytes written to the spool
+    uint64_t spliced = 0;    // GET body bytes spliced from the file to the socket
+    uint64_t enobufs = 0;    // recvs ended because the buffer ring was empty
+    uint64_t send_waits = 0; // responses that waited for a send buffer
+    uint64_t recv_pauses = 0; // input arriving faster than we got through it
+    uint64_t send_timeouts = 0; // peers that stopped reading
+    uint64_t idle_closed = 0;   // peers that stopped sending
+    uint64_t regroups = 0;      // recvs moved to another buffer size
+    uint64_t zc_sends = 0;
+    uint64_t zc_copied = 0;     // zero copy sends the kernel copied after all
+};
+
+/**
+  What the rings have in common. The spool's append point is an atomic, a PUT on any ring takes its record's
+  space with one fetch_add. Whichever ring moves spool_reserved past the records fallocates the space it
+  claimed, the others go on appending.
+  */
+struct http_shared
+{
+    ~http_shared()
+    {
+        if (root_fd >= 0)
+            ::close(root_fd);
+        if (spool_fd >= 0)
+            ::close(spool_fd);
+    }
+
+    bool open(const http_config &cfg)
+    {
+        root_fd = ::open(cfg.root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd < 0)
+        {
+            ERROR << "open root " << cfg.root << ": " << ::strerror(errno) << ENDL;
+            return false;
+        }
+
+        spool_fd = ::open(cfg.spool.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        struct stat sb;
+        if (spool_fd < 0 || ::fstat(spool_fd, &sb))
+        {
+            ERROR << "open spool " << cfg.spool << ": " << ::strerror(errno) << ENDL;
+            return false;
+        }
+        // uploads are appended after whatever is there already
+        spool_end = sb.st_size;
+        spool_reserved = sb.st_size;
+        prealloc = cfg.prealloc > 0;
+        return true;
+    }
+
+    int root_fd = -1;
+    int spool_fd = -1;
+    std::atomic<uint64_t> spool_end{0};
+    std::atomic<uint64_t> spool_reserved{0}; // fallocated, or being fallocated, up to here
+    std::atomic<bool> prealloc{true};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> failed{false};         // a ring didn't start, none of them run
+
+    // every ring's fd, for the one reading signals to wake the others up, complete once they've all started
+    std::mutex lock;
+    std::vector<int> ring_fds;
+
+    static constexpr log_module s_log_module = LOG_HTTP;
+};
+
+} // namespace
+
+class http_server;
+class http_conn;
+
+/**
+  What a CQE was for. A connection has one of each so its recv, send, file and spool I/O can be in flight
+  at the same time and each completion still knows what it completed, SPOOL_WRITE has one per body write
+  and SEND_ZC one per zero copy send waiting on its notification.
+  */
+struct http_op
+{
+    enum kind { ACCEPT, SIGNAL, FALLOCATE, TICK, REFUSE, IDLE, RECV, CANCEL, SEND, SEND_ZC, SEND_TIMEOUT, OPEN,
+                FILE, FILE_CLOSE, SPOOL_WRITE, SPOOL_META, SPLICE_IN, SPLICE_OUT, SPLICE_TIMER, SHUTDOWN, CLOSE };
+
+    http_server *server = nullptr;
+    http_conn *conn = nullptr;
+    kind op = ACCEPT;
+    uint32_t idx = 0;
+
+    uint32_t process_io_uring(int res, uint32_t flags);
+};
+
+using http_ring = io_uring_wrapper<http_op>;
+using http_wheel = timer_wheel<http_op>;
+using http_recv_buffers = recv_buffers<http_conn>;
+
+class http_conn
+{
+public:
+    http_conn(http_server *server, int fd, uint32_t slot);
+
+    void start()
+    {
+        touch();
+        arm_recv();
+        maybe_finish_close();
+    }
+
+    uint32_t slot() const { return m_slot; }
+    void set_slot(uint32_t slot) { m_slot = slot; }
+
+    void on_io(const http_op &op, int res, uint32_t flags);
+
+    // the server had nothing for us earlier, now it has
+    void buffers_available();
+    void send_buffer_available();
+
+    // server shutting down, drop everything without waiting on the ring
+    void abandon();
+
+private:
+    static constexpr log_module s_log_module = LOG_HTTP;
+
+    struct recv_chunk
+    {
+        uint16_t bid = 0;
+        uint8_t cls = 0;     // recv_buffers class
+        uint32_t off = 0;
+        uint32_t len = 0;
+    };
+
+    // a writev of body bytes, whole receive buffers or the part of one the body ends in
+    struct spool_write
+    {
+        http_op op;
+        iovec iov[SPOOL_IOVS];
+        uint32_t iov_cnt = 0;
+        uint32_t iov_done = 0; // iovecs short writes got all the way through
+        uint64_t off = 0;      // where its next byte goes in the spool
+        uint64_t bytes = 0;    // body bytes it covers, off the front of m_chunks once it and the ones before are done
+        bool done = false;
+    };
+
+    // a zero copy send, buf isn't to be touched until its notification
+    struct zc_send
+    {
+        http_op op;
+        char *buf = nullptr; // nullptr when the slot is free
+    };
+
+    bool track(bool ok);
+    bool sock_op(bool ok);
+    void arm_recv();
+    void pause_recv();
+    void cancel_recv();
+    void regroup();
+    void on_recv(int res, uint32_t flags);
+    void touch();
+    void on_idle();
+    void on_send(int res);
+    void on_send_zc(uint32_t idx, int res, uint32_t flags);
+    void zc_done(uint32_t idx);
+    bool zc_busy(const char *buf) const;
+    void on_open(int res);
+    void on_file(int res);
+    void on_spool_write(uint32_t idx, int res);
+    void on_meta_write(int res);
+    void spool_write_failed(int res);
+    void on_splice_in(int res);
+    void on_splice_out(int res);
+
+    void process_input();
+    bool read_head();
+    void start_request(const http_request &req);
+    void start_get();
+    void start_put(const http_request &req);
+    void begin_body();
+    bool open_pipe();
+    void begin_splice();
+    void splice_next();
+    void arm_splice_timer();
+    void on_splice_timer(int res);
+    void cancel_splice_timer();
+    void write_body();
+    bool queue_write();
+    void write_meta();
+    void write_hash();
+
+    void respond(int status, std::string_view reason, bool keep_alive = true, std::string_view extra = {});
+    void send_out(const char *buf, size_t len, int flags = 0);
+    bool prep_send_next();
+    void read_next();
+    void drop_send_buf();
+    void send_deadline();
+    void send_done();
+    void finish_request();
+    void close_file();
+    void close_pipe();
+    void close_conn();
+    void maybe_finish_close();
+
+    std::string_view chunk_data(const recv_chunk &chunk);
+    void consume(size_t bytes);
+    void drop_input();
+
+private:
+    http_server *m_server = nullptr;
+    http_ring *m_ring = nullptr;
+    int m_fd = -1;
+    uint32_t m_slot = 0;
+
+    http_op m_recv_op;
+    http_op m_send_op;
+    http_op m_send_timeout_op;
+    http_op m_open_op;
+    http_op m_file_op;
+    http_op m_file_close_op;
+    http_op m_cancel_op;
+    http_op m_meta_op;
+    http_op m_splice_in_op;
+    http_op m_splice_out_op;
+    http_op m_splice_timer_op;
+    http_op m_shutdown_op;
+    http_op m_close_op;
+    http_op m_idle_op;
+    http_wheel::timer m_idle_timer;
+    bool m_fixed = false;    // m_fd is a slot in the ring's fixed file table
+
+    http_11_state m_state = http_11_state::READING_REQUEST_HEADERS;
+    uint32_t m_inflight = 0; // ops we still expect a (last) CQE for, the recv counts while it's armed
+    bool m_recv_armed = false;
+    bool m_recv_paused = false; // PUT body writes are behind, recv is cancelled until they catch up
+    bool m_recv_cancel = false; // a cancel is on its way to the recv
+    uint32_t m_class = 0;       // the receive buffer class our recvs fit
+    uint32_t m_recv_class = 0;  // the one the armed recv takes from, another if ours ran out
+    uint32_t m_recv_avg = 0;    // recent recv sizes, bytes
+    bool m_peer_closed = false;
+    bool m_closing = false;
+    bool m_close_sent = false;
+    bool m_keep_alive = true;
+    bool m_interim = false;  // sending 100 Continue
+    bool m_waiting = false;  // on one of the server's wait lists
+
+    std::deque<recv_chunk> m_chunks; // received and not consumed yet, in order
+    std::string m_head;              // a request head split across buffers
+    http_parser m_parser{http_parser::REQUEST};
+
+    // the request being answered
+    std::string m_path;
+    std::string m_out;        // response heads that don't come with a body
+    char *m_send_buf = nullptr;
+    const char *m_send_ptr = nullptr;
+    size_t m_send_left = 0;
+    int m_send_flags = 0;
+    zc_send m_zc[ZC_SENDS];
+    size_t m_head_len = 0;    // response head bytes at the front of m_send_buf
+    int m_file_fd = -1;
+    uint64_t m_file_size = 0;
+    uint64_t m_file_off = 0;
+
+    // spliced GET, the pipe is made by the first one and kept for the connection's next ones
+    int m_pipe[2] = {-1, -1};
+    size_t m_pipe_sz = 0;
+    uint64_t m_pipe_bytes = 0; // in the pipe, not in the socket yet
+    bool m_splicing = false;
+    bool m_splice_timer = false; // see arm_splice_timer()
+    bool m_splice_moved = false; // bytes went out since the timer was armed
+
+    // PUT
+    std::string m_name;
+    std::string m_desc;
+    std::string m_meta;
+    file_meta_data m_meta_data;
+    uint64_t m_record_off = 0;
+    uint64_t m_body_off = 0;  // where the next body byte goes in the spool
+    uint64_t m_body_left = 0;
+    uint64_t m_hash = 0;
+    uint64_t m_body_queued = 0; // body bytes at the front of m_chunks the writes in flight cover
+    spool_write m_writes[SPOOL_WRITES];
+    uint32_t m_write_first = 0; // oldest of the writes in flight
+    uint32_t m_write_cnt = 0;
+    bool m_write_failed = false;
+    bool m_meta_writing = false; // the header or, once it's written, the hash
+    bool m_meta_written = false; // the header, with file_hash 0
+    bool m_hash_written = false;
+    const char *m_write_ptr = nullptr; // the meta data not written yet
+    size_t m_write_left = 0;
+    uint64_t m_meta_off = 0;           // and where it goes
+};
+
+class http_server
+{
+public:
+    // made on the ring's own thread, after apply_placement(), so the buffers land on its node
+    http_server(const http_config &cfg, http_shared &shared, uint32_t id, const thread_placement &placement)
+        : m_cfg(cfg),
+          m_shared(shared),
+          m_id(id),
+          m_placement(placement),
+          m_ring(cfg.queue_depth),
+          m_wheel(m_ring, &m_tick_op, WHEEL_TICK_NS),
+          m_send_buffers(cfg.send_buf_sz, cfg.send_bufs, buffer_arena::NORMAL, placement.node)
+    {
+        m_accept_op.server = this;
+        m_accept_op.op = http_op::ACCEPT;
+        m_signal_op.server = this;
+        m_signal_op.op = http_op::SIGNAL;
+        m_falloc_op.server = this;
+        m_falloc_op.op = http_op::FALLOCATE;
+        m_tick_op.server = this;
+        m_tick_op.op = http_op::TICK;
+        m_refuse_op.server = this;
+        m_refuse_op.op = http_op::REFUSE;
+        if (cfg.recv_small_sz && cfg.recv_small_sz < cfg.recv_buf_sz)
+            m_recv.add_class(cfg.recv_small_bufs, cfg.recv_small_sz, buffer_arena::NORMAL, placement.node);
+        m_recv.add_class(cfg.recv_bufs, cfg.recv_buf_sz, buffer_arena::NORMAL, placement.node);
+        m_send_ts.tv_sec = cfg.send_timeout_ms / 1000;
+        m_send_ts.tv_nsec = (cfg.send_timeout_ms % 1000) * 1000000ll;
+    }
+
+    ~http_server()
+    {
+        for (auto conn : m_conns)
+        {
+            conn->abandon();
+            m_pool.release(conn);
+        }
+        if (m_listen_fd >= 0)
+            ::close(m_listen_fd);
+        if (m_signal_fd >= 0)
+            ::close(m_signal_fd);
+    }
+
+    /**
+      Signals are blocked in every thread, the ring given them reads them off a signalfd and wakes the others,
+      see main(). The rest get nullptr.
+      */
+    bool start(const sigset_t *signals)
+    {
+        if (!m_ring.is_valid() || !m_send_buffers.is_valid())
+            return false;
+
+        if (m_placement.pinned())
+            m_ring.set_iowq_affinity(m_placement.cpus);
+
+        if (m_cfg.io_stats)
+            m_ring.enable_stats();
+
+        if (!m_recv.setup(m_ring, 0))
+            return false;
+
+        // zero copy sends out of registered buffers don't pin their pages every time, it works without too
+        if (m_cfg.zc_min)
+            m_send_buffers.register_with(m_ring);
+        m_bundle = m_cfg.recv_bundle && m_ring.recv_bundle_ok();
+
+        // room for the connections we keep and a few refused ones waiting for their close
+        if (m_cfg.fixed_files)
+        {
+            m_fixed = m_ring.register_files_sparse(m_cfg.max_conns + REFUSE_SLOTS);
+            if (!m_fixed)
+            {
+                WARN << "ring " << m_id << ": no fixed file table, accepting into plain fds" << ENDL;
+            }
+        }
+
+        if (signals)
+        {
+            m_signal_fd = ::signalfd(-1, signals, SFD_CLOEXEC);
+            if (m_signal_fd < 0)
+            {
+                ERROR << "signalfd: " << ::strerror(errno) << ENDL;
+                return false;
+            }
+        }
+
+        if (!listen_on())
+            return false;
+
+        if (m_cfg.idle_timeout_ms && !prepped(m_wheel.start()))
+            return false;
+
+        if (m_signal_fd >= 0 && !prepped(m_ring.prep_read(m_signal_fd, reinterpret_cast<char*>(&m_siginfo), sizeof(m_siginfo), 0, &m_signal_op)))
+            return false;
+
+        return arm_accept() && m_ring.submit() >= 0;
+    }
+
+    int ring_fd() const { return m_ring.ring_fd(); }
+
+    void run()
+    {
+        std::string recv_bufs;
+        for (uint32_t cls = 0; cls < m_recv.classes(); cls++)
+            recv_bufs += (cls ? " + " : "") + std::to_string(m_recv.get(cls).cnt()) + " x " + std::to_string(m_recv.get(cls).buf_size());
+        TRACE << "ring " << m_id << " listening on " << m_cfg.addr << ":" << m_cfg.port << ", root: " << m_cfg.root << ", spool: " << m_cfg.spool
+              << ", recv buffers: " << recv_bufs << (m_bundle ? " bundled" : "")
+              << ", send buffers: " << m_send_buffers.slot_cnt() << " x " << m_send_buffers.slot_size()
+              << (m_send_buffers.registered() ? " registered" : "")
+              << ", fixed files: " << (m_fixed ? "yes" : "no") << ", incoming cpu: " << m_incoming_cpu << ENDL;
+
+        // a wakeup from the ring that got the signal is what gets us out of wait_events()
+        while (!m_stop && !m_shared.stop.load(std::memory_order_relaxed))
+            m_ring.wait_events();
+
+        TRACE << "ring " << m_id << " connections accepted: " << m_counters.accepted << ", refused: " << m_counters.refused
+              << ", closed: " << m_counters.closed << ", open: " << m_conns.size()
+              << ", GETs: " << m_counters.gets << ", PUTs: " << m_counters.puts << ", errors: " << m_counters.errors
+              << ", bytes in: " << m_counters.bytes_in << ", bytes out: " << m_counters.bytes_out
+              << ", spooled: " << m_counters.spooled << ", spliced: " << m_counters.spliced
+              << ", recv out of buffers: " << m_counters.enobufs
+              << ", waits for a send buffer: " << m_counters.send_waits
+              << ", recv paused: " << m_counters.recv_pauses
+              << ", send timeouts: " << m_counters.send_timeouts << ", idle closed: " << m_counters.idle_closed
+              << ", recvs moved to another buffer size: " << m_counters.regroups
+              << ", zero copy sends: " << m_counters.zc_sends << ", copied anyway: " << m_counters.zc_copied << ENDL;
+        if (m_ring.stats())
+            m_ring.stats()->trace("http ring " + std::to_string(m_id));
+    }
+
+    uint32_t on_accept(int res, uint32_t flags)
+    {
+        uint64_t before = m_prepped;
+        if (res >= 0)
+        {
+            // res is a fixed file slot with --fixed-files, TCP_NODELAY came from the listener either way
+            if (m_conns.size() >= m_cfg.max_conns)
+            {
+                m_counters.refused++;
+                if (!m_fixed)
+                    ::close(res);
+                else if (!prepped(m_ring.prep_close_fixed(res, &m_refuse_op)))
+                    m_ring.set_fixed_file(res, -1);
+            }
+            else
+            {
+                http_conn *conn = m_pool.create(this, res, m_conns.size());
+                m_conns.push_back(conn);
+                m_counters.accepted++;
+                conn->start();
+            }
+        }
+        else if (res == -ENFILE && m_fixed)
+        {
+            // the fixed file table is full of refused connections still closing, the kernel dropped this one
+            m_counters.refused++;
+            DEBUG(1) << "ring " << m_id << " accept: no free fixed file slot" << ENDL;
+        }
+        else
+        {
+            WARN << "accept: " << ::strerror(-res) << ENDL;
+        }
+
+        if (!(flags & IORING_CQE_F_MORE) && !m_stop)
+            arm_accept();
+        return m_prepped != before;
+    }
+
+    uint32_t on_signal(int res)
+    {
+        if (res < 0)
+        {
+            ERROR << "signalfd read: " << ::strerror(-res) << ENDL;
+        }
+        else
+        {
+            TRACE << "got signal " << m_siginfo.ssi_signo << ", stopping" << ENDL;
+        }
+        m_stop = true;
+        m_shared.stop = true;
+
+        // the other rings may be asleep in wait_events()
+        uint32_t events = 0;
+        for (int fd : m_shared.ring_fds)
+        {
+            if (fd != m_ring.ring_fd())
+                events += m_ring.prep_wakeup(fd);
+        }
+        return events;
+    }
+
+    uint32_t on_refuse(int res)
+    {
+        if (res < 0)
+        {
+            WARN << "close refused connection: " << ::strerror(-res) << ENDL;
+        }
+        return 0;
+    }
+
+    uint32_t on_tick(int res, uint32_t flags)
+    {
+        uint64_t before = m_prepped;
+        m_wheel.on_tick(res, flags);
+        return m_prepped != before;
+    }
+
+    uint32_t on_fallocate(int res)
+    {
+        // the first ring to find out says so
+        if (res < 0 && m_shared.prealloc.exchange(false))
+            WARN << "fallocate spool: " << ::strerror(-res) << ", not reserving spool space from now on" << ENDL;
+        return 0;
+    }
+
+    // connections count every SQE they prep, so process_io_uring can tell the ring whether to submit
+    bool prepped(bool ok)
+    {
+        m_prepped += ok;
+        return ok;
+    }
+    uint64_t prepped() const { return m_prepped; }
+
+    http_ring& ring() { return m_ring; }
+    http_recv_buffers& recv() { return m_recv; }
+    bool bundle() const { return m_bundle; }
+    size_t send_buf_size() const { return m_send_buffers.slot_size(); }
+    const http_config& cfg() const { return m_cfg; }
+    bool fixed_files() const { return m_fixed; }
+
+    // splicing is on until a file system turns out not to support it
+    bool splice_ok(uint64_t size) const { return m_splice && size >= m_cfg.splice_min; }
+    void splice_failed(int err)
+    {
+        if (!m_splice)
+            return;
+        WARN << "splice: " << ::strerror(err) << ", serving GETs through send buffers from now on" << ENDL;
+        m_splice = false;
+    }
+    http_wheel& wheel() { return m_wheel; }
+
+    // zero copy is on until the kernel turns out not to have it
+    bool zc_ok(size_t len) const { return m_zc && len >= m_cfg.zc_min; }
+    void zc_failed(int err)
+    {
+        if (!m_zc)
+            return;
+        WARN << "send zc: " << ::strerror(err) << ", copying sends from now on" << ENDL;
+        m_zc = false;
+    }
+
+    // buf is in a send buffer
+    bool prep_send_zc(int fd, const char *buf, size_t len, int flags, http_op *op)
+    {
+        return prepped(m_ring.prep_send_zc(fd, buf, len, flags, op, m_send_buffers.buf_index(buf), IORING_SEND_ZC_REPORT_USAGE));
+    }
+    uint64_t idle_timeout_ns() const { return m_cfg.idle_timeout_ms * 1000000ull; }
+
+    // nullptr when sends wait forever
+    __kernel_timespec* send_timeout() { return m_cfg.send_timeout_ms ? &m_send_ts : nullptr; }
+    int root_fd() const { return m_shared.root_fd; }
+    int spool_fd() const { return m_shared.spool_fd; }
+    http_counters& counters() { return m_counters; }
+
+    void wait_for_buffers(http_conn *conn)
+    {
+        m_counters.enobufs++;
+        m_recv.wait(conn);
+    }
+
+    // nullptr means conn is queued and gets send_buffer_available() when one is released
+    char* acquire_send_buffer(http_conn *conn)
+    {
+        char *buf = m_send_buffers.acquire();
+        if (!buf)
+        {
+            m_counters.send_waits++;
+            m_send_waiters.push_back(conn);
+        }
+        return buf;
+    }
+
+    void release_send_buffer(char *buf)
+    {
+        m_send_buffers.release(buf);
+        if (!m_send_waiters.empty())
+        {
+            http_conn *conn = m_send_waiters.front();
+            m_send_waiters.pop_front();
+            conn->send_buffer_available();
+        }
+    }
+
+    void forget_waiter(http_conn *conn)
+    {
+        m_recv.forget(conn);
+        std::erase(m_send_waiters, conn);
+    }
+
+    /**
+      Where a record of bytes goes, records are appended in the order PUTs start, whichever ring they're on.
+      Once the records get near the end of the space reserved, another --spool-prealloc-mb past them is
+      fallocated (keeping the file size), so body writes landing out of order don't each go allocate blocks
+      and the spool doesn't end up in pieces all over the disk.
+      */
+    uint64_t allocate_spool(uint64_t bytes)
+    {
+        uint64_t off = m_shared.spool_end.fetch_add(bytes);
+        uint64_t end = off + bytes;
+
+        uint64_t reserved = m_shared.spool_reserved.load();
+        if (m_shared.prealloc.load(std::memory_order_relaxed) && end + m_cfg.prealloc / 2 > reserved)
+        {
+            uint64_t target = end + m_cfg.prealloc;
+            // the ring that moves the mark fallocates what it claimed, a failed prep leaves a gap that's simply not reserved
+            if (m_shared.spool_reserved.compare_exchange_strong(reserved, target))
+                prepped(m_ring.prep_fallocate(m_shared.spool_fd, FALLOC_FL_KEEP_SIZE, reserved, target - reserved, &m_falloc_op));
+        }
+        return off;
+    }
+
+    // the connection is closed and nothing of it is in flight
+    void release(http_conn *conn)
+    {
+        uint32_t slot = conn->slot();
+        m_conns[slot] = m_conns.back();
+        m_conns[slot]->set_slot(slot);
+        m_conns.pop_back();
+        m_pool.release(conn);
+        m_counters.closed++;
+    }
+
+private:
+    static constexpr log_module s_log_module = LOG_HTTP;
+
+    bool listen_on()
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_cfg.port);
+        if (::inet_pton(AF_INET, m_cfg.addr.c_str(), &addr.sin_addr) != 1)
+        {
+            ERROR << "bad --addr: " << m_cfg.addr << ENDL;
+            return false;
+        }
+
+        // every ring binds its own socket to the port, accepted sockets inherit TCP_NODELAY
+        m_listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (m_listen_fd < 0
+            || ::setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+            || ::setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+            || ::setsockopt(m_listen_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+        {
+            ERROR << "listening socket: " << ::strerror(errno) << ENDL;
+            return false;
+        }
+
+        // pinned to one CPU, ask for the connections whose packets that CPU handles, a hint the kernel may ignore
+        if (m_cfg.incoming_cpu && m_placement.pinned() && CPU_COUNT(&m_placement.cpus) == 1)
+        {
+            int cpu = 0;
+            while (!CPU_ISSET(cpu, &m_placement.cpus))
+                cpu++;
+            if (::setsockopt(m_listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)))
+            {
+                WARN << "ring " << m_id << " SO_INCOMING_CPU " << cpu << ": " << ::strerror(errno) << ENDL;
+            }
+            else
+            {
+                m_incoming_cpu = cpu;
+            }
+        }
+
+        if (::bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || ::listen(m_listen_fd, 1024))
+        {
+            ERROR << "listen on " << m_cfg.addr << ":" << m_cfg.port << ": " << ::strerror(errno) << ENDL;
+            return false;
+        }
+        return true;
+    }
+
+    bool arm_accept()
+    {
+        if (m_fixed)
+            return prepped(m_ring.prep_multishot_accept_direct(m_listen_fd, &m_accept_op));
+        return prepped(m_ring.prep_multishot_accept(m_listen_fd, &m_accept_op));
+    }
+
+private:
+    http_config m_cfg;
+    http_shared &m_shared;
+    uint32_t m_id = 0;
+    thread_placement m_placement;
+    http_ring m_ring;
+    http_wheel m_wheel;         // before the connections, their timers unlink from it
+    http_recv_buffers m_recv;   // after the ring, its buffer rings have to be given back before the ring goes
+    buffer_arena m_send_buffers;
+    http_op m_accept_op;
+    http_op m_signal_op;
+    http_op m_falloc_op;
+    http_op m_tick_op;
+    http_op m_refuse_op;
+    __kernel_timespec m_send_ts{};
+    int m_signal_fd = -1;
+    signalfd_siginfo m_siginfo{};
+    bool m_stop = false;
+    bool m_splice = m_cfg.splice_min > 0;
+    bool m_zc = m_cfg.zc_min > 0;
+    bool m_fixed = false;       // connections are fixed file slots
+    bool m_bundle = false;      // recvs are bundles
+    int m_incoming_cpu = -1;
+    int m_listen_fd = -1;
+    uint64_t m_prepped = 0;
+    slab_pool<http_conn> m_pool;
+    std::vector<http_conn*> m_conns;
+    std::deque<http_conn*> m_send_waiters;
+    http_counters m_counters;
+};
+
+uint32_t http_op::process_io_uring(int res, uint32_t flags)
+{
+    if (op == ACCEPT)
+        return server->on_accept(res, flags);
+    if (op == SIGNAL)
+        return server->on_signal(res);
+    if (op == FALLOCATE)
+        return server->on_fallocate(res);
+    if (op == TICK)
+        return server->on_tick(res, flags);
+    if (op == REFUSE)
+        return server->on_refuse(res);
+
+    uint64_t before = server->prepped();
+    conn->on_io(*this, res, flags);
+    return server->prepped() != before;
+}
+
+http_conn::http_conn(http_server *server, int fd, uint32_t slot)
+    : m_server(server),
+      m_ring(&server->ring()),
+      m_fd(fd),
+      m_slot(slot),
+      m_fixed(server->fixed_files())
+{
+    m_recv_op = http_op{server, this, http_op::RECV};
+    m_send_op = http_op{server, this, http_op::SEND};
+    for (uint32_t i = 0; i < ZC_SENDS; i++)
+        m_zc[i].op = http_op{server, this, http_op::SEND_ZC, i};
+    m_send_timeout_op = http_op{server, this, http_op::SEND_TIMEOUT};
+    m_open_op = http_op{server, this, http_op::OPEN};
+    m_file_op = http_op{server, this, http_op::FILE};
+    m_file_close_op = http_op{server, this, http_op::FILE_CLOSE};
+    m_cancel_op = http_op{server, this, http_op::CANCEL};
+    m_meta_op = http_op{server, this, http_op::SPOOL_META};
+    for (uint32_t i = 0; i < SPOOL_WRITES; i++)
+        m_writes[i].op = http_op{server, this, http_op::SPOOL_WRITE, i};
+    m_splice_in_op = http_op{server, this, http_op::SPLICE_IN};
+    m_splice_out_op = http_op{server, this, http_op::SPLICE_OUT};
+    m_splice_timer_op = http_op{server, this, http_op::SPLICE_TIMER};
+    m_shutdown_op = http_op{server, this, http_op::SHUTDOWN};
+    m_close_op = http_op{server, this, http_op::CLOSE};
+    m_idle_op = http_op{server, this, http_op::IDLE};
+    m_idle_timer.set_event(&m_idle_op);
+}
+
+bool http_conn::track(bool ok)
+{
+    m_inflight += ok;
+    return m_server->prepped(ok);
+}
+
+// the op just prepped on the socket names it by its fixed file slot
+bool http_conn::sock_op(bool ok)
+{
+    if (ok && m_fixed)
+        m_ring->fixed_file();
+    return ok;
+}
+
+void http_conn::arm_recv()
+{
+    if (m_recv_armed || m_recv_paused || m_closing || m_peer_closed)
+        return;
+    // our class, unless it's about out and another isn't, then the kernel's -ENOBUFS gets us parked
+    int cls = m_server->recv().pick(m_class);
+    m_recv_class = cls < 0 ? m_class : cls;
+    m_recv_armed = track(sock_op(m_ring->prep_recv_multishot(m_fd, m_server->recv().get(m_recv_class).group(),
+                                                             &m_recv_op, m_server->bundle())));
+    if (!m_recv_armed)
+        close_conn();
+}
+
+/**
+  Input is coming in faster than we get through it, a PUT body the spool is behind on or a peer pipelining
+  requests while we're still answering one. Rather than let it eat the buffer ring, the recv is cancelled and
+  only re-armed by consume() once half the buffers have been given back.
+  */
+void http_conn::pause_recv()
+{
+    if (m_recv_paused || !m_recv_armed || m_closing)
+        return;
+    m_recv_paused = true;
+    m_server->counters().recv_pauses++;
+    DEBUG(2) << "fd: " << m_fd << " pausing recv, holding " << m_chunks.size() << " buffers" << ENDL;
+    cancel_recv();
+}
+
+// the recv ends with -ECANCELED and on_recv() re-arms it as things stand then, a send in flight is left alone
+void http_conn::cancel_recv()
+{
+    if (m_recv_cancel)
+        return;
+    m_recv_cancel = true;
+    if (!track(m_ring->prep_cancel(&m_recv_op, 0, &m_cancel_op)))
+        close_conn();
+}
+
+/**
+  Recv sizes moved our average out of the buffer class we're in, the recv is cancelled and re-armed on the
+  class it fits. A recv already on that class, because ours ran out, stays where it is.
+  */
+void http_conn::regroup()
+{
+    uint32_t cls = m_server->recv().fit(m_class, m_recv_avg);
+    if (cls == m_class)
+        return;
+    m_class = cls;
+    if (!m_recv_armed || m_recv_class == cls || m_closing)
+        return;
+    m_server->counters().regroups++;
+    DEBUG(2) << "fd: " << m_fd << " recvs average " << m_recv_avg << " bytes, moving to buffer class " << cls << ENDL;
+    cancel_recv();
+}
+
+void http_conn::buffers_available()
+{
+    m_waiting = false;
+    arm_recv();
+}
+
+void http_conn::send_buffer_available()
+{
+    m_waiting = false;
+    if (m_closing)
+        return;
+    if (m_state == http_11_state::OPENING_GET_FILE && m_file_fd >= 0)
+        begin_body();
+    else if (m_state == http_11_state::READING_GET_FILE)
+        read_next();
+}
+
+void http_conn::on_io(const http_op &op, int res, uint32_t flags)
+{
+    DEBUGF(3, "fd: {}, op: {}, res: {}, flags: {}, state: {}", m_fd, static_cast<int>(op.op), res, flags, to_str(m_state));
+    switch (op.op) {
+    case http_op::RECV:
+        on_recv(res, flags);
+        break;
+    case http_op::IDLE:
+        on_idle();
+        break;
+    case http_op::CANCEL:
+        // -ENOENT, what it was after had ended already
+        m_inflight--;
+        if (res < 0 && res != -ENOENT)
+            DEBUG(1) << "cancel recv: " << ::strerror(-res) << ENDL;
+        break;
+    case http_op::SEND:
+        m_inflight--;
+        on_send(res);
+        break;
+    case http_op::SEND_ZC:
+        on_send_zc(op.idx, res, flags);
+        break;
+    case http_op::SEND_TIMEOUT:
+        // -ECANCELED when the send finished in time, the send itself sees -ECANCELED when it didn't
+        m_inflight--;
+        if (res == -ETIME)
+        {
+            m_server->counters().send_timeouts++;
+            DEBUG(1) << "fd: " << m_fd << " send timed out" << ENDL;
+        }
+        break;
+    case http_op::OPEN:
+        m_inflight--;
+        on_open(res);
+        break;
+    case http_op::FILE:
+        m_inflight--;
+        on_file(res);
+        break;
+    case http_op::FILE_CLOSE:
+        m_inflight--;
+        if (res < 0)
+            WARN << "close: " << ::strerror(-res) << ENDL;
+        break;
+    case http_op::SPOOL_WRITE:
+        m_inflight--;
+        on_spool_write(op.idx, res);
+        break;
+    case http_op::SPOOL_META:
+        m_inflight--;
+        on_meta_write(res);
+        break;
+    case http_op::SPLICE_IN:
+        m_inflight--;
+        on_splice_in(res);
+        break;
+    case http_op::SPLICE_OUT:
+        m_inflight--;
+        on_splice_out(res);
+        break;
+    case http_op::SPLICE_TIMER:
+        m_inflight--;
+        on_splice_timer(res);
+        break;
+    case http_op::SHUTDOWN:
+        // -ENOTCONN when the peer beat us to it
+        m_inflight--;
+        break;
+    case http_op::CLOSE:
+        // last thing we ever do, nothing else is in flight
+        m_server->release(this);
+        return;
+    case http_op::ACCEPT:
+    case http_op::SIGNAL:
+    case http_op::FALLOCATE:
+    case http_op::TICK:
+    case http_op::REFUSE:
+        break;
+    };
+
+    maybe_finish_close();
+}
+
+void http_conn::on_recv(int res, uint32_t flags)
+{
+    if (res > 0)
+    {
+        m_server->counters().bytes_in += res;
+        touch();
+        // a bundle is several buffers
+        m_server->recv().received(m_recv_class, res, flags, [this](uint16_t bid, uint32_t len) {
+            m_chunks.push_back(recv_chunk{bid, static_cast<uint8_t>(m_recv_class), 0, len});
+        });
+        m_recv_avg = (m_recv_avg * 7 + res) / 8;
+        // whatever state we're in, a PUT body or pipelined requests alike
+        if (m_chunks.size() >= m_server->cfg().conn_bufs)
+            pause_recv();
+        else
+            regroup();
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        m_inflight--;
+        m_recv_armed = false;
+        m_recv_cancel = false;
+
+        if (res == 0)
+        {
+            m_peer_closed = true;
+        }
+        else if (res == -ECANCELED)
+        {
+            // paused, unless the writes caught up before the cancel got to it, or moved to another class
+            arm_recv();
+        }
+        else if (res == -ENOBUFS)
+        {
+            if (!m_closing)
+            {
+                m_waiting = true;
+                m_server->wait_for_buffers(this);
+            }
+        }
+        else if (res < 0)
+        {
+            // reset by the peer or we shut it down ourselves
+            DEBUG(1) << "recv: " << ::strerror(-res) << ENDL;
+            m_peer_closed = true;
+            close_conn();
+        }
+        else
+        {
+            arm_recv();
+        }
+    }
+
+    process_input();
+}
+
+// the peer is alive, its idle deadline starts over
+void http_conn::touch()
+{
+    if (uint64_t ns = m_server->idle_timeout_ns())
+        m_server->wheel().arm(m_idle_timer, ns);
+}
+
+/**
+  Nothing from the peer for the idle timeout. It only counts when we're waiting on the peer: for the next
+  request, the rest of a head or a body. A connection busy answering, parked for buffers or with its recv
+  paused gets another round.
+  */
+void http_conn::on_idle()
+{
+    if (m_closing)
+        return;
+
+    bool on_peer = m_state == http_11_state::READING_REQUEST_HEADERS
+        || (m_state == http_11_state::READING_REQUEST_BODY && !m_recv_paused && !m_write_cnt);
+    if (!on_peer || m_waiting)
+    {
+        touch();
+        return;
+    }
+    m_server->counters().idle_closed++;
+    DEBUG(1) << "fd: " << m_fd << " idle, closing" << ENDL;
+    close_conn();
+}
+
+std::string_view http_conn::chunk_data(const recv_chunk &chunk)
+{
+    return std::string_view(m_server->recv().buffer(chunk.cls, chunk.bid) + chunk.off, chunk.len);
+}
+
+// bytes off the front of the oldest chunk, its buffer goes back to the kernel once it's empty
+void http_conn::consume(size_t bytes)
+{
+    recv_chunk &chunk = m_chunks.front();
+    chunk.off += bytes;
+    chunk.len -= bytes;
+    if (chunk.len == 0)
+    {
+        uint16_t bid = chunk.bid;
+        uint32_t cls = chunk.cls;
+        m_chunks.pop_front();
+        m_server->recv().recycle(cls, bid);
+
+        if (m_recv_paused && m_chunks.size() <= m_server->cfg().conn_bufs / 2)
+        {
+            m_recv_paused = false;
+            arm_recv();
+        }
+    }
+}
+
+void http_conn::drop_input()
+{
+    while (!m_chunks.empty())
+        consume(m_chunks.front().len);
+    m_head.clear();
+    m_parser.reset();
+}
+
+void http_conn::process_input()
+{
+    while (!m_closing)
+    {
+        if (m_state == http_11_state::READING_REQUEST_HEADERS)
+        {
+            if (!read_head())
+                break;
+        }
+        else if (m_state == http_11_state::READING_REQUEST_BODY)
+        {
+            write_body();
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // the peer is done sending and everything it sent has been answered
+    if (m_peer_closed && !m_closing && m_state == http_11_state::READING_REQUEST_HEADERS && m_chunks.empty())
+        close_conn();
+}
+
+/**
+  Parse the next request head. Usually it's all in the front chunk and is parsed right there,
+  one split across chunks is gathered in m_head first and m_parser carries on from the last complete line.
+  false when there's nothing more to do for now.
+  */
+bool http_conn::read_head()
+{
+    if (m_chunks.empty())
+        return false;
+
+    std::string_view data = chunk_data(m_chunks.front());
+    size_t prev = m_head.size();
+    http_request req;
+    http_11_action action;
+    if (prev == 0)
+    {
+        action = parse_request(m_parser, data, req);
+    }
+    else
+    {
+        m_head.append(data);
+        action = parse_request(m_parser, m_head, req);
+    }
+
+    if ((action == http_11_action::WAIT && prev + data.size() > MAX_HEAD_BYTES)
+        || (action == http_11_action::DONE && req.header_len > MAX_HEAD_BYTES))
+    {
+        drop_input();
+        respond(431, "Request Header Fields Too Large", false);
+        return false;
+    }
+
+    switch (action) {
+    case http_11_action::WAIT:
+        if (prev == 0)
+            m_head.assign(data);
+        consume(data.size());
+        return true;
+    case http_11_action::DONE:
+        // everything start_request() needs is copied out before the buffer holding it is recycled
+        start_request(req);
+        consume(req.header_len - prev);
+        m_head.clear();
+        return true;
+    default:
+        drop_input();
+        respond(400, "Bad Request", false);
+        return false;
+    };
+}
+
+void http_conn::start_request(const http_request &req)
+{
+    m_keep_alive = req.keep_alive;
+
+    switch (req.type) {
+    case request_type::GET:
+        if (req.content_length || req.chunked)
+        {
+            // we don't read past a GET's body, the next request would start in the middle of it
+            respond(400, "Bad Request", false);
+            return;
+        }
+        m_path = req.target;
+        start_get();
+        return;
+    case request_type::PUT:
+        if (req.chunked || !req.has_content_length)
+        {
+            respond(411, "Length Required", false);
+            return;
+        }
+        start_put(req);
+        return;
+    default:
+        // whatever body it has is unread, so the connection can't carry on
+        respond(405, "Method Not Allowed", false, "Allow: GET, PUT\r\n");
+        return;
+    };
+}
+
+void http_conn::start_get()
+{
+    m_server->counters().gets++;
+
+    // the path under root, no query string, no way out of root
+    m_path.erase(0, m_path.find_first_not_of('/'));
+    m_path.erase(std::min(m_path.find('?'), m_path.size()));
+    if (m_path.empty())
+        m_path = "index.html";
+    if (m_path == ".." || m_path.starts_with("../") || m_path.find("/../") != std::string::npos
+        || m_path.ends_with("/..") || m_path.find('\0') != std::string::npos)
+    {
+        respond(403, "Forbidden");
+        return;
+    }
+
+    m_state = http_11_state::OPENING_GET_FILE;
+    if (!track(m_ring->prep_open_at(m_server->root_fd(), m_path.c_str(), O_RDONLY | O_CLOEXEC, 0, &m_open_op)))
+        respond(500, "Internal Server Error", false);
+}
+
+// the GET's openat, its own op so a connection closed meanwhile (m_state is DONE then) still closes the fd
+void http_conn::on_open(int res)
+{
+    if (m_closing)
+    {
+        if (res >= 0)
+        {
+            m_file_fd = res;
+            close_file();
+        }
+        return;
+    }
+
+    if (res < 0)
+    {
+        if (res == -ENOENT || res == -ENOTDIR)
+            respond(404, "Not Found");
+        else if (res == -EACCES)
+            respond(403, "Forbidden");
+        else if (res == -ENAMETOOLONG)
+            respond(414, "URI Too Long");
+        else
+            respond(500, "Internal Server Error");
+        return;
+    }
+
+    m_file_fd = res;
+    struct stat sb;
+    if (::fstat(m_file_fd, &sb) || !S_ISREG(sb.st_mode))
+    {
+        close_file();
+        respond(404, "Not Found");
+        return;
+    }
+    m_file_size = sb.st_size;
+    m_file_off = 0;
+    begin_body();
+}
+
+// a read of the file into the send buffer
+void http_conn::on_file(int res)
+{
+    if (m_closing)
+        return;
+
+    if (res <= 0)
+    {
+        // the head already promised a length, all we can do is hang up
+        ERROR << "read " << m_path << ": " << (res < 0 ? ::strerror(-res) : "file shrank") << ENDL;
+        close_conn();
+        return;
+    }
+
+    m_file_off += res;
+    m_state = http_11_state::WRITING_RESPONSE_BODY;
+    send_out(m_send_buf, m_head_len + res);
+    m_head_len = 0;
+}
+
+// head plus as much of the file as fits in the send buffer, in one send
+void http_conn::begin_body()
+{
+    if (m_server->splice_ok(m_file_size) && open_pipe())
+    {
+        begin_splice();
+        return;
+    }
+
+    m_send_buf = m_server->acquire_send_buffer(this);
+    if (!m_send_buf)
+    {
+        m_waiting = true;
+        return;
+    }
+
+    m_out.assign("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: ");
+    m_out.append(std::to_string(m_file_size));
+    m_out.append(m_keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+    ::memcpy(m_send_buf, m_out.data(), m_out.size());
+    m_head_len = m_out.size();
+
+    if (m_file_size == 0)
+    {
+        m_state = http_11_state::WRITING_RESPONSE_BODY;
+        send_out(m_send_buf, m_head_len);
+        m_head_len = 0;
+        return;
+    }
+
+    m_state = http_11_state::READING_GET_FILE;
+    size_t len = std::min<uint64_t>(m_server->send_buf_size() - m_head_len, m_file_size - m_file_off);
+    if (!track(m_ring->prep_read(m_file_fd, m_send_buf + m_head_len, len, m_file_off, &m_file_op)))
+        close_conn();
+}
+
+bool http_conn::open_pipe()
+{
+    if (m_pipe[0] >= 0)
+        return true;
+
+    if (::pipe2(m_pipe, O_CLOEXEC))
+    {
+        WARN << "pipe2: " << ::strerror(errno) << ", sending through a send buffer" << ENDL;
+        m_pipe[0] = m_pipe[1] = -1;
+        return false;
+    }
+    // past /proc/sys/fs/pipe-max-size or the per user pipe page limit we keep whatever the kernel gave us
+    ::fcntl(m_pipe[1], F_SETPIPE_SZ, static_cast<int>(m_server->cfg().pipe_sz));
+    int sz = ::fcntl(m_pipe[1], F_GETPIPE_SZ);
+    m_pipe_sz = sz > 0 ? sz : 64 * 1024;
+    return true;
+}
+
+/**
+  The head goes out on its own, MSG_MORE so it can share a segment with the start of the body,
+  send_done() gets the splices going once it's out.
+  */
+void http_conn::begin_splice()
+{
+    m_out.assign("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: ");
+    m_out.append(std::to_string(m_file_size));
+    m_out.append(m_keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+
+    m_splicing = true;
+    m_pipe_bytes = 0;
+    m_state = http_11_state::WRITING_RESPONSE_HEADERS;
+    send_out(m_out.data(), m_out.size(), MSG_MORE);
+}
+
+/**
+  Next piece of the body: whatever is still in the pipe goes to the socket, otherwise a pipe's worth of
+  the file goes into the pipe with the splice out to the socket linked behind it, one submit, two CQEs.
+  A short splice in cancels the linked splice out (-ECANCELED), what did make it into the pipe
+  is sent on the next round.
+  */
+void http_conn::splice_next()
+{
+    m_state = http_11_state::WRITING_RESPONSE_BODY;
+    arm_splice_timer();
+    uint32_t len = m_pipe_bytes;
+    if (!len)
+    {
+        // unlinked the splice out could finish before the splice in filled the pipe
+        if (!m_ring->reserve_sqes(2))
+        {
+            close_conn();
+            return;
+        }
+        len = std::min<uint64_t>(m_pipe_sz, m_file_size - m_file_off);
+        if (!track(m_ring->prep_splice(m_file_fd, m_file_off, m_pipe[1], -1, len, SPLICE_F_MOVE, &m_splice_in_op)))
+        {
+            close_conn();
+            return;
+        }
+        m_ring->link_next();
+    }
+
+    uint32_t flags = SPLICE_F_MOVE;
+    if (m_file_off + len < m_file_size)
+        flags |= SPLICE_F_MORE;
+    if (!track(sock_op(m_ring->prep_splice(m_pipe[0], -1, m_fd, -1, len, flags, &m_splice_out_op))))
+        close_conn();
+}
+
+void http_conn::on_splice_in(int res)
+{
+    if (m_closing)
+        return;
+
+    if (res <= 0)
+    {
+        // the head already promised a length, all we can do is hang up
+        if (res < 0 && m_file_off == 0 && (res == -EINVAL || res == -EOPNOTSUPP))
+            m_server->splice_failed(-res);
+        else
+            ERROR << "splice " << m_path << ": " << (res < 0 ? ::strerror(-res) : "file shrank") << ENDL;
+        close_conn();
+        return;
+    }
+    m_file_off += res;
+    m_pipe_bytes += res;
+}
+
+void http_conn::on_splice_out(int res)
+{
+    if (m_closing)
+        return;
+
+    if (res == -ECANCELED)
+    {
+        // the splice in ahead of us came up short, send what it did get
+        splice_next();
+        return;
+    }
+    if (res <= 0)
+    {
+        DEBUG(1) << "splice to socket: " << (res < 0 ? ::strerror(-res) : "sent 0 bytes") << ENDL;
+        close_conn();
+        return;
+    }
+
+    m_server->counters().bytes_out += res;
+    m_server->counters().spliced += res;
+    m_splice_moved = true;
+    m_pipe_bytes -= res;
+    if (m_pipe_bytes || m_file_off < m_file_size)
+    {
+        splice_next();
+        return;
+    }
+    m_splicing = false;
+    cancel_splice_timer();
+    finish_request();
+}
+
+/**
+  The splice to the socket runs in an io-wq worker where a peer that stopped reading keeps it blocked,
+  and a linked timeout doesn't get it out of there, so a spliced body has a plain timeout of its own instead.
+  Each time it fires without a byte having gone out since, the socket is shut down, which fails the
+  splice, otherwise it goes again. Cancelled once the body is out.
+  */
+void http_conn::arm_splice_timer()
+{
+    __kernel_timespec *ts = m_server->send_timeout();
+    if (m_splice_timer || !ts)
+        return;
+    m_splice_moved = false;
+    m_splice_timer = track(m_ring->prep_timeout(ts, 0, &m_splice_timer_op));
+}
+
+void http_conn::on_splice_timer(int res)
+{
+    m_splice_timer = false;
+    if (res != -ETIME || m_closing || !m_splicing)
+        return;
+
+    if (m_splice_moved)
+    {
+        arm_splice_timer();
+        return;
+    }
+    m_server->counters().send_timeouts++;
+    DEBUG(1) << "fd: " << m_fd << " splice timed out" << ENDL;
+    close_conn();
+}
+
+void http_conn::cancel_splice_timer()
+{
+    if (m_splice_timer)
+        track(m_ring->prep_cancel(&m_splice_timer_op, 0, &m_cancel_op));
+}
+
+void http_conn::start_put(const http_request &req)
+{
+    m_server->counters().puts++;
+
+    m_name = req.target;
+    m_name.erase(0, m_name.find_first_not_of('/'));
+    m_desc = req.file_desc;
+    if (m_name.size() > UINT16_MAX || m_desc.size() > UINT16_MAX)
+    {
+        respond(400, "Bad Request", false);
+        return;
+    }
+
+    // refused before any spool is claimed for it, the body is left unread so the connection goes
+    uint64_t header = spool_header_size(m_name, m_desc);
+    uint64_t max_put = m_server->cfg().max_put;
+    if ((max_put && req.content_length > max_put) || req.content_length > INT64_MAX - header)
+    {
+        respond(413, "Content Too Large", false);
+        return;
+    }
+
+    m_record_off = m_server->allocate_spool(header + req.content_length);
+    m_body_off = m_record_off + header;
+    m_body_left = req.content_length;
+    m_body_queued = 0;
+    m_hash = 0;
+    m_write_failed = false;
+    m_meta_writing = false;
+    m_meta_written = false;
+    m_hash_written = false;
+    m_meta_data = file_meta_data{};
+    m_meta_data.file_size = req.content_length;
+    m_meta_data.write_time = ::time(nullptr);
+    m_meta_data.file_name_len = m_name.size();
+    m_meta_data.file_desc_len = m_desc.size();
+    write_meta();
+    if (m_closing)
+        return;
+
+    // a body on its way is as good as having seen big recvs
+    m_recv_avg = std::max<uint64_t>(m_recv_avg, std::min<uint64_t>(m_body_left, m_server->cfg().recv_buf_sz));
+    regroup();
+
+    m_state = http_11_state::READING_REQUEST_BODY;
+    if (req.expect_continue)
+    {
+        // curl and friends hold the body back until they see this (or give up waiting)
+        m_interim = true;
+        m_out.assign("HTTP/1.1 100 Continue\r\n\r\n");
+        m_state = http_11_state::WRITING_RESPONSE_HEADERS;
+        send_out(m_out.data(), m_out.size());
+    }
+}
+
+/**
+  Body bytes go to the spool straight out of the receive buffers, up to SPOOL_WRITES writevs in flight
+  each covering whatever has arrived since the last one was queued, so the disk is kept busy while the
+  socket is. Writes may complete in any order, they are retired oldest first and a receive buffer is
+  recycled once every write covering it has. The meta data went out as the body started, only the hash
+  is written last, once it's known.
+  */
+void http_conn::write_body()
+{
+    if (m_write_failed)
+        return;
+
+    if (m_body_left == 0)
+    {
+        write_hash();
+        return;
+    }
+
+    while (m_write_cnt < SPOOL_WRITES && m_body_queued < m_body_left && queue_write())
+        ;
+
+    // nothing in flight and nothing to write, the rest of the body is never coming
+    if (!m_write_cnt && m_peer_closed)
+        close_conn();
+}
+
+// a write of the body bytes received and not queued yet, false when there are none
+bool http_conn::queue_write()
+{
+    spool_write &w = m_writes[(m_write_first + m_write_cnt) % SPOOL_WRITES];
+    w.iov_cnt = 0;
+    w.iov_done = 0;
+    w.bytes = 0;
+    w.done = false;
+
+    uint64_t skip = m_body_queued;
+    uint64_t want = m_body_left - m_body_queued;
+    for (const recv_chunk &chunk : m_chunks)
+    {
+        if (skip >= chunk.len)
+        {
+            skip -= chunk.len;
+            continue;
+        }
+        std::string_view data = chunk_data(chunk).substr(skip);
+        skip = 0;
+        data = data.substr(0, std::min<uint64_t>(data.size(), want - w.bytes));
+        m_hash = compute_hash(data, m_hash);
+        w.iov[w.iov_cnt++] = iovec{const_cast<char*>(data.data()), data.size()};
+        w.bytes += data.size();
+        if (w.bytes == want || w.iov_cnt == SPOOL_IOVS)
+            break;
+    }
+    if (!w.bytes)
+        return false;
+
+    w.off = m_body_off;
+    m_body_off += w.bytes;
+    m_body_queued += w.bytes;
+    if (!track(m_ring->prep_writev(m_server->spool_fd(), w.iov, w.iov_cnt, w.off, &w.op)))
+    {
+        close_conn();
+        return false;
+    }
+    m_write_cnt++;
+    return true;
+}
+
+void http_conn::on_spool_write(uint32_t idx, int res)
+{
+    spool_write &w = m_writes[idx];
+    if (res <= 0)
+    {
+        w.done = true;
+        spool_write_failed(res);
+        return;
+    }
+
+    w.off += res;
+    for (uint64_t left = res; left && w.iov_done < w.iov_cnt; )
+    {
+        iovec &iov = w.iov[w.iov_done];
+        size_t n = std::min<uint64_t>(left, iov.iov_len);
+        iov.iov_base = static_cast<char*>(iov.iov_base) + n;
+        iov.iov_len -= n;
+        left -= n;
+        if (!iov.iov_len)
+            w.iov_done++;
+    }
+    if (w.iov_done < w.iov_cnt && !m_write_failed)
+    {
+        // short write, carry on from where it stopped
+        if (!track(m_ring->prep_writev(m_server->spool_fd(), w.iov + w.iov_done, w.iov_cnt - w.iov_done, w.off, &w.op)))
+        {
+            w.done = true;
+            close_conn();
+        }
+        return;
+    }
+    w.done = true;
+
+    if (m_write_failed)
+    {
+        spool_write_failed(0);
+        return;
+    }
+
+    while (m_write_cnt && m_writes[m_write_first].done)
+    {
+        uint64_t bytes = m_writes[m_write_first].bytes;
+        m_server->counters().spooled += bytes;
+        m_body_left -= bytes;
+        m_body_queued -= bytes;
+        m_write_first = (m_write_first + 1) % SPOOL_WRITES;
+        m_write_cnt--;
+
+        // nothing's dropped before the last write is back, the buffers are still ours when closing
+        while (bytes)
+        {
+            uint64_t n = std::min<uint64_t>(bytes, m_chunks.front().len);
+            consume(n);
+            bytes -= n;
+        }
+    }
+    process_input();
+}
+
+/**
+  The upload can't be stored. The other writes in flight still read out of our receive buffers, so the
+  input is only dropped and the 500 sent once the last of them (and the meta data's) is back, res 0 is one
+  of them coming back.
+  */
+void http_conn::spool_write_failed(int res)
+{
+    if (res < 0 || !m_write_failed)
+        ERROR << "spool write: " << (res < 0 ? ::strerror(-res) : "wrote 0 bytes") << ENDL;
+    m_write_failed = true;
+
+    if (m_meta_writing)
+        return;
+    for (uint32_t i = 0; i < m_write_cnt; i++)
+    {
+        if (!m_writes[(m_write_first + i) % SPOOL_WRITES].done)
+            return;
+    }
+    m_write_cnt = 0;
+    if (!m_closing)
+    {
+        drop_input();
+        respond(500, "Internal Server Error", false);
+    }
+}
+
+/**
+  The header goes out as soon as the PUT starts, its size known from Content-Length and file_hash 0, so an
+  upload that fails or is cut short still leaves a record that says how long it is, one that doesn't hash
+  to file_hash. write_hash() fills the hash in once the body is all down.
+  */
+void http_conn::write_meta()
+{
+    spool_header(m_meta, m_meta_data, m_name, m_desc);
+    m_write_ptr = m_meta.data();
+    m_write_left = m_meta.size();
+    m_meta_off = m_record_off;
+    m_meta_writing = track(m_ring->prep_write(m_server->spool_fd(), m_write_ptr, m_write_left, m_meta_off, &m_meta_op));
+    if (!m_meta_writing)
+        close_conn();
+}
+
+void http_conn::write_hash()
+{
+    // the header may still be on its way, its completion comes back here
+    if (m_meta_writing || !m_meta_written || m_hash_written)
+        return;
+
+    m_meta_data.file_hash = m_hash;
+    m_write_ptr = reinterpret_cast<const char*>(&m_meta_data.file_hash);
+    m_write_left = sizeof(m_meta_data.file_hash);
+    m_meta_off = m_record_off + offsetof(file_meta_data, file_hash);
+    m_meta_writing = track(m_ring->prep_write(m_server->spool_fd(), m_write_ptr, m_write_left, m_meta_off, &m_meta_op));
+    if (!m_meta_writing)
+        close_conn();
+}
+
+void http_conn::on_meta_write(int res)
+{
+    m_meta_writing = false;
+    if (res <= 0)
+    {
+        spool_write_failed(res);
+        return;
+    }
+
+    m_meta_off += res;
+    m_write_ptr += res;
+    m_write_left -= res;
+    if (m_write_left)
+    {
+        // short write, carry on from where it stopped
+        m_meta_writing = track(m_ring->prep_write(m_server->spool_fd(), m_write_ptr, m_write_left, m_meta_off, &m_meta_op));
+        if (!m_meta_writing)
+            close_conn();
+        return;
+    }
+
+    if (m_write_failed)
+    {
+        // a body write failed meanwhile, that one was waiting for us
+        spool_write_failed(0);
+        return;
+    }
+
+    if (!m_meta_written)
+    {
+        // the body may be all written already, waiting on the header to put the hash in
+        m_meta_written = true;
+        process_input();
+        return;
+    }
+
+    m_hash_written = true;
+    if (!m_closing)
+    {
+        std::string extra = "X-Spool-Offset: " + std::to_string(m_record_off) + "\r\n";
+        respond(201, "Created", m_keep_alive, extra);
+    }
+}
+
+void http_conn::respond(int status, std::string_view reason, bool keep_alive, std::string_view extra)
+{
+    if (status >= 400)
+        m_server->counters().errors++;
+    m_keep_alive = m_keep_alive && keep_alive;
+
+    m_out.assign("HTTP/1.1 ");
+    m_out.append(std::to_string(status)).append(" ").append(reason);
+    m_out.append("\r\nContent-Length: 0\r\n").append(extra);
+    if (!m_keep_alive)
+        m_out.append("Connection: close\r\n");
+    m_out.append("\r\n");
+
+    m_state = http_11_state::WRITING_RESPONSE_HEADERS;
+    send_out(m_out.data(), m_out.size());
+}
+
+void http_conn::send_out(const char *buf, size_t len, int flags)
+{
+    m_send_ptr = buf;
+    m_send_left = len;
+    m_send_flags = MSG_NOSIGNAL | flags;
+    if (!prep_send_next())
+    {
+        close_conn();
+        return;
+    }
+    send_deadline();
+}
+
+/**
+  What's left of the send. Zero copy when it's out of the send buffer, big enough for that to beat copying
+  (--zc-kb) and a zc slot is free, a plain send otherwise.
+  */
+bool http_conn::prep_send_next()
+{
+    bool in_send_buf = m_send_buf && m_send_ptr >= m_send_buf && m_send_ptr < m_send_buf + m_server->send_buf_size();
+    if (in_send_buf && m_server->zc_ok(m_send_left))
+    {
+        for (zc_send &zc : m_zc)
+        {
+            if (zc.buf)
+                continue;
+            if (!track(sock_op(m_server->prep_send_zc(m_fd, m_send_ptr, m_send_left, m_send_flags, &zc.op))))
+                return false;
+            zc.buf = m_send_buf;
+            m_server->counters().zc_sends++;
+            return true;
+        }
+    }
+    return track(sock_op(m_ring->prep_send(m_fd, m_send_ptr, m_send_left, m_send_flags, &m_send_op)));
+}
+
+/**
+  A linked timeout on the send just prepped, a peer that stopped reading gets its send cancelled and the
+  connection closed instead of holding a send buffer forever. Splices have arm_splice_timer().
+  */
+void http_conn::send_deadline()
+{
+    if (__kernel_timespec *ts = m_server->send_timeout())
+        track(m_ring->prep_link_timeout(ts, &m_send_timeout_op));
+}
+
+void http_conn::on_send(int res)
+{
+    if (m_closing)
+        return;
+
+    if (res <= 0)
+    {
+        DEBUG(1) << "send: " << (res < 0 ? ::strerror(-res) : "sent 0 bytes") << ENDL;
+        close_conn();
+        return;
+    }
+
+    m_server->counters().bytes_out += res;
+    m_send_ptr += res;
+    m_send_left -= res;
+    if (m_send_left)
+    {
+        if (!prep_send_next())
+        {
+            close_conn();
+            return;
+        }
+        send_deadline();
+        return;
+    }
+
+    send_done();
+}
+
+/**
+  A zero copy send's CQEs: the send's own, handled like any send's, then with IORING_CQE_F_NOTIF the kernel
+  giving the buffer back. The first one without IORING_CQE_F_MORE is the last, the op counts in m_inflight
+  till then so a closing connection waits for its buffers.
+  */
+void http_conn::on_send_zc(uint32_t idx, int res, uint32_t flags)
+{
+    if (flags & IORING_CQE_F_NOTIF)
+    {
+        if (static_cast<uint32_t>(res) & IORING_NOTIF_USAGE_ZC_COPIED)
+            m_server->counters().zc_copied++;
+        m_inflight--;
+        zc_done(idx);
+        return;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        m_inflight--;
+        zc_done(idx);
+    }
+
+    if ((res == -EINVAL || res == -EOPNOTSUPP) && !m_closing)
+    {
+        // no zero copy here, the same send again copying
+        m_server->zc_failed(-res);
+        if (!prep_send_next())
+            close_conn();
+        else
+            send_deadline();
+        return;
+    }
+    on_send(res);
+}
+
+// the slot is free again, and its buffer too unless it's still ours or another send has it
+void http_conn::zc_done(uint32_t idx)
+{
+    char *buf = m_zc[idx].buf;
+    m_zc[idx].buf = nullptr;
+    if (buf && buf != m_send_buf && !zc_busy(buf))
+        m_server->release_send_buffer(buf);
+}
+
+bool http_conn::zc_busy(const char *buf) const
+{
+    for (const zc_send &zc : m_zc)
+    {
+        if (zc.buf == buf)
+            return true;
+    }
+    return false;
+}
+
+// done with the send buffer, a zero copy send still waiting on its notification gives it back instead
+void http_conn::drop_send_buf()
+{
+    char *buf = m_send_buf;
+    m_send_buf = nullptr;
+    if (buf && !zc_busy(buf))
+        m_server->release_send_buffer(buf);
+}
+
+void http_conn::send_done()
+{
+    if (m_interim)
+    {
+        m_interim = false;
+        m_state = http_11_state::READING_REQUEST_BODY;
+        process_input();
+        return;
+    }
+
+    if (m_splicing)
+    {
+        splice_next();
+        return;
+    }
+
+    if (m_state == http_11_state::WRITING_RESPONSE_BODY && m_file_off < m_file_size)
+    {
+        m_state = http_11_state::READING_GET_FILE;
+        read_next();
+        return;
+    }
+
+    finish_request();
+}
+
+// the next chunk of the file, into another send buffer if the kernel may still be sending from ours
+void http_conn::read_next()
+{
+    if (m_send_buf && zc_busy(m_send_buf))
+        drop_send_buf();
+    if (!m_send_buf)
+    {
+        m_send_buf = m_server->acquire_send_buffer(this);
+        if (!m_send_buf)
+        {
+            m_waiting = true;
+            return;
+        }
+    }
+
+    size_t len = std::min<uint64_t>(m_server->send_buf_size(), m_file_size - m_file_off);
+    if (!track(m_ring->prep_read(m_file_fd, m_send_buf, len, m_file_off, &m_file_op)))
+        close_conn();
+}
+
+void http_conn::finish_request()
+{
+    close_file();
+    drop_send_buf();
+
+    if (!m_keep_alive)
+    {
+        close_conn();
+        return;
+    }
+
+    // on to the next request, it may be sitting in m_chunks already
+    m_state = http_11_state::READING_REQUEST_HEADERS;
+    touch();
+    process_input();
+}
+
+void http_conn::close_pipe()
+{
+    if (m_pipe[0] < 0)
+        return;
+    ::close(m_pipe[0]);
+    ::close(m_pipe[1]);
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+void http_conn::close_file()
+{
+    if (m_file_fd < 0)
+        return;
+    if (!track(m_ring->prep_close(m_file_fd, &m_file_close_op)))
+        ::close(m_file_fd);
+    m_file_fd = -1;
+}
+
+/**
+  Shut the socket down, which ends the multishot recv, then wait for everything in flight to come back
+  before closing it and giving the connection back, the ring still points at our ops until then.
+  A fixed file slot has no fd to call shutdown(2) on, it goes through the ring.
+  */
+void http_conn::close_conn()
+{
+    if (m_closing)
+        return;
+
+    m_closing = true;
+    m_state = http_11_state::DONE;
+    cancel_splice_timer();
+    m_server->wheel().cancel(m_idle_timer);
+    if (m_waiting)
+    {
+        m_server->forget_waiter(this);
+        m_waiting = false;
+    }
+    if (!m_fixed)
+        ::shutdown(m_fd, SHUT_RDWR);
+    else if (!track(sock_op(m_ring->prep_shutdown(m_fd, SHUT_RDWR, &m_shutdown_op))))
+    {
+        WARN << "slot: " << m_fd << " no SQE for the shutdown" << ENDL;
+    }
+}
+
+void http_conn::maybe_finish_close()
+{
+    if (!m_closing || m_close_sent || m_inflight)
+        return;
+
+    drop_input();
+    close_file();
+    close_pipe();
+    drop_send_buf();
+    if (m_inflight)
+        return; // the file close, back here when it completes
+
+    m_close_sent = m_server->prepped(m_fixed ? m_ring->prep_close_fixed(m_fd, &m_close_op) : m_ring->prep_close(m_fd, &m_close_op));
+    if (!m_close_sent)
+    {
+        if (m_fixed)
+            m_ring->set_fixed_file(m_fd, -1);
+        else
+            ::close(m_fd);
+        m_server->release(this);
+    }
+}
+
+void http_conn::abandon()
+{
+    drop_input();
+    if (m_file_fd >= 0)
+        ::close(m_file_fd);
+    close_pipe();
+    // fixed slots go with the ring
+    if (m_fd >= 0 && !m_close_sent && !m_fixed)
+        ::close(m_fd);
+    m_file_fd = -1;
+    m_fd = -1;
+}
+
+int32_t main(int argc, char **argv)
+{
+    http_config cfg;
+
+    for (int i = 1; i < argc; i++)
+    {
+        auto[key, val] = split(argv[i], '=');
+        if (key == "--addr"sv)
+        {
+            cfg.addr = val;
+        }
+        else if (key == "--port"sv)
+        {
+            cfg.port = aton(val);
+        }
+        else if (key == "--root"sv)
+        {
+            cfg.root = val;
+        }
+        else if (key == "--spool"sv)
+        {
+            cfg.spool = val;
+        }
+        else if (key == "--queue-depth"sv)
+        {
+            cfg.queue_depth = aton(val);
+        }
+        else if (key == "--recv-bufs"sv)
+        {
+            cfg.recv_bufs = aton(val);
+        }
+        else if (key == "--recv-kb"sv)
+        {
+            cfg.recv_buf_sz = std::max<size_t>(aton(val), 1) * 1024;
+        }
+        else if (key == "--recv-small-bufs"sv)
+        {
+            cfg.recv_small_bufs = aton(val);
+        }
+        else if (key == "--recv-small-kb"sv)
+        {
+            cfg.recv_small_sz = static_cast<size_t>(aton(val)) * 1024;
+        }
+        else if (key == "--recv-bundle"sv)
+        {
+            cfg.recv_bundle = (val == "true"sv);
+        }
+        else if (key == "--send-bufs"sv)
+        {
+            cfg.send_bufs = std::max<uint32_t>(aton(val), 1);
+        }
+        else if (key == "--send-kb"sv)
+        {
+            cfg.send_buf_sz = std::max<size_t>(aton(val), 4) * 1024;
+        }
+        else if (key == "--splice-kb"sv)
+        {
+            cfg.splice_min = static_cast<size_t>(aton(val)) * 1024;
+        }
+        else if (key == "--zc-kb"sv)
+        {
+            cfg.zc_min = static_cast<size_t>(aton(val)) * 1024;
+        }
+        else if (key == "--pipe-kb"sv)
+        {
+            cfg.pipe_sz = std::max<size_t>(aton(val), 4) * 1024;
+        }
+        else if (key == "--conn-bufs"sv)
+        {
+            cfg.conn_bufs = std::max<uint32_t>(aton(val), 2);
+        }
+        else if (key == "--spool-prealloc-mb"sv)
+        {
+            cfg.prealloc = static_cast<uint64_t>(aton(val)) << 20;
+        }
+        else if (key == "--max-put-mb"sv)
+        {
+            cfg.max_put = static_cast<uint64_t>(aton(val)) << 20;
+        }
+        else if (key == "--send-timeout-ms"sv)
+        {
+            cfg.send_timeout_ms = aton(val);
+        }
+        else if (key == "--idle-timeout-ms"sv)
+        {
+            cfg.idle_timeout_ms = aton(val);
+        }
+        else if (key == "--max-conns"sv)
+        {
+            cfg.max_conns = aton(val);
+        }
+        else if (key == "--rings"sv)
+        {
+            cfg.rings = std::max<uint32_t>(aton(val), 1);
+        }
+        else if (key == "--placement"sv)
+        {
+            cfg.placement = val;
+        }
+        else if (key == "--fixed-files"sv)
+        {
+            cfg.fixed_files = (val == "true"sv);
+        }
+        else if (key == "--incoming-cpu"sv)
+        {
+            cfg.incoming_cpu = (val == "true"sv);
+        }
+        else if (key == "--io-stats"sv)
+        {
+            cfg.io_stats = (val == "true"sv);
+        }
+        else if (key == "--debug"sv)
+        {
+            s_debug_level = aton(val);
+        }
+        else if (key == "--debug-modules"sv)
+        {
+            if (!set_log_levels(val))
+            {
+                ERROR << "--debug-modules wants module=level[,module=level], modules: general, wrapper, log_file, copy, http: " << val << ENDL;
+                return 1;
+            }
+        }
+        else
+        {
+            ERROR << "unknown option: " << argv[i] << ENDL;
+            return 1;
+        }
+    }
+
+    cpu_topology topology;
+    std::vector<thread_placement> placements;
+    if (!topology.plan(cfg.placement, cfg.rings, placements))
+    {
+        ERROR << "bad --placement: " << cfg.placement << ENDL;
+        return 1;
+    }
+
+    // blocked before the log writer and ring threads exist so they inherit the mask, ring 0 reads them off a signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    ::signal(SIGPIPE, SIG_IGN);
+
+    http_shared shared;
+    if (!shared.open(cfg))
+        return 1;
+
+    // no ring serves before all of them have started, a signal has every ring_fd to wake then
+    std::latch started(cfg.rings);
+    std::vector<std::thread> threads;
+    for (uint32_t r = 0; r < cfg.rings; r++)
+    {
+        threads.emplace_back([&, r] {
+            apply_placement(placements[r]);
+            http_server server(cfg, shared, r, placements[r]);
+            if (!server.start(r == 0 ? &signals : nullptr))
+            {
+                shared.failed = true;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> guard(shared.lock);
+                shared.ring_fds.push_back(server.ring_fd());
+            }
+            started.arrive_and_wait();
+            if (!shared.failed)
+                server.run();
+        });
+    }
+
+    for (auto &thrd : threads)
+        thrd.join();
+    return shared.failed ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <liburing.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string_view>
+
+#include "hdr_histogram.h"
+#include "log.h"
+
+/**
+  Per ring instrumentation, see io_uring_wrapper::enable_stats().
+
+  Every SQE is timestamped when get_sqe() hands it out and again when submit() passes it to the kernel,
+  its CQE is timestamped once per reaped batch, so an op's life splits into
+      sq wait:  prep -> submit, sitting in our SQ
+      service:  submit -> reap, the kernel's time plus however long the CQE sat before we looked
+      latency:  prep -> reap, per opcode
+  plus how long the callbacks for a batch took, how many CQEs each batch had, how many ops were in flight
+  when the batch was reaped and how often get_sqe() found the SQ full.
+
+  Written by the ring's thread only, the histograms and counters can be read from any thread at any time.
+  A histogram is ~60KB, the per opcode ones are only allocated for opcodes the ring actually uses.
+  */
+struct io_uring_stats
+{
+    static constexpr uint32_t OP_CNT = 256; // sqe->opcode is a u8
+
+    io_uring_stats() = default;
+
+    io_uring_stats(const io_uring_stats&) = delete;
+    io_uring_stats& operator=(const io_uring_stats&) = delete;
+
+    ~io_uring_stats()
+    {
+        for (auto &hist : op_latency)
+            delete hist.load(std::memory_order_relaxed);
+    }
+
+    static const char* to_str(uint8_t opcode)
+    {
+        switch (opcode) {
+        case IORING_OP_NOP: return "NOP";
+        case IORING_OP_READV: return "READV";
+        case IORING_OP_WRITEV: return "WRITEV";
+        case IORING_OP_FSYNC: return "FSYNC";
+        case IORING_OP_READ_FIXED: return "READ_FIXED";
+        case IORING_OP_WRITE_FIXED: return "WRITE_FIXED";
+        case IORING_OP_POLL_ADD: return "POLL_ADD";
+        case IORING_OP_POLL_REMOVE: return "POLL_REMOVE";
+        case IORING_OP_SENDMSG: return "SENDMSG";
+        case IORING_OP_RECVMSG: return "RECVMSG";
+        case IORING_OP_TIMEOUT: return "TIMEOUT";
+        case IORING_OP_TIMEOUT_REMOVE: return "TIMEOUT_REMOVE";
+        case IORING_OP_ACCEPT: return "ACCEPT";
+        case IORING_OP_ASYNC_CANCEL: return "ASYNC_CANCEL";
+        case IORING_OP_LINK_TIMEOUT: return "LINK_TIMEOUT";
+        case IORING_OP_CONNECT: return "CONNECT";
+        case IORING_OP_OPENAT: return "OPENAT";
+        case IORING_OP_CLOSE: return "CLOSE";
+        case IORING_OP_READ: return "READ";
+        case IORING_OP_WRITE: return "WRITE";
+        case IORING_OP_SEND: return "SEND";
+        case IORING_OP_RECV: return "RECV";
+        case IORING_OP_SPLICE: return "SPLICE";
+        case IORING_OP_RENAMEAT: return "RENAMEAT";
+        case IORING_OP_UNLINKAT: return "UNLINKAT";
+        case IORING_OP_MSG_RING: return "MSG_RING";
+        case IORING_OP_SEND_ZC: return "SEND_ZC";
+        case IORING_OP_SENDMSG_ZC: return "SENDMSG_ZC";
+        };
+        return "OTHER";
+    }
+
+    // ring thread only
+    hdr_histogram& latency_for(uint8_t opcode)
+    {
+        hdr_histogram *hist = op_latency[opcode].load(std::memory_order_relaxed);
+        if (!hist)
+        {
+            hist = new hdr_histogram;
+            op_latency[opcode].store(hist, std::memory_order_release);
+        }
+        return *hist;
+    }
+
+    // single writer, a plain load and store rather than a locked add
+    static void bump(std::atomic<uint64_t> &counter, uint64_t cnt = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + cnt, std::memory_order_relaxed);
+    }
+
+    // not safe against the other ring recording into this one at the same time
+    void merge(const io_uring_stats &other)
+    {
+        for (uint32_t op = 0; op < OP_CNT; op++)
+        {
+            hdr_histogram *hist = other.op_latency[op].load(std::memory_order_acquire);
+            if (hist)
+                latency_for(op).merge(*hist);
+        }
+        sq_wait.merge(other.sq_wait);
+        service.merge(other.service);
+        batch_ns.merge(other.batch_ns);
+        cq_batch.merge(other.cq_batch);
+        inflight.merge(other.inflight);
+        bump(submits, other.submits.load(std::memory_order_relaxed));
+        bump(sq_full, other.sq_full.load(std::memory_order_relaxed));
+        bump(sq_full_failed, other.sq_full_failed.load(std::memory_order_relaxed));
+    }
+
+    void trace(std::string_view name) const
+    {
+        TRACE << name << " submits: " << submits.load(std::memory_order_relaxed)
+              << ", sq full retries: " << sq_full.load(std::memory_order_relaxed)
+              << ", sq full failures: " << sq_full_failed.load(std::memory_order_relaxed) << ENDL;
+        trace_histogram(name, "sq wait ns", sq_wait);
+        trace_histogram(name, "service ns", service);
+        trace_histogram(name, "batch callbacks ns", batch_ns);
+        trace_histogram(name, "cq batch size", cq_batch);
+        trace_histogram(name, "in flight", inflight);
+        for (uint32_t op = 0; op < OP_CNT; op++)
+        {
+            hdr_histogram *hist = op_latency[op].load(std::memory_order_acquire);
+            if (hist)
+                trace_histogram(name, to_str(op), *hist);
+        }
+    }
+
+    static void trace_histogram(std::string_view name, std::string_view what, const hdr_histogram &hist)
+    {
+        if (!hist.total())
+            return;
+        TRACE << name << " " << what << ", cnt: " << hist.total()
+              << ", mean: " << hist.mean()
+              << ", p50: " << hist.value_at_percentile(50)
+              << ", p99: " << hist.value_at_percentile(99)
+              << ", p99.9: " << hist.value_at_percentile(99.9)
+              << ", max: " << hist.max() << ENDL;
+    }
+
+    std::atomic<hdr_histogram*> op_latency[OP_CNT] = {};
+    hdr_histogram sq_wait;
+    hdr_histogram service;
+    hdr_histogram batch_ns;
+    hdr_histogram cq_batch;
+    hdr_histogram inflight;
+    std::atomic<uint64_t> in_flight{0};      // ops pending as of the last submit or reap
+    std::atomic<uint64_t> submits{0};
+    std::atomic<uint64_t> sq_full{0};        // get_sqe() found the SQ full and submitted to make room
+    std::atomic<uint64_t> sq_full_failed{0}; // and there still wasn't room
+};
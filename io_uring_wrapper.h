@@ -32,6 +32,7 @@ Questions:
 #include <errno.h>
 #include <fcntl.h>
 #include <liburing.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,8 +41,12 @@ Questions:
 #include <unistd.h>
 
 #include <iostream>
+#include <memory>
 #include <tuple>
+#include <vector>
 
+#include "get_nanoseconds.h"
+#include "io_uring_stats.h"
 #include "log.h"
 #include "misc.h"
 
@@ -83,20 +88,30 @@ template<class EVENT_CLASS>
 class io_uring_wrapper
 {
 public:
-    io_uring_wrapper(uint32_t queue_depth)
+    /**
+      sqpoll starts a kernel thread polling the SQ, pinned to sq_cpu when sq_cpu >= 0
+      */
+    io_uring_wrapper(uint32_t queue_depth, bool sqpoll = false, int sq_cpu = -1)
         : m_queue_depth(queue_depth)
     {
         struct io_uring_params params;
 
         memset(&params, 0, sizeof(params));
-        params.flags |= IORING_SETUP_SQPOLL;
-        params.sq_thread_idle = 5000; // Set idle timeout to 5 seconds, not handling the timeout for now
 
-        //int ret = io_uring_queue_init_params(queue_depth, &m_ring, &params);
         // enabling SQPOLL increased both CPU and test run times by 30%
-        // maybe there were additional settings needed?
+        // maybe there were additional settings needed? pinning the poller next to the ring thread is worth a retest
+        if (sqpoll)
+        {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = 5000; // Set idle timeout to 5 seconds, not handling the timeout for now
+            if (sq_cpu >= 0)
+            {
+                params.flags |= IORING_SETUP_SQ_AFF;
+                params.sq_thread_cpu = sq_cpu;
+            }
+        }
 
-        int ret = io_uring_queue_init(queue_depth, &m_ring, 0);
+        int ret = io_uring_queue_init_params(queue_depth, &m_ring, &params);
         if (ret < 0)
         {
             ERROR << "io_uring_queue_init: " << ::strerror(-ret) << ENDL;
@@ -109,14 +124,34 @@ public:
     {
         if (m_valid)
         {
+            // a wakeup for another ring may still be sitting in the SQ, with SQPOLL the kernel
+            // picks it up whenever the poller runs, it is lost if the ring goes away first
+            flush_sq();
             io_uring_queue_exit(&m_ring);
         }
     }
 
+    // submit and wait until the kernel has consumed every queued SQE
+    void flush_sq()
+    {
+        if (!m_valid)
+            return;
+
+        while (io_uring_sq_ready(&m_ring))
+        {
+            if (this->submit() < 0)
+                return;
+            if (io_uring_sq_ready(&m_ring))
+                ::sched_yield();
+        }
+    }
+
     int submit()
     {
         if (!m_valid)
             return -1;
+        if (m_stats)
+            track_unsubmitted();
         int ret = io_uring_submit(&m_ring);
         if (ret < 0)
         {
@@ -125,6 +160,44 @@ public:
         return ret;
     }
 
+    /**
+      Turn on per op timing, see io_uring_stats.h. Costs a clock read per SQE, one per submit and two per
+      reaped batch, plus a slot per op in flight to hold the timestamps, user_data points at the slot
+      while the op is in flight. Turn it on before preparing anything.
+      Pass stats to record into something that outlives the ring (to read it from another thread while
+      the ring comes and goes), otherwise the ring allocates its own.
+      */
+    void enable_stats(io_uring_stats *stats = nullptr)
+    {
+        if (!m_valid || m_stats)
+            return;
+        if (!stats)
+        {
+            m_own_stats = std::make_unique<io_uring_stats>();
+            stats = m_own_stats.get();
+        }
+        m_stats = stats;
+        m_prep_ns.assign(m_ring.sq.ring_entries, 0);
+    }
+
+    // nullptr unless enable_stats() was called, readable from any thread
+    const io_uring_stats* stats() const { return m_stats; }
+
+    // keep the io-wq workers (blocking file I/O is punted to them) on the same CPUs as the ring thread
+    bool set_iowq_affinity(const cpu_set_t &cpus)
+    {
+        if (!m_valid)
+            return false;
+
+        int ret = io_uring_register_iowq_aff(&m_ring, sizeof(cpus), &cpus);
+        if (ret < 0)
+        {
+            ERROR << "io_uring_register_iowq_aff: " << ::strerror(-ret) << ENDL;
+            return false;
+        }
+        return true;
+    }
+
     bool prep_open_at(int dir_fd, const char *path, int flags, mode_t mode, void *data)
     {
         io_uring_sqe *sqe = get_sqe();
@@ -136,8 +209,7 @@ public:
 
         io_uring_prep_openat(sqe, dir_fd, path, flags, mode);
 
-        if (!m_multishot)
-            m_pending++;
+        m_pending++;
 
         return true;
     }
@@ -159,8 +231,24 @@ public:
 
         io_uring_prep_write(sqe, fd, buffer, len, offset);
 
-        if (!m_multishot)
-            m_pending++;
+        m_pending++;
+
+        return true;
+    }
+
+    // the iovecs are read when the SQE is submitted, the buffers they point at until it completes
+    bool prep_writev(int fd, const iovec *iovs, uint32_t cnt, off_t offset, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_writev(sqe, fd, iovs, cnt, offset);
+
+        m_pending++;
 
         return true;
     }
@@ -182,11 +270,66 @@ public:
 
         io_uring_prep_read(sqe, fd, buffer, sz, offset);
 
-        if (!m_multishot)
-            m_pending++;
+        m_pending++;
+
+        return true;
+    }
+    /**
+      Register buffers once so fixed reads/writes skip the per I/O page pinning and mapping.
+      buf_index in prep_read_fixed/prep_write_fixed is the index of the iovec the buffer falls in.
+      */
+    bool register_buffers(const iovec *iovs, uint32_t cnt)
+    {
+        if (!m_valid)
+            return false;
+
+        int ret = io_uring_register_buffers(&m_ring, iovs, cnt);
+        if (ret < 0)
+        {
+            WARN << "io_uring_register_buffers: " << ::strerror(-ret) << ", falling back to unregistered buffers" << ENDL;
+            return false;
+        }
+        return true;
+    }
+
+    bool prep_read_fixed(int fd, char *buffer, size_t sz, off_t offset, int buf_index, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+        {
+            ERROR << "io_uring_get_sqe: failed to get SQE" << ENDL;
+            return false;
+        }
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_read_fixed(sqe, fd, buffer, sz, offset, buf_index);
+
+        m_pending++;
 
         return true;
     }
+
+    bool prep_write_fixed(int fd, const char *buffer, size_t len, off_t offset, int buf_index, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+        {
+            ERROR << "io_uring_get_sqe: failed to get SQE" << ENDL;
+            return false;
+        }
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_write_fixed(sqe, fd, buffer, len, offset, buf_index);
+
+        m_pending++;
+
+        return true;
+    }
+
     /*
        example code: https://git.kernel.dk/cgit/liburing/tree/examples/proxy.c
        I have not found any examples using a buffer ring to hold per accept addrinfo_in data, maybe not needed.
@@ -212,7 +355,208 @@ public:
         // flags is zero for now
 
         io_uring_prep_multishot_accept(sqe, fd, nullptr, nullptr, 0); 
-        m_multishot = true;
+        m_pending++;
+        return true;
+    }
+
+    /**
+      Multishot accept straight into the fixed file table (register_files_sparse() first), each CQE's res
+      is the slot the kernel picked, never an fd. Ops on the connection then need fixed_file(), close it
+      with prep_close_fixed(). -ENFILE when the table is full.
+      */
+    bool prep_multishot_accept_direct(int fd, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+        io_uring_prep_multishot_accept_direct(sqe, fd, nullptr, nullptr, 0);
+        m_pending++;
+        return true;
+    }
+
+    /**
+      One SQE, a CQE per chunk of data received for as long as the socket has data and group has buffers.
+      Each CQE's flags carry IORING_CQE_F_BUFFER with the buffer id in the upper 16 bits, the EVENT_CLASS
+      needs the process_io_uring(res, flags) form to see them. The last CQE comes without IORING_CQE_F_MORE:
+      0 at EOF, -ENOBUFS when group ran dry (re-arm once buffers are given back) or another -errno.
+      With bundle (recv_bundle_ok() says whether the kernel has them, 6.10 and up) a CQE takes as many buffers as
+      the data waiting fills, the id is the first of them and the rest follow in ring order, see buffer_ring.h.
+      */
+    bool prep_recv_multishot(int fd, uint16_t group, void *data, bool bundle = false)
+    {
+        if (!m_valid)
+            return false;
+
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+        {
+            ERROR << "get_sqe: failed to get SQE" << ENDL;
+            return false;
+        }
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        if (bundle)
+            sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+        m_pending++;
+        return true;
+    }
+
+    bool recv_bundle_ok() const { return m_valid && (m_ring.features & IORING_FEAT_RECVSEND_BUNDLE); }
+
+    // flags are send(2)'s, MSG_NOSIGNAL so a peer that went away is an -EPIPE rather than a SIGPIPE
+    bool prep_send(int fd, const char *buffer, size_t len, int flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_send(sqe, fd, buffer, len, flags);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Zero copy send: the pages of buffer go to the NIC as they are, two CQEs. The first has the bytes sent
+      (or -errno) and IORING_CQE_F_MORE when a notification follows, the second IORING_CQE_F_NOTIF once the
+      kernel is done with buffer, which can't be written to or reused before then. The op is pending until
+      that last CQE, EVENT_CLASS needs process_io_uring(res, flags) to tell them apart.
+      buf_index >= 0 is a registered buffer (register_buffers()), which also saves pinning the pages per send.
+      zc_flags IORING_SEND_ZC_REPORT_USAGE has the notification's res say IORING_NOTIF_USAGE_ZC_COPIED when
+      the kernel copied after all (loopback always does). Kernels before 6.0 say -EINVAL.
+      */
+    bool prep_send_zc(int fd, const char *buffer, size_t len, int flags, void *data, int buf_index = -1, uint32_t zc_flags = 0)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        if (buf_index >= 0)
+            io_uring_prep_send_zc_fixed(sqe, fd, buffer, len, flags, zc_flags, buf_index);
+        else
+            io_uring_prep_send_zc(sqe, fd, buffer, len, flags, zc_flags);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // prep_send_zc() with an iovec (msg and what it points to live until the first CQE, the data until the notification), 6.1 and up
+    bool prep_sendmsg_zc(int fd, const msghdr *msg, int flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_sendmsg_zc(sqe, fd, msg, flags);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // one recv into buffer, completes with the bytes received, 0 once the peer has closed
+    bool prep_recv(int fd, char *buffer, size_t len, int flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_recv(sqe, fd, buffer, len, flags);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Move len bytes from fd_in to fd_out inside the kernel, one of them has to be a pipe.
+      Offsets of -1 mean the fd's own position (a pipe or socket has no other), file offsets aren't advanced.
+      File to pipe only takes references to page cache pages and pipe to socket hands the pages on,
+      the data is never copied into or out of user space. flags are splice(2)'s, SPLICE_F_MOVE, SPLICE_F_MORE.
+      */
+    bool prep_splice(int fd_in, int64_t off_in, int fd_out, int64_t off_out, uint32_t len, uint32_t flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_splice(sqe, fd_in, off_in, fd_out, off_out, len, flags);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      The SQE prepped last doesn't start the next one prepped until it completes. If it fails, or comes back
+      short for reads, writes, sends and splices, the next one completes with -ECANCELED without running.
+      Both still post their CQEs, in order. A link can't span submits, if the SQ fills up between the two
+      (get_sqe() submits to make room) they run unlinked, reserve_sqes() first rules that out.
+      */
+    void link_next()
+    {
+        if (m_last_sqe)
+            m_last_sqe->flags |= IOSQE_IO_LINK;
+    }
+
+    // room for cnt SQEs without get_sqe() submitting in between, submits what's queued if there isn't
+    bool reserve_sqes(unsigned cnt)
+    {
+        if (!m_valid)
+            return false;
+        if (io_uring_sq_space_left(&m_ring) < cnt)
+            this->submit();
+        return io_uring_sq_space_left(&m_ring) >= cnt;
+    }
+
+    /**
+      The op prepared last names a fixed file slot instead of an fd, for a splice that's fd_out.
+      Cancel by a slot with IORING_ASYNC_CANCEL_FD_FIXED.
+      */
+    void fixed_file()
+    {
+        if (m_last_sqe)
+            m_last_sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    // shutdown(2) as an op, the way to do it for a fixed file slot
+    bool prep_shutdown(int fd, int how, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_shutdown(sqe, fd, how);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
         return true;
     }
 
@@ -227,8 +571,7 @@ public:
 
         io_uring_prep_connect(sqe, fd, addr, addrlen); 
 
-        if (!m_multishot)
-            m_pending++;
+        m_pending++;
         return true;
     }
 
@@ -243,12 +586,312 @@ public:
 
         io_uring_prep_close(sqe, fd);
 
-        if (!m_multishot)
-            m_pending++;
+        m_pending++;
+
+        return true;
+    }
+
+    // paths are copied by the kernel when the SQE is submitted
+    bool prep_rename_at(int old_dir_fd, const char *old_path, int new_dir_fd, const char *new_path, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_renameat(sqe, old_dir_fd, old_path, new_dir_fd, new_path, 0);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
 
         return true;
     }
 
+    bool prep_unlink_at(int dir_fd, const char *path, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_unlinkat(sqe, dir_fd, path, 0);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Completes with -ETIME once ts has elapsed (or with 0 after count other completions if count > 0).
+      ts is read at submit time, it only has to live until submit() returns.
+      */
+    bool prep_timeout(__kernel_timespec *ts, uint32_t count, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_timeout(sqe, ts, count, 0);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Completes with -ETIME and IORING_CQE_F_MORE every time ts elapses until cancelled (6.4 and up, -EINVAL
+      before that). ts is copied at submit. Counts as one pending op until the CQE without F_MORE,
+      like every multishot op.
+      */
+    bool prep_timeout_multishot(__kernel_timespec *ts, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_timeout(sqe, ts, 0, IORING_TIMEOUT_MULTISHOT);
+        io_uring_sqe_set_data(sqe, data);
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      A deadline for the op prepared right before this, which is linked to it here. If ts elapses first the
+      op is cancelled (it completes with -ECANCELED, or -EINTR for some) and this completes with -ETIME,
+      otherwise this completes with -ECANCELED. Either way there are two CQEs. Both SQEs have to go to the
+      kernel in the same submit, ts only has to live until then, so false (and the op runs without a
+      deadline) when it was submitted already or the SQ is full and getting an SQE would submit it.
+      */
+    bool prep_link_timeout(__kernel_timespec *ts, void *data)
+    {
+        io_uring_sqe *prev = m_last_sqe;
+        if (!m_valid || !prev || m_ring.sq.sqe_head == m_ring.sq.sqe_tail || !io_uring_sq_space_left(&m_ring))
+            return false;
+
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        prev->flags |= IOSQE_IO_LINK;
+        io_uring_prep_link_timeout(sqe, ts, 0);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // mode is fallocate(2)'s, FALLOC_FL_KEEP_SIZE reserves blocks past the end without growing the file
+    bool prep_fallocate(int fd, int mode, uint64_t offset, uint64_t len, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_fallocate(sqe, fd, mode, offset, len);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Cancellation: what's found completes with -ECANCELED (a multishot with its last CQE, a timeout too).
+      Our own CQE says 0 (the number found with IORING_ASYNC_CANCEL_ALL), -ENOENT when nothing was found
+      because it finished already, -EALREADY when it's running and can't be stopped (a disk write usually).
+
+      prep_cancel() finds the op prepared with target as its data, the first of them or every one with
+      IORING_ASYNC_CANCEL_ALL in flags. With stats on the kernel only knows the op by its slot, the slot is
+      looked up at submit, see track_unsubmitted(), and it's only ever one op then.
+      */
+    bool prep_cancel(void *target, uint32_t flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_cancel(sqe, target, flags);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // the first op on fd, or all of them with IORING_ASYNC_CANCEL_ALL
+    bool prep_cancel_fd(int fd, uint32_t flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_cancel_fd(sqe, fd, flags);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // everything in flight on the ring, ops that can't be stopped still complete on their own
+    bool prep_cancel_all(void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_cancel64(sqe, 0, IORING_ASYNC_CANCEL_ANY);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    // flags 0 for fsync, IORING_FSYNC_DATASYNC for fdatasync
+    bool prep_fsync(int fd, uint32_t flags, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_fsync(sqe, fd, flags);
+        io_uring_sqe_set_data(sqe, data);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Cross ring messaging, IORING_OP_MSG_RING.
+
+      Posts a CQE into another ring, the thread owning that ring sees it in its own process_events()
+      (or wakes from wait_events()), no locks, futexes or eventfds involved.
+      The message CQE carries target_data and res, target_data->process_io_uring(res) is called on
+      the receiving thread, a nullptr target_data is a bare wakeup.
+      Message CQEs are tagged with the low bit of user_data, so they aren't counted against pending.
+
+      If data is passed our ring also gets a CQE for data with the result of the send (counted as pending),
+      otherwise our CQE is skipped on success and only failures are logged.
+      */
+    template<class TARGET_CLASS>
+    bool post_message(io_uring_wrapper<TARGET_CLASS> &target, TARGET_CLASS *target_data, int32_t res, void *data = nullptr)
+    {
+        return prep_msg_ring(target.ring_fd(), target_data, res, data);
+    }
+
+    // bare wakeup for a ring that may be sitting in wait_events(), only the ring fd is needed
+    bool prep_wakeup(int target_ring_fd)
+    {
+        return prep_msg_ring(target_ring_fd, nullptr, 0, nullptr);
+    }
+
+    /**
+      Pass one of our fixed file slots into the target ring's fixed file table.
+      The target must have called register_files_sparse(), target_slot can be IORING_FILE_INDEX_ALLOC
+      to let the kernel pick a free slot.
+      The target gets a message CQE for target_data with the installed slot (or -errno) as the result,
+      our slot is left alone, close it with prep_close_fixed() once the handoff completes.
+      */
+    template<class TARGET_CLASS>
+    bool post_fixed_file(io_uring_wrapper<TARGET_CLASS> &target,
+                         uint32_t source_slot,
+                         uint32_t target_slot,
+                         TARGET_CLASS *target_data,
+                         void *data = nullptr)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_msg_ring_fd(sqe, target.ring_fd(), source_slot, target_slot, message_data(target_data), 0);
+        set_sender_data(sqe, data);
+
+        return true;
+    }
+
+    /**
+      Fixed file table, needed to receive files from other rings and for IOSQE_FIXED_FILE ops.
+      Slots start out empty, fill them with set_fixed_file() or by receiving them through post_fixed_file().
+      */
+    bool register_files_sparse(uint32_t cnt)
+    {
+        if (!m_valid)
+            return false;
+
+        int ret = io_uring_register_files_sparse(&m_ring, cnt);
+        if (ret < 0)
+        {
+            ERROR << "io_uring_register_files_sparse: " << ::strerror(-ret) << ENDL;
+            return false;
+        }
+        return true;
+    }
+
+    // install fd in slot, the ring takes its own reference so the caller can close fd afterwards
+    bool set_fixed_file(uint32_t slot, int fd)
+    {
+        if (!m_valid)
+            return false;
+
+        int ret = io_uring_register_files_update(&m_ring, slot, &fd, 1);
+        if (ret < 0)
+        {
+            ERROR << "io_uring_register_files_update: " << ::strerror(-ret) << ENDL;
+            return false;
+        }
+        return true;
+    }
+
+    bool prep_close_fixed(uint32_t slot, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_sqe_set_data(sqe, data);
+
+        io_uring_prep_close_direct(sqe, slot);
+
+        m_pending++;
+
+        return true;
+    }
+
+    /**
+      Block until at least one CQE is ready then process everything that is ready.
+      Used by threads that have nothing in flight and are waiting on a wakeup from another ring.
+      */
+    uint32_t wait_events()
+    {
+        if (!m_valid)
+            return 0;
+
+        io_uring_cqe *cqe = nullptr;
+        int ret = io_uring_wait_cqe(&m_ring, &cqe);
+        if (ret < 0 && ret != -EINTR)
+        {
+            ERROR << "io_uring_wait_cqe failed: " << ::strerror(-ret) << ENDL;
+            return 0;
+        }
+        return process_events();
+    }
+
     uint32_t process_events()
     {
         if (!m_valid)
@@ -257,9 +900,10 @@ public:
             return 0;
         }
 
-        if (!m_multishot && !m_pending)
+        // wakeups from other rings show up without anything pending on our side
+        if (!m_pending && !io_uring_cq_ready(&m_ring))
         {
-            DEBUG(5) << "m_pending: " << m_pending << ENDL;
+            DEBUGF(5, "m_pending: {}", m_pending);
             return 0;
         }
 
@@ -267,19 +911,49 @@ public:
         uint32_t i = 0;
         unsigned head;
         uint32_t new_events = 0;
+        uint64_t reap_ns = m_stats ? get_nanoseconds() : 0;
+        uint32_t inflight = m_pending;
 
         io_uring_for_each_cqe(&m_ring, head, cqe)
         {
-             if (!m_multishot)
+             i++;
+             uint64_t user_data = io_uring_cqe_get_data64(cqe);
+             if (user_data & STATS_TAG)
+                 user_data = untrack(user_data, cqe->flags, reap_ns);
+             if (user_data & MESSAGE_TAG)
+             {
+                 // posted by another ring, nothing pending on our side for it
+                 m_messages++;
+                 EVENT_CLASS *req = reinterpret_cast<EVENT_CLASS*>(user_data & ~MESSAGE_TAG);
+                 if (req)
+                     new_events += dispatch(req, cqe->res, cqe->flags);
+                 continue;
+             }
+             if (!user_data)
+             {
+                 // only a failed message send with no sender data posts a CQE without user data
+                 ERROR << "msg_ring failed: " << ::strerror(-cqe->res) << ENDL;
+                 continue;
+             }
+
+             // a multishot op stays pending until the CQE that ends it, the one without F_MORE
+             if (!(cqe->flags & IORING_CQE_F_MORE))
                  m_pending--; // decrement prior to ::process potentially incrementing
-             EVENT_CLASS *req = reinterpret_cast<EVENT_CLASS*>(io_uring_cqe_get_data(cqe));
-             uint32_t events = req->process_io_uring(cqe->res);
-             DEBUG(3) << "called process_io_uring, events: " << events << ENDL;
+             EVENT_CLASS *req = reinterpret_cast<EVENT_CLASS*>(user_data);
+             uint32_t events = dispatch(req, cqe->res, cqe->flags);
+             DEBUGF(3, "called process_io_uring, events: {}", events);
              new_events += events;
-             i++;
         }
 
-        DEBUG(2) << "batch events: " << i << ", new events: " << new_events << ENDL;
+        DEBUGF(2, "batch events: {}, new events: {}", i, new_events);
+
+        if (m_stats && i > 0)
+        {
+            m_stats->batch_ns.record(get_nanoseconds() - reap_ns);
+            m_stats->cq_batch.record(i);
+            m_stats->inflight.record(inflight);
+            m_stats->in_flight.store(m_pending, std::memory_order_relaxed);
+        }
 
         if (new_events)
             this->submit();
@@ -290,29 +964,111 @@ public:
         return i;
     }
 
+    /**
+      Provided buffers: a ring of entries (a power of 2) buffer descriptors shared with the kernel,
+      IOSQE_BUFFER_SELECT ops on group take the next buffer from it. Fill it with io_uring_buf_ring_add()
+      and io_uring_buf_ring_advance(), see buffer_ring.h. Free it before the ring goes away.
+      */
+    io_uring_buf_ring* setup_buf_ring(uint32_t entries, uint16_t group)
+    {
+        if (!m_valid)
+            return nullptr;
+
+        int ret = 0;
+        io_uring_buf_ring *br = io_uring_setup_buf_ring(&m_ring, entries, group, 0, &ret);
+        if (!br)
+        {
+            ERROR << "io_uring_setup_buf_ring: " << ::strerror(-ret) << ENDL;
+            return nullptr;
+        }
+        return br;
+    }
+
+    void free_buf_ring(io_uring_buf_ring *br, uint32_t entries, uint16_t group)
+    {
+        if (m_valid && br)
+            io_uring_free_buf_ring(&m_ring, br, entries, group);
+    }
+
     bool is_valid() const { return m_valid; }
 
     uint32_t pending() const { return m_pending; }
 
+    int ring_fd() const { return m_ring.ring_fd; }
+
+    uint64_t messages() const { return m_messages; }
+
 private:
+    static constexpr log_module s_log_module = LOG_WRAPPER;
+
+    // low bit of user_data marks a CQE posted by another ring, EVENT_CLASS pointers are always aligned
+    static constexpr uint64_t MESSAGE_TAG = 1;
+    // next bit marks an op_slot standing in for the caller's user_data while stats are on
+    static constexpr uint64_t STATS_TAG = 2;
+
+    struct op_slot
+    {
+        uint64_t user_data = 0;
+        uint64_t prep_ns = 0;
+        uint64_t submit_ns = 0;
+        uint8_t opcode = 0;
+        bool busy = false;
+    };
+
     io_uring m_ring;
     uint32_t m_queue_depth = 10;
     uint32_t m_pending = 0;
     bool m_valid = true;
-    bool m_multishot = false;
+    uint64_t m_messages = 0;
 
-    // io_uring allows you to supply multiple buffer rings (rings of buffers), each can have a diff/uniq size if desired
-    // then io_uring chooses which buffer to use based on the incoming event
-    // might use that if we were doing accepts and reads from the same io_uring ring
-    // for now we won't use it but want to plumb in the storage to handle it, kind of
+    io_uring_stats *m_stats = nullptr;
+    std::unique_ptr<io_uring_stats> m_own_stats;
+    std::vector<uint64_t> m_prep_ns;     // get_sqe() time for each SQ slot
+    io_uring_sqe *m_last_sqe = nullptr;  // for link_next()
+    std::vector<std::unique_ptr<op_slot>> m_slots;
+    std::vector<op_slot*> m_free_slots;
 
-    //std::vector<io_uring_buf_ring*> m_buff_rings; // not used yet, maybe never
-
-    // what is best way to store multiple arrays of buffers (array of arrays)
-    // tracking the number of arrays and the length of each buffer
-    // allow user to call ->add_ring_buffer(number_of_buffers, size_of_buffers)
+    // provided buffer rings (one per buffer group, each with its own buffer size) are set up with
+    // setup_buf_ring() and owned by the caller, see buffer_ring.h
 
 private:
+    // classes that care about the CQE flags (provided buffers, multishot) take them as a second argument
+    static uint32_t dispatch(EVENT_CLASS *req, int32_t res, uint32_t flags)
+    {
+        if constexpr (requires { req->process_io_uring(res, flags); })
+            return req->process_io_uring(res, flags);
+        else
+            return req->process_io_uring(res);
+    }
+
+    static uint64_t message_data(void *target_data)
+    {
+        return reinterpret_cast<uint64_t>(target_data) | MESSAGE_TAG;
+    }
+
+    // with no sender data there is nothing to hand our CQE to, so skip it unless the send fails
+    void set_sender_data(io_uring_sqe *sqe, void *data)
+    {
+        io_uring_sqe_set_data(sqe, data);
+        if (data)
+            m_pending++;
+        else
+            io_uring_sqe_set_flags(sqe, IOSQE_CQE_SKIP_SUCCESS);
+    }
+
+    bool prep_msg_ring(int target_ring_fd, void *target_data, int32_t res, void *data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+
+        if (!sqe)
+            return false;
+
+        io_uring_prep_msg_ring(sqe, target_ring_fd, static_cast<uint32_t>(res), message_data(target_data), 0);
+        set_sender_data(sqe, data);
+
+        return true;
+    }
+
     io_uring_sqe* get_sqe()
     {
         if (!m_valid)
@@ -324,68 +1080,119 @@ private:
         {
             // MAN: the  SQ  ring is currently full and entries must be submitted for processing before new ones can get allocated
             WARN << "io_uring_get_sqe: failed to get SQE, calling submit and retrying" << ENDL;
+            if (m_stats)
+                io_uring_stats::bump(m_stats->sq_full);
             this->submit();
             sqe = io_uring_get_sqe(&m_ring);
             if (!sqe)
             {
                 ERROR << "io_uring_get_sqe: failed to get SQE on 2nd try, failing" << ENDL;
+                if (m_stats)
+                    io_uring_stats::bump(m_stats->sq_full_failed);
             }
         }
+
+        if (sqe && m_stats)
+            m_prep_ns[sqe - m_ring.sq.sqes] = get_nanoseconds();
+        m_last_sqe = sqe;
         return sqe;
     }
 
     /**
-      Add buffers for use by io_uring.
-      Initial use case is for multishot accept but could be used by most of the io_uring apis
-
-      should be able to pass in an array of objects or and array of char*
-      element size is redundant with actual types that you can run sizeof() on but 
-      when an array of char buffers is passed we need to know how big each buffer is
-
-      sockaddr_in *addrs = new sockaddr_in[1000];
-      setup_buffer_ring(1000, addrs) // pass in an array of 1000 sockaddr_in objects, the pointers are alligned properly
-
-
-      char **buffers = new char*[1000];
-      char *buff = new char[1000 * 1024]; // single large buffer to avoid allocation overhead
-      for (uint32_t i = 0; i < 1000; i++)
-      {
-          buffers[i] = buff + (i * 1024);
-      }
-      setup_buffer_ring(1000, buffers, 1024) // pass in an array of 1000 char buffers of 1024 bytes each
-
-    */
-/*
-    template<typename DTYPE>
-    io_uring_buf_ring* setup_buffer_ring(uint32_t buff_cnt, DTYPE *array_ptr, size_t element_size = sizeof(DTYPE), int32_t buff_ring_id = -1)
+      Every SQE between sqe_head and sqe_tail is prepared but not yet handed to the kernel, swap each
+      one's user_data for a slot remembering it along with its opcode and timestamps.
+      SQEs without user_data (skipped message sends) never post a CQE we could match, they are left alone.
+      A cancel by user_data is pointed at the target's slot once every op in the batch has one.
+      */
+    void track_unsubmitted()
     {
-	    io_uring_buf_reg reg = { };
-	    io_uring_buf_ring *br = nullptr;
+        uint64_t now = get_nanoseconds();
+        uint32_t cnt = 0;
+        bool cancels = false;
+        for (unsigned pos = m_ring.sq.sqe_head; pos != m_ring.sq.sqe_tail; pos++)
+        {
+            unsigned idx = pos & m_ring.sq.ring_mask;
+            io_uring_sqe *sqe = &m_ring.sq.sqes[idx];
+            cnt++;
+            cancels |= is_cancel_by_data(sqe);
+            if (!sqe->user_data || (sqe->user_data & STATS_TAG))
+                continue;
+
+            op_slot *slot = get_slot();
+            slot->user_data = sqe->user_data;
+            slot->prep_ns = m_prep_ns[idx];
+            slot->submit_ns = now;
+            slot->opcode = sqe->opcode;
+            slot->busy = true;
+            sqe->user_data = reinterpret_cast<uint64_t>(slot) | STATS_TAG;
+            m_stats->sq_wait.record(now - slot->prep_ns);
+        }
+        if (cancels)
+        {
+            for (unsigned pos = m_ring.sq.sqe_head; pos != m_ring.sq.sqe_tail; pos++)
+            {
+                io_uring_sqe *sqe = &m_ring.sq.sqes[pos & m_ring.sq.ring_mask];
+                if (is_cancel_by_data(sqe) && !(sqe->addr & STATS_TAG))
+                    sqe->addr = slot_of(sqe->addr);
+            }
+        }
+        if (cnt)
+            io_uring_stats::bump(m_stats->submits);
+        m_stats->in_flight.store(m_pending, std::memory_order_relaxed);
+    }
 
-	    // allocate mem for sharing buffer ring
-	    if (posix_memalign((void **) &br, 4096, buff_cnt * sizeof(struct io_uring_buf_ring)))
-		    return nullptr;
+    static bool is_cancel_by_data(const io_uring_sqe *sqe)
+    {
+        return sqe->opcode == IORING_OP_ASYNC_CANCEL && sqe->addr
+            && !(sqe->cancel_flags & (IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ANY));
+    }
 
-	    // assign and register buffer ring
-	    reg.ring_addr = (unsigned long) br;
-	    reg.ring_entries = buff_cnt;
-	    reg.bgid = buff_ring_id;
+    // a walk over every slot, cancels are rare enough; nothing found leaves user_data as it was, for -ENOENT
+    uint64_t slot_of(uint64_t user_data) const
+    {
+        for (const auto &slot : m_slots)
+        {
+            if (slot->busy && slot->user_data == user_data)
+                return reinterpret_cast<uint64_t>(slot.get()) | STATS_TAG;
+        }
+        return user_data;
+    }
 
-	    if (io_uring_register_buf_ring(&m_ring, &reg, 0))
-		    return nullptr;
+    // record the op's times and hand back the caller's user_data, multishot ops keep their slot until the last CQE
+    uint64_t untrack(uint64_t user_data, uint32_t cqe_flags, uint64_t reap_ns)
+    {
+        op_slot *slot = reinterpret_cast<op_slot*>(user_data & ~STATS_TAG);
+        user_data = slot->user_data;
+        if (m_stats)
+        {
+            m_stats->latency_for(slot->opcode).record(reap_ns - slot->prep_ns);
+            m_stats->service.record(reap_ns - slot->submit_ns);
+        }
 
-	    // add initial buffers to the ring
-	    io_uring_buf_ring_init(br);
-	    for (uint32_t i = 0; i < buff_cnt; i++)
+        if (cqe_flags & IORING_CQE_F_MORE)
         {
-		    // add each buffer, we'll use i as the buffer ID
-		    io_uring_buf_ring_add(br, bufs[i], BUF_SIZE, i, io_uring_buf_ring_mask(buff_cnt), i);
-	    }
+            // the next one is timed from here
+            slot->prep_ns = reap_ns;
+            slot->submit_ns = reap_ns;
+        }
+        else
+        {
+            slot->busy = false;
+            m_free_slots.push_back(slot);
+        }
+        return user_data;
+    }
 
-	    // we've supplied buffers, make them visible to the kernel
-	    io_uring_buf_ring_advance(br, buff_cnt);
-	    return br;
+    op_slot* get_slot()
+    {
+        if (m_free_slots.empty())
+        {
+            m_slots.emplace_back(new op_slot);
+            return m_slots.back().get();
+        }
+        op_slot *slot = m_free_slots.back();
+        m_free_slots.pop_back();
+        return slot;
     }
-*/
 
 };
@@ -8,12 +8,44 @@ void submit_log_entry(std::string &buff)
     s_error_log.log(buff);
 }
 
+void submit_log_record(std::string_view record)
+{
+    s_error_log.log_record(record);
+}
+
 void set_error_log_name(const char *dir_name, const char *file_name)
 {
     s_error_log.set_log_name(dir_name, file_name);
 }
 
+void set_error_log_flush(uint32_t flush_ms, bool datasync)
+{
+    s_error_log.set_flush_interval(flush_ms);
+    s_error_log.set_sync(datasync);
+}
+
+void set_error_log_control(const char *path)
+{
+    s_error_log.set_control_file(path);
+}
+
+void set_error_log_rotation(uint64_t max_bytes, uint32_t max_secs, uint32_t keep, bool compress)
+{
+    s_error_log.set_rotation(max_bytes, max_secs, keep, compress);
+}
+
 void process_error_log_events()
 {
     s_error_log.process_events();
 }
+
+log_counters get_error_log_counters()
+{
+    log_counters counters;
+    counters.dropped = s_error_log.dropped();
+    counters.blocked = s_error_log.blocked();
+    counters.bytes_written = s_error_log.bytes_written();
+    counters.short_writes = s_error_log.short_writes();
+    counters.rotations = s_error_log.rotations();
+    return counters;
+}
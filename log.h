@@ -1,20 +1,168 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <string>
+#include <string_view>
+#include <utility>
 
 #include "get_milliseconds.h"
+#include "log_record.h"
 #include "string_helpers.h"
 
-inline static int s_debug_level = 0;
+/**
+  Debug levels
+
+  Compile time: DEBUG(n)/DEBUGF(n, ...) with n > LOG_MAX_DEBUG_LEVEL are discarded by if constexpr,
+  no code is generated for them, build with -DLOG_MAX_DEBUG_LEVEL=0 to drop every debug site.
+
+  Run time: each site belongs to a module, found by name lookup of s_log_module at the call site,
+  so a class picks its module with a static constexpr s_log_module member and everything else is LOG_GENERAL.
+  A module with a level >= 0 uses it, -1 (the default) falls back to s_debug_level.
+  Both can be changed while running, set_log_module_level() or the writer's control file (see log_file.h).
+  */
+#ifndef LOG_MAX_DEBUG_LEVEL
+#define LOG_MAX_DEBUG_LEVEL 9
+#endif
+
+enum log_module { LOG_GENERAL, LOG_WRAPPER, LOG_FILE, LOG_COPY, LOG_HTTP, LOG_MODULE_CNT };
+
+inline const char* to_str(log_module val)
+{
+    switch (val) {
+    case LOG_GENERAL: return "general";
+    case LOG_WRAPPER: return "wrapper";
+    case LOG_FILE: return "log_file";
+    case LOG_COPY: return "copy";
+    case LOG_HTTP: return "http";
+    case LOG_MODULE_CNT: break;
+    };
+    return "UNHANDLED";
+}
+
+inline bool from_str(std::string_view str, log_module &val)
+{
+    for (int i = 0; i < LOG_MODULE_CNT; i++)
+    {
+        if (str == to_str(static_cast<log_module>(i)))
+        {
+            val = static_cast<log_module>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// every module starts on s_debug_level, however many LOG_MODULE_CNT says there are
+template<size_t... I>
+constexpr std::array<std::atomic<int>, sizeof...(I)> unset_module_levels(std::index_sequence<I...>)
+{
+    return {{((void)I, -1)...}};
+}
+
+inline std::atomic<int> s_debug_level{0};
+inline std::array<std::atomic<int>, LOG_MODULE_CNT> s_module_levels = unset_module_levels(std::make_index_sequence<LOG_MODULE_CNT>{});
+inline constexpr log_module s_log_module = LOG_GENERAL;
 inline thread_local std::string s_log_buffer;
 
+inline bool log_enabled(log_module module, int level)
+{
+    int module_level = s_module_levels[module].load(std::memory_order_relaxed);
+    return (module_level < 0 ? s_debug_level.load(std::memory_order_relaxed) : module_level) >= level;
+}
+
+// -1 puts the module back on s_debug_level
+inline void set_log_module_level(log_module module, int level)
+{
+    s_module_levels[module].store(level, std::memory_order_relaxed);
+}
+
+/**
+  "wrapper=3,copy=1" or one name=level per line, "debug" sets s_debug_level, # starts a comment line.
+  Applies what parses, returns false if anything didn't.
+  */
+inline bool set_log_levels(std::string_view spec)
+{
+    bool ok = true;
+    while (!spec.empty())
+    {
+        size_t end = spec.find_first_of(",\n");
+        std::string_view item = spec.substr(0, end);
+        spec.remove_prefix(end == std::string_view::npos ? spec.size() : end + 1);
+
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+            item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t' || item.back() == '\r'))
+            item.remove_suffix(1);
+        if (item.empty() || item.front() == '#')
+            continue;
+
+        size_t eq = item.find('=');
+        int level = 0;
+        if (eq == std::string_view::npos ||
+            std::from_chars(item.data() + eq + 1, item.data() + item.size(), level).ec != std::errc())
+        {
+            ok = false;
+            continue;
+        }
+
+        std::string_view name = item.substr(0, eq);
+        log_module module;
+        if (name == "debug")
+            s_debug_level.store(level, std::memory_order_relaxed);
+        else if (from_str(name, module))
+            set_log_module_level(module, level);
+        else
+            ok = false;
+    }
+    return ok;
+}
+
 void submit_log_entry(std::string &buff);
+void submit_log_record(std::string_view record);
 void set_error_log_name(const char *dir_name, const char *file_name);
+void set_error_log_flush(uint32_t flush_ms, bool datasync); // call before set_error_log_name
+void set_error_log_control(const char *path); // levels file re-read by the log writer when it changes
+void set_error_log_rotation(uint64_t max_bytes, uint32_t max_secs, uint32_t keep, bool compress); // before set_error_log_name
 void process_error_log_events();
 
+// the log writer's counters, safe to call from any thread
+struct log_counters
+{
+    uint64_t dropped = 0;
+    uint64_t blocked = 0;
+    uint64_t bytes_written = 0;
+    uint64_t short_writes = 0;
+    uint64_t rotations = 0;
+};
+log_counters get_error_log_counters();
+
 #define BEGL s_log_buffer.clear(); s_log_buffer << get_milliseconds()
 #define ERROR { BEGL << " ERROR " << __func__ << ' ' << __FILE__ << ':' << __LINE__ << ' '
 #define TRACE { BEGL << " TRACE " << __func__ << ' ' << __FILE__ << ':' << __LINE__ << ' '
 #define WARN  { BEGL << " WARN " << __func__ << ' ' << __FILE__ << ':' << __LINE__ << ' '
-#define DEBUG(level) if (s_debug_level >= level)  { BEGL << " DEBUG" << level << ' ' << __func__ << ' ' << __FILE__ << ':' << __LINE__ << ' '
+#define DEBUG(level) if constexpr ((level) <= LOG_MAX_DEBUG_LEVEL) if (log_enabled(s_log_module, level)) { BEGL << " DEBUG" << level << ' ' << __func__ << ' ' << __FILE__ << ':' << __LINE__ << ' '
 #define ENDL '\n'; submit_log_entry(s_log_buffer); }
+
+/**
+  Deferred format versions for hot paths, see log_record.h
+      DEBUGF(2, "batch events: {}, new events: {}", i, new_events);
+  The calling thread only copies the arguments, the log writer renders the line.
+  */
+template<typename... ARGS>
+inline void log_deferred(const log_site *site, const ARGS&... args)
+{
+    log_record_buffer buf;
+    encode_log_record(buf, site, get_milliseconds(), args...);
+    submit_log_record(std::string_view(buf.data, buf.len));
+}
+
+#define LOG_SITE(level, debug_level, format) static const log_site s_log_site{level, debug_level, __func__, __FILE__, __LINE__, format}
+#define ERRORF(format, ...) { LOG_SITE(" ERROR ", -1, format); log_deferred(&s_log_site __VA_OPT__(,) __VA_ARGS__); }
+#define TRACEF(format, ...) { LOG_SITE(" TRACE ", -1, format); log_deferred(&s_log_site __VA_OPT__(,) __VA_ARGS__); }
+#define WARNF(format, ...)  { LOG_SITE(" WARN ", -1, format); log_deferred(&s_log_site __VA_OPT__(,) __VA_ARGS__); }
+#define DEBUGF(level, format, ...) if constexpr ((level) <= LOG_MAX_DEBUG_LEVEL) if (log_enabled(s_log_module, level)) { LOG_SITE(" DEBUG", level, format); log_deferred(&s_log_site __VA_OPT__(,) __VA_ARGS__); }
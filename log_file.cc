@@ -1,39 +1,73 @@
-
 #include "log_file.h"
 
+#include <sched.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
 #include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <string_view>
 
 #include "io_uring_wrapper.h"
-#include "scoped_lock.h"
+#include "log_record.h"
+
+namespace
+{
+    // the calling thread's ring, given back to the log_file when the thread exits
+    struct producer_handle
+    {
+        log_file *owner = nullptr;
+        log_file::producer *prod = nullptr;
+
+        void release()
+        {
+            if (prod)
+                prod->in_use.store(false, std::memory_order_release);
+            owner = nullptr;
+            prod = nullptr;
+        }
+
+        ~producer_handle() { release(); }
+    };
+
+    thread_local producer_handle s_producer;
+    // set on the writer thread, a BLOCK wait from there would never end
+    thread_local bool s_is_writer = false;
+}
 
 log_file::log_file()
-    : m_io_uring(new io_uring_wrapper<log_file>(10))
 {
     //set_log_name(log_dir, file_name);
-    m_input_buffer->clear();
 }
 
 log_file::~log_file()
 {
-    if (m_state == IDLE && m_input_buffer->size())
+    if (m_writer.joinable())
     {
-        write_buffer(true);
+        // any other logging threads should be gone by now
+        m_stop.store(true, std::memory_order_release);
+        ::eventfd_write(m_wake_fd, 1);
+        m_writer.join();
     }
+    // anything logged from here on goes to std::cerr
+    m_to_file.store(false, std::memory_order_release);
 
-    while (m_state != IDLE)
-        process_events();
-
-    if (m_input_buffer->size())
-    {
-        write_buffer(true);
-        while (m_state != IDLE)
-            process_events();
-    }
+    if (m_wake_fd != -1)
+        ::close(m_wake_fd);
+    if (m_fd != -1)
+        ::close(m_fd);
+    if (m_dir_fd != -1)
+        ::close(m_dir_fd);
 
-    delete m_io_uring;
+    uint32_t cnt = std::min(m_producer_cnt.load(), MAX_PRODUCERS);
+    for (uint32_t i = 0; i < cnt; i++)
+        delete m_producers[i].load();
 }
 
 
@@ -62,115 +96,478 @@ void log_file::set_log_name(std::string_view log_dir, std::string_view file_name
     if (!m_file_name.empty() && m_fd == -1)
     {
         // we have not opened the log file yet, this should be at the start of the app, do a blocking open
-        m_fd = ::openat(m_dir_fd, m_file_name.data(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+        // writes go at explicit offsets, starting from the current end of the file
+        m_fd = ::openat(m_dir_fd, m_file_name.data(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
         if (-1 == m_fd)
         {
-            std::cerr << "Failed to open log file: " << m_file_name << ", " << ::strerror(errno) << std::endl; 
+            std::cerr << "Failed to open log file: " << m_file_name << ", " << ::strerror(errno) << std::endl;
             exit(1);
         }
+        m_offset = ::lseek(m_fd, 0, SEEK_END);
+        m_opened_at = ::time(nullptr);
+
+        m_wake_fd = ::eventfd(0, EFD_CLOEXEC); // blocking, io_uring fails reads on a nonblocking fd with EAGAIN
+        if (-1 == m_wake_fd)
+        {
+            std::cerr << "Failed to create log eventfd: " << ::strerror(errno) << std::endl;
+            exit(1);
+        }
+
+        m_to_file.store(true, std::memory_order_release);
+        m_writer = std::thread(&log_file::writer_main, this);
     }
 }
 
 
-void log_file::log(std::string_view str, bool lock_it) // lock_it defaults to true for
+void log_file::log(std::string_view str)
+{
+    if (str.empty())
+        return;
+
+    std::string with_nl;
+    if (str.back() != '\n')
+    {
+        with_nl.reserve(str.size() + 1);
+        with_nl.append(str);
+        with_nl.push_back('\n');
+        str = with_nl;
+    }
+
+    submit(str, false);
+}
+
+void log_file::log_record(std::string_view record)
 {
-    dsy::scoped_lock alock(&m_mutex, lock_it);
-    m_input_buffer->append(str);
-    if (m_input_buffer->back() != '\n')
-        m_input_buffer->push_back('\n');
+    submit(record, true);
+}
 
-    if (m_fd > -1)
+void log_file::submit(std::string_view str, bool record)
+{
+    if (!m_to_file.load(std::memory_order_acquire))
     {
-        if (m_input_buffer->size() > 10 * 1024)
+        if (record)
+        {
+            std::string line;
+            render_log_record(str, line);
+            std::cerr << line;
+        }
+        else
         {
-            write_buffer(false);
+            std::cerr << str;
         }
+        return;
     }
-    else
+
+    producer *prod = get_producer();
+    if (!prod)
     {
-        std::cerr << *m_input_buffer << std::endl;
-        m_input_buffer->clear();
+        m_unregistered_drops.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
+
+    if (!prod->ring.try_write(str, record))
+    {
+        if (m_policy == DROP || s_is_writer || str.size() + sizeof(uint32_t) > prod->ring.capacity())
+        {
+            prod->dropped.fetch_add(1, std::memory_order_relaxed);
+            wake();
+            return;
+        }
+
+        prod->blocked.fetch_add(1, std::memory_order_relaxed);
+        do
+        {
+            wake();
+            ::sched_yield();
+        } while (!prod->ring.try_write(str, record));
+    }
+
+    if (prod->ring.used() > prod->ring.capacity() / 4)
+        wake();
 }
 
 void log_file::reopen()
 {
-    // set the flag for the write thread to take action on
-    m_reopen = true;
-    reopen_log();
+    // set the flag for the writer thread to take action on
+    m_reopen.store(true, std::memory_order_release);
+    wake();
 }
 
-uint32_t log_file::process_io_uring(int res)
+void log_file::process_events()
 {
-    // do we need to lock here? hmm?
+    m_flush_now.store(true, std::memory_order_release);
+    wake();
+}
 
-    switch (m_state) {
-    case OPENING:
-        if (m_new_fd == -1)
+uint64_t log_file::dropped() const
+{
+    uint64_t total = m_unregistered_drops.load(std::memory_order_relaxed);
+    uint32_t cnt = std::min(m_producer_cnt.load(std::memory_order_acquire), MAX_PRODUCERS);
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        producer *prod = m_producers[i].load(std::memory_order_acquire);
+        if (prod)
+            total += prod->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t log_file::blocked() const
+{
+    uint64_t total = 0;
+    uint32_t cnt = std::min(m_producer_cnt.load(std::memory_order_acquire), MAX_PRODUCERS);
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        producer *prod = m_producers[i].load(std::memory_order_acquire);
+        if (prod)
+            total += prod->blocked.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+log_file::producer* log_file::get_producer()
+{
+    if (s_producer.owner == this)
+        return s_producer.prod;
+
+    // first log from this thread (or it last logged to a different log_file)
+    s_producer.release();
+
+    // take over the ring of a thread that has exited, anything still in it gets drained as usual
+    uint32_t cnt = std::min(m_producer_cnt.load(std::memory_order_acquire), MAX_PRODUCERS);
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        producer *prod = m_producers[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (prod && prod->in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
         {
-            if (res < 0)
-            {
-                std::cerr << "Failed to open log file: " << m_file_name << ", " << ::strerror(-res) << std::endl;
-                exit(1);
-            }
-            else
-            {
-                dsy::scoped_lock alock(&m_mutex, true);
-                std::swap(m_new_fd, m_fd);
-                m_io_uring->prep_close(m_new_fd, this); 
-            }
+            s_producer.owner = this;
+            s_producer.prod = prod;
+            return prod;
         }
-        else // m_new_fd is being closed after having been swapped with m_fd
+    }
+
+    uint32_t slot = m_producer_cnt.fetch_add(1, std::memory_order_acq_rel);
+    if (slot >= MAX_PRODUCERS)
+        return nullptr;
+
+    producer *prod = new producer;
+    m_producers[slot].store(prod, std::memory_order_release);
+    s_producer.owner = this;
+    s_producer.prod = prod;
+    return prod;
+}
+
+// one eventfd write per drain at most, the writer clears m_wake_pending before it drains
+void log_file::wake()
+{
+    if (m_wake_fd == -1)
+        return;
+    if (m_wake_pending.load(std::memory_order_relaxed) || m_wake_pending.exchange(true, std::memory_order_acq_rel))
+        return;
+    ::eventfd_write(m_wake_fd, 1);
+}
+
+void log_file::writer_main()
+{
+    s_is_writer = true;
+
+    io_uring_wrapper<log_op> ring(MAX_INFLIGHT * 2 + 8);
+    if (!ring.is_valid())
+    {
+        std::cerr << "Failed to create the log writer's io_uring" << std::endl;
+        exit(1);
+    }
+    m_io_uring = &ring;
+
+    m_flush_ts.tv_sec = m_flush_ms / 1000;
+    m_flush_ts.tv_nsec = (m_flush_ms % 1000) * 1000000LL;
+
+    arm_wake();
+    arm_timeout();
+    ring.submit();
+
+    while (!m_stop.load(std::memory_order_acquire))
+    {
+        ring.wait_events();
+        pump();
+    }
+
+    // let whatever is in flight finish, the timeout and the eventfd read die with the ring
+    while (m_writes_inflight || m_opening || m_syncing)
+        ring.wait_events();
+
+    // then one last blocking write for anything still in the rings
+    std::string rest;
+    if (m_filling)
+        rest.swap(m_filling->m_buffer);
+    drain(rest, SIZE_MAX);
+    size_t done = 0;
+    while (done < rest.size())
+    {
+        ssize_t ret = ::pwrite(m_fd, rest.data() + done, rest.size() - done, m_offset + done);
+        if (ret <= 0)
         {
-            if (res < 0)
-            {
-                std::cerr << "Failed to close log file: " << m_file_name << ", " << ::strerror(-res) << std::endl;
-                exit(1);
-            }
-            m_new_fd = -1;
-            m_state = IDLE;
+            if (ret < 0 && errno == EINTR)
+                continue;
+            std::cerr << "Failed to write log buffer: " << ::strerror(errno) << std::endl;
+            break;
+        }
+        done += ret;
+    }
+    m_offset += done;
+    m_bytes_written.fetch_add(done, std::memory_order_relaxed);
+    if (m_sync)
+        ::fdatasync(m_fd);
+
+    // a gzip still running held the prune back, wait for it rather than leave more than keep behind
+    for (const compressor &c : m_compressors)
+        ::waitpid(c.pid, nullptr, 0);
+    m_compressors.clear();
+    while (m_rotate_keep && m_rotated.size() > m_rotate_keep)
+    {
+        ::unlinkat(m_dir_fd, m_rotated.front().c_str(), 0);
+        m_rotated.pop_front();
+    }
+
+    m_io_uring = nullptr;
+}
+
+uint32_t log_file::op_done(log_op &op, int res)
+{
+    switch (op.m_kind) {
+    case log_op::TIMEOUT:
+        // -ETIME is the normal expiry
+        m_tick = true;
+        if (!m_stop.load(std::memory_order_acquire))
+        {
+            arm_timeout();
+            return 1;
         }
+        put_op(&op);
         break;
-    case WRITING:
+    case log_op::WAKE:
+        m_wake_pending.store(false, std::memory_order_release);
         if (res < 0)
+            std::cerr << "Failed to read log eventfd: " << ::strerror(-res) << std::endl;
+        if (!m_stop.load(std::memory_order_acquire))
         {
-            std::cerr << "Failed to write log buffer: " << ::strerror(-res) << std::endl;
+            m_io_uring->prep_read(m_wake_fd, reinterpret_cast<char*>(&op.m_wake_cnt), sizeof(op.m_wake_cnt), 0, &op);
+            return 1;
+        }
+        put_op(&op);
+        break;
+    case log_op::WRITE:
+        m_writes_inflight--;
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            issue_write(&op);
+            return 1;
+        }
+        if (res <= 0)
+        {
+            std::cerr << "Failed to write log buffer: " << (res ? ::strerror(-res) : "wrote 0 bytes")
+                      << ", lost " << op.m_buffer.size() - op.m_done << " bytes" << std::endl;
+            put_op(&op);
+            break;
         }
 
-        if (res < m_output_buffer->size())
+        op.m_done += res;
+        m_bytes_written.fetch_add(res, std::memory_order_relaxed);
+        m_dirty = true;
+        if (op.m_done < op.m_buffer.size())
         {
-            std::cerr << "PARTIAL WRITE, wrote " << res << " bytes out of " << m_output_buffer->size() << std::endl;
+            // short write, carry on from where it stopped
+            m_short_writes.fetch_add(1, std::memory_order_relaxed);
+            issue_write(&op);
+            return 1;
         }
-        // TODO: track bytes written so we can call write multiple times if we are getting partial writes
-        m_output_buffer->clear();
-        m_state = IDLE;
-    default:
+        put_op(&op);
         break;
-    }
+    case log_op::SYNC:
+        if (res < 0)
+            std::cerr << "Failed to fdatasync log file: " << m_file_name << ", " << ::strerror(-res) << std::endl;
+        m_syncing = false;
+        put_op(&op);
+        break;
+    case log_op::OPEN:
+        if (res < 0)
+        {
+            std::cerr << "Failed to open log file: " << m_file_name << ", " << ::strerror(-res) << std::endl;
+            exit(1);
+        }
+        else
+        {
+            struct stat sb;
+            int old_fd = m_fd;
+            m_fd = res;
+            m_offset = ::fstat(m_fd, &sb) == 0 ? sb.st_size : 0;
+            m_opened_at = ::time(nullptr);
+            m_opening = false;
+            put_op(&op);
 
-    return m_state == IDLE ? 0 : 1;
+            log_op *close_op = get_op(log_op::CLOSE);
+            close_op->m_fd = old_fd;
+            close_op->m_buffer.swap(m_rotated_name); // empty for a plain reopen
+            m_io_uring->prep_close(old_fd, close_op);
+            return 1;
+        }
+        break;
+    case log_op::CLOSE:
+        if (res < 0)
+            std::cerr << "Failed to close log file: " << m_file_name << ", " << ::strerror(-res) << std::endl;
+        if (op.m_buffer.empty())
+        {
+            put_op(&op);
+            break;
+        }
+        else
+        {
+            // the rotated file is complete now
+            std::string rotated = op.m_buffer;
+            put_op(&op);
+            if (m_rotate_compress && compress(rotated))
+                rotated += ".gz";
+            m_rotated.push_back(rotated);
+            return prune_rotated();
+        }
+        break;
+    case log_op::RENAME:
+        if (res < 0)
+        {
+            std::cerr << "Failed to rename log file: " << m_file_name << " to " << op.m_buffer << ", " << ::strerror(-res)
+                      << ", rotation is off" << std::endl;
+            m_rotate_bytes = 0;
+            m_rotate_secs = 0;
+            m_rotated_name.clear();
+            m_opening = false;
+            put_op(&op);
+            break;
+        }
+        m_rotations.fetch_add(1, std::memory_order_relaxed);
+        put_op(&op);
+        // our fd still points at the renamed file, open a new one in its place
+        reopen_log();
+        return 1;
+    case log_op::UNLINK:
+        if (res < 0 && res != -ENOENT)
+            std::cerr << "Failed to remove old log file: " << op.m_buffer << ", " << ::strerror(-res) << std::endl;
+        put_op(&op);
+        break;
+    };
+
+    return 0;
 }
 
-void log_file::process_events()
+/**
+  Runs after every batch of completions: drain the rings and start as many writes as we are allowed.
+  Between flush intervals only full batches are written, on a tick (or process_events()) everything is.
+  */
+void log_file::pump()
 {
-    if (m_state == IDLE)
-        return;
+    bool flush_now = m_tick || m_flush_now.exchange(false, std::memory_order_acq_rel);
+    if (m_tick)
+    {
+        check_control();
+        reap_compressors();
+    }
+    m_tick = false;
+
+    if (!m_filling)
+        m_filling = get_op(log_op::WRITE);
+    drain(m_filling->m_buffer, MAX_WRITE);
 
-    m_io_uring->process_events();
+    // reopen once the old file has nothing in flight, writes wait until the new fd is in place
+    if (!m_opening && !m_writes_inflight && m_reopen.exchange(false, std::memory_order_acq_rel))
+        reopen_log();
+
+    // same for rotation, once it is due no new writes go to the old file
+    bool rotate = rotate_due();
+    if (rotate && !m_opening && !m_writes_inflight)
+        rotate_log();
+
+    while (!rotate && !m_opening && m_writes_inflight < MAX_INFLIGHT && m_filling->m_buffer.size() &&
+           (flush_now || m_filling->m_buffer.size() >= BATCH_SIZE))
+    {
+        // with size rotation only write up to the limit, at a line boundary, the rest goes to the next file
+        if (m_rotate_bytes && m_offset + m_filling->m_buffer.size() > m_rotate_bytes)
+        {
+            size_t cut = m_filling->m_buffer.rfind('\n', m_rotate_bytes - m_offset - 1);
+            if (cut == std::string::npos && m_offset)
+            {
+                // not even one more line fits
+                m_rotate_now = true;
+                break;
+            }
+            if (cut != std::string::npos && cut + 1 < m_filling->m_buffer.size())
+            {
+                log_op *op = get_op(log_op::WRITE);
+                op->m_buffer.assign(m_filling->m_buffer, 0, cut + 1);
+                m_filling->m_buffer.erase(0, cut + 1);
+                issue_write(op);
+                m_rotate_now = true;
+                break;
+            }
+        }
+
+        issue_write(m_filling);
+        m_filling = get_op(log_op::WRITE);
+        drain(m_filling->m_buffer, MAX_WRITE);
+    }
+
+    if (flush_now && m_sync && m_dirty && !m_syncing)
+    {
+        log_op *op = get_op(log_op::SYNC);
+        m_io_uring->prep_fsync(m_fd, IORING_FSYNC_DATASYNC, op);
+        m_syncing = true;
+        m_dirty = false;
+    }
+
+    m_io_uring->submit();
 }
 
-void log_file::write_buffer(bool lock_it)
+void log_file::drain(std::string &out, size_t max_bytes)
 {
-    dsy::scoped_lock alock(&m_mutex, lock_it);
-    if (m_state != IDLE || m_fd == -1)
-        return;
+    // start somewhere different each time so a busy thread can't starve the rest when out fills up
+    uint32_t cnt = std::min(m_producer_cnt.load(std::memory_order_acquire), MAX_PRODUCERS);
+    for (uint32_t i = 0; i < cnt && out.size() < max_bytes; i++)
+    {
+        producer *prod = m_producers[(m_drain_start + i) % cnt].load(std::memory_order_acquire);
+        if (prod)
+            prod->ring.drain(out, max_bytes, render_log_record);
+    }
+    if (cnt)
+        m_drain_start = (m_drain_start + 1) % cnt;
+}
 
-    std::swap(m_input_buffer, m_output_buffer);
-    m_input_buffer->clear(); // just in case
+void log_file::issue_write(log_op *op)
+{
+    if (op->m_fd == -1)
+    {
+        // first time out, it gets the next chunk of the file
+        op->m_fd = m_fd;
+        op->m_offset = m_offset;
+        m_offset += op->m_buffer.size();
+    }
 
-    m_io_uring->prep_write(m_fd, m_output_buffer->data(), m_output_buffer->size(), -1, this);
-    m_io_uring->submit();
-    m_state = WRITING;
+    m_io_uring->prep_write(op->m_fd,
+                           op->m_buffer.data() + op->m_done,
+                           op->m_buffer.size() - op->m_done,
+                           op->m_offset + op->m_done,
+                           op);
+    m_writes_inflight++;
+}
+
+void log_file::arm_timeout()
+{
+    log_op *op = get_op(log_op::TIMEOUT);
+    m_io_uring->prep_timeout(&m_flush_ts, 0, op);
+}
+
+void log_file::arm_wake()
+{
+    log_op *op = get_op(log_op::WAKE);
+    m_io_uring->prep_read(m_wake_fd, reinterpret_cast<char*>(&op->m_wake_cnt), sizeof(op->m_wake_cnt), 0, op);
 }
 
 void log_file::reopen_log()
@@ -179,11 +576,173 @@ void log_file::reopen_log()
     // 2. swap new and old fd
     // 3. close old fd
 
-    if (m_state != IDLE)
+    DEBUG(2) << "opening " << m_file_name << ENDL;
+    log_op *op = get_op(log_op::OPEN);
+    m_io_uring->prep_open_at(m_dir_fd, m_file_name.data(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666, op);
+
+    m_opening = true;
+}
+
+bool log_file::rotate_due() const
+{
+    if (m_offset == 0)
+        return false;
+    if (m_rotate_now)
+        return true;
+    if (m_rotate_bytes && m_offset >= m_rotate_bytes)
+        return true;
+    return m_rotate_secs && ::time(nullptr) - m_opened_at >= m_rotate_secs;
+}
+
+/**
+  1. rename the file to <name>.<YYYYmmdd-HHMMSS>, our fd follows it
+  2. reopen_log() once that completes, then the old fd is closed
+  3. when the close completes compress it and drop the oldest beyond keep
+  */
+void log_file::rotate_log()
+{
+    char stamp[32];
+    time_t now = ::time(nullptr);
+    tm local;
+    ::localtime_r(&now, &local);
+    ::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+
+    std::string name = m_file_name + "." + stamp;
+    // more than one rotation in the same second
+    for (uint32_t i = 1; std::find(m_rotated.begin(), m_rotated.end(), name) != m_rotated.end() ||
+                         std::find(m_rotated.begin(), m_rotated.end(), name + ".gz") != m_rotated.end(); i++)
+    {
+        name = m_file_name + "." + stamp + "-" + std::to_string(i);
+    }
+
+    DEBUG(1) << "rotating " << m_file_name << " to " << name << " at " << m_offset << " bytes" << ENDL;
+    m_rotate_now = false;
+    log_op *op = get_op(log_op::RENAME);
+    op->m_buffer = name;
+    m_rotated_name = name;
+    m_io_uring->prep_rename_at(m_dir_fd, m_file_name.c_str(), m_dir_fd, op->m_buffer.c_str(), op);
+
+    m_opening = true;
+}
+
+// gzip in a child process, we only look at it again to reap it, false when it didn't start
+bool log_file::compress(const std::string &name)
+{
+    std::string path = m_log_dir.empty() ? name : m_log_dir + "/" + name;
+    const char *argv[] = { "gzip", "-f", "--", path.c_str(), nullptr };
+
+    pid_t pid = -1;
+    int ret = ::posix_spawnp(&pid, "gzip", nullptr, nullptr, const_cast<char**>(argv), environ);
+    if (ret)
+    {
+        std::cerr << "Failed to start gzip for " << path << ", " << ::strerror(ret) << std::endl;
+        return false;
+    }
+    m_compressors.push_back(compressor{pid, name + ".gz"});
+    return true;
+}
+
+void log_file::reap_compressors()
+{
+    bool reaped = false;
+    for (size_t i = 0; i < m_compressors.size(); )
+    {
+        int status = 0;
+        if (::waitpid(m_compressors[i].pid, &status, WNOHANG) == 0)
+        {
+            i++;
+            continue;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            // the file was most likely left as it was, that's the one keep has to remove
+            std::cerr << "gzip of a rotated log failed, status: " << status << std::endl;
+            auto it = std::find(m_rotated.begin(), m_rotated.end(), m_compressors[i].name);
+            if (it != m_rotated.end())
+                it->resize(it->size() - 3);
+        }
+        m_compressors[i] = std::move(m_compressors.back());
+        m_compressors.pop_back();
+        reaped = true;
+    }
+
+    // a prune may have stopped at a file still being compressed
+    if (reaped)
+        prune_rotated();
+}
+
+/**
+  Remove the oldest rotated files beyond keep. One still being compressed is left for now, unlinking it
+  would race gzip creating the .gz, reap_compressors() prunes again once its gzip is gone.
+  */
+uint32_t log_file::prune_rotated()
+{
+    uint32_t events = 0;
+    while (m_rotate_keep && m_rotated.size() > m_rotate_keep)
+    {
+        const std::string &oldest = m_rotated.front();
+        if (std::any_of(m_compressors.begin(), m_compressors.end(), [&oldest](const compressor &c) { return c.name == oldest; }))
+            break;
+        log_op *unlink_op = get_op(log_op::UNLINK);
+        unlink_op->m_buffer = oldest;
+        m_rotated.pop_front();
+        m_io_uring->prep_unlink_at(m_dir_fd, unlink_op->m_buffer.c_str(), unlink_op);
+        events++;
+    }
+    return events;
+}
+
+// blocking stat (and read when it changed) once per flush interval, only ever on the writer thread
+void log_file::check_control()
+{
+    if (m_control_path.empty())
         return;
 
-    DEBUG(2) << "opening " << m_file_name << ENDL;
-    m_io_uring->prep_open_at(m_dir_fd, m_file_name.data(), O_WRONLY | O_CREAT | O_APPEND, 0666, this);
+    struct stat sb;
+    if (::stat(m_control_path.c_str(), &sb) != 0)
+    {
+        m_control_size = -1;
+        return;
+    }
+
+    if (sb.st_size == m_control_size &&
+        sb.st_mtim.tv_sec == m_control_mtime.tv_sec && sb.st_mtim.tv_nsec == m_control_mtime.tv_nsec)
+        return;
+    m_control_size = sb.st_size;
+    m_control_mtime = sb.st_mtim;
+
+    std::ifstream in(m_control_path);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    if (!set_log_levels(contents.str()))
+        WARN << "some of " << m_control_path << " didn't parse, expecting module=level lines" << ENDL;
+    DEBUG(1) << "applied log levels from " << m_control_path << ENDL;
+}
 
-    m_state = OPENING;
+log_file::log_op* log_file::get_op(log_op::kind kind)
+{
+    log_op *op = nullptr;
+    if (m_free_ops.empty())
+    {
+        m_ops.emplace_back(new log_op);
+        op = m_ops.back().get();
+        op->m_owner = this;
+    }
+    else
+    {
+        op = m_free_ops.back();
+        m_free_ops.pop_back();
+    }
+
+    op->m_kind = kind;
+    op->m_fd = -1;
+    op->m_done = 0;
+    op->m_offset = 0;
+    op->m_buffer.clear();
+    return op;
+}
+
+void log_file::put_op(log_op *op)
+{
+    m_free_ops.push_back(op);
 }
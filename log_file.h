@@ -1,15 +1,16 @@
 #pragma once
 
 #include <algorithm>
-#include <mutex>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include "io_uring_wrapper.h"
-
-//class log_file;
-//template<typename T> class io_uring_wrapper;
-//template<> class io_uring_wrapper<log_file>; // try forward declaration
+#include "spsc_ring.h"
 
 /**
   General purpose logger
@@ -17,24 +18,89 @@
   writer thread writes the log entries in batches
      - probably should allow the destination to be a POST url but will start with just a file name
 
-
-  some thoughts floating up about why the opens/writes/closes in this class can't also use io_uring
-     - mixing it with the transaction handling would muck that up more than I like but you could if the event loop was brought out into the app code instead of inside the io_uring_wrapper, then the events could have an enum to say what type of logic are they for (TXN, LOG, ETC) so the data* could be interpretted correctly. Hmm.
-     - could give this class it's own io_uring wrapper then the owner of the log call process periodically.
+  Each logging thread gets its own spsc_ring the first time it logs, log() is a copy into that ring, no locks.
+  When a ring is full the entry is dropped (DROP, the default) or the thread yields until
+  there is room (BLOCK), either way it is counted, see dropped() and blocked().
+  A thread's ring is handed to the next new thread when it exits, so memory is bounded by
+  MAX_PRODUCERS * RING_SIZE.
+
+  set_log_name() opens the file and starts the writer thread, it has its own io_uring and every
+  I/O on it is a log_op:
+     - a timeout every flush interval, everything drained is written at least that often
+     - a read on an eventfd, a producer whose ring passes a quarter full pokes it so the writer drains early,
+       that is one write(2) on the eventfd and never a wait
+     - up to MAX_INFLIGHT writes, each with its own buffer at an explicit file offset (no O_APPEND),
+       so they can complete in any order and a short write is just continued at offset + done
+     - optionally one fdatasync per flush interval, only if something was written since the last one
+  Until set_log_name() is called (or with "stdout") entries go straight to std::cerr.
+
+  Rotation (set_rotation()) is also done on the writer's ring, once the file passes max_bytes or has been
+  open max_secs: renameat the file to <name>.<YYYYmmdd-HHMMSS>, openat a fresh one, close the old fd,
+  then optionally gzip the rotated file in a child process and unlinkat the oldest beyond keep.
+  Producers never see any of it, the writer keeps draining their rings while the switch is in progress
+  and the drained entries go to the new file.
+
+  The writer also polls an optional control file once per flush interval, when its mtime or size changes
+  it is fed to set_log_levels() (log.h), so debug levels can be changed per module without a restart:
+      echo "wrapper=3" > log.ctl
+
+  Deferred format records (log_record.h) share the rings with text entries, marked so the drain
+  renders them on the writer thread instead of copying them.
+
+  O_DIRECT isn't offered, it needs block aligned buffers, offsets and lengths and log writes are
+  neither, padding the tail would put garbage in the file. fdatasync batching gets the durability.
   */
 class log_file
 {
 public:
-    enum state { OPENING, IDLE, WRITING, CLOSING };
-    const char* to_str(state val)
+    enum overflow_policy { DROP, BLOCK };
+
+    static constexpr uint32_t MAX_PRODUCERS = 256;
+    static constexpr size_t RING_SIZE = 64 * 1024;
+    static constexpr uint32_t MAX_INFLIGHT = 4;            // write buffers in flight at once
+    static constexpr size_t BATCH_SIZE = 64 * 1024;        // write before the flush interval once this much is drained
+    static constexpr size_t MAX_WRITE = 1024 * 1024;       // biggest single write
+
+    // one per logging thread, lives until the log_file goes away
+    struct producer
     {
-        switch (val) {
-        case OPENING: return "OPENING";
-        case IDLE: return "IDLE";
-        case WRITING: return "WRITING";
-        case CLOSING: return "CLOSING";
-        };
-    } 
+        spsc_ring ring{RING_SIZE};
+        std::atomic<bool> in_use{true};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> blocked{0};
+    };
+
+    // one I/O on the writer thread's ring
+    struct log_op
+    {
+        enum kind { WRITE, TIMEOUT, WAKE, SYNC, OPEN, CLOSE, RENAME, UNLINK };
+
+        static const char* to_str(kind val)
+        {
+            switch (val) {
+            case WRITE: return "WRITE";
+            case TIMEOUT: return "TIMEOUT";
+            case WAKE: return "WAKE";
+            case SYNC: return "SYNC";
+            case OPEN: return "OPEN";
+            case CLOSE: return "CLOSE";
+            case RENAME: return "RENAME";
+            case UNLINK: return "UNLINK";
+            };
+            return "UNHANDLED";
+        }
+
+        uint32_t process_io_uring(int res) { return m_owner->op_done(*this, res); }
+
+        log_file *m_owner = nullptr;
+        kind m_kind = WRITE;
+        int m_fd = -1;
+        std::string m_buffer;    // WRITE: the data, CLOSE: file to compress once closed, RENAME/UNLINK: the path
+        size_t m_done = 0;
+        uint64_t m_offset = 0;
+        uint64_t m_wake_cnt = 0;
+    };
+
 public:
     log_file();
 
@@ -42,32 +108,121 @@ public:
 
     void set_log_name(std::string_view log_dir, std::string_view file_name);
 
-    void log(std::string_view str, bool lock_it = true);
+    void log(std::string_view str);
 
-    void reopen();
+    // a deferred format record from log_deferred(), rendered by the writer thread
+    void log_record(std::string_view record);
 
-    uint32_t process_io_uring(int res);
+    void reopen();
 
+    // ask the writer to write out whatever it has now rather than at the next flush interval
     void process_events();
 
-private:
+    // these only take effect if called before set_log_name()
+    void set_overflow_policy(overflow_policy policy) { m_policy = policy; }
+    // at least 1 ms, a 0 timeout would expire as soon as it's armed and spin the writer
+    void set_flush_interval(uint32_t ms) { m_flush_ms = std::max<uint32_t>(ms, 1); }
+    void set_sync(bool datasync) { m_sync = datasync; }
+    void set_control_file(std::string_view path) { m_control_path = path; }
+
+    /**
+      Rotate when the file reaches max_bytes or has been open for max_secs (0 turns either off),
+      keep the newest keep rotated files (0 keeps them all), gzip them in the background if compress.
+      */
+    void set_rotation(uint64_t max_bytes, uint32_t max_secs, uint32_t keep, bool compress)
+    {
+        m_rotate_bytes = max_bytes;
+        m_rotate_secs = max_secs;
+        m_rotate_keep = keep;
+        m_rotate_compress = compress;
+    }
+
+    uint64_t rotations() const { return m_rotations.load(std::memory_order_relaxed); }
 
-    void write_buffer(bool lock_it);
+    // entries thrown away because a thread's ring was full (or no ring could be had)
+    uint64_t dropped() const;
+    // times a thread had to wait for room with the BLOCK policy
+    uint64_t blocked() const;
+    uint64_t bytes_written() const { return m_bytes_written.load(std::memory_order_relaxed); }
+    uint64_t short_writes() const { return m_short_writes.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr log_module s_log_module = LOG_FILE;
+
+    void submit(std::string_view str, bool record);
+    producer* get_producer();
+    void wake();
+
+    // writer thread only
+    void writer_main();
+    uint32_t op_done(log_op &op, int res);
+    void pump();
+    void drain(std::string &out, size_t max_bytes);
+    void issue_write(log_op *op);
+    void arm_timeout();
+    void arm_wake();
     void reopen_log();
+    bool rotate_due() const;
+    void rotate_log();
+    bool compress(const std::string &path);
+    void reap_compressors();
+    uint32_t prune_rotated();
+    void check_control();
+    log_op* get_op(log_op::kind kind);
+    void put_op(log_op *op);
 
 private:
-    state m_state = IDLE;
     std::string m_log_dir = ".";
     std::string m_file_name = "out.log";
     int m_dir_fd = -1;
     int m_fd = -1;
-    int m_new_fd = -1;
-    bool m_reopen = true;
-   
-    io_uring_wrapper<log_file> *m_io_uring = nullptr;;
-
-    std::string m_buffers[2];
-    std::string *m_input_buffer = &m_buffers[0];
-    std::string *m_output_buffer = &m_buffers[1];
-    std::mutex m_mutex;
+    int m_wake_fd = -1;
+    std::atomic<bool> m_to_file{false};
+    std::atomic<bool> m_reopen{false};
+    std::atomic<bool> m_flush_now{false};
+    std::atomic<bool> m_wake_pending{false};
+    std::atomic<bool> m_stop{false};
+    overflow_policy m_policy = DROP;
+    uint32_t m_flush_ms = 100;
+    bool m_sync = false;
+    std::string m_control_path;
+    uint64_t m_rotate_bytes = 0;
+    uint32_t m_rotate_secs = 0;
+    uint32_t m_rotate_keep = 0;
+    bool m_rotate_compress = false;
+    std::thread m_writer;
+
+    // owned by the writer thread
+    io_uring_wrapper<log_op> *m_io_uring = nullptr;
+    __kernel_timespec m_flush_ts{};
+    uint64_t m_offset = 0;      // where the next write goes
+    log_op *m_filling = nullptr; // the buffer being drained into
+    uint32_t m_writes_inflight = 0;
+    bool m_tick = false;
+    bool m_opening = false;
+    bool m_syncing = false;
+    bool m_dirty = false;       // written since the last fdatasync
+    uint32_t m_drain_start = 0;
+    timespec m_control_mtime{};
+    off_t m_control_size = -1;
+    time_t m_opened_at = 0;             // for time based rotation
+    bool m_rotate_now = false;          // the last write stopped short of the size limit, rotate before the next
+    std::string m_rotated_name;         // name the current rotation is renaming to, empty when not rotating
+    std::deque<std::string> m_rotated;  // rotated files we made, oldest first, for keep
+    struct compressor
+    {
+        pid_t pid;
+        std::string name; // the .gz it's writing, as it is in m_rotated
+    };
+    std::vector<compressor> m_compressors;
+    std::vector<std::unique_ptr<log_op>> m_ops;
+    std::vector<log_op*> m_free_ops;
+
+    std::atomic<uint64_t> m_bytes_written{0};
+    std::atomic<uint64_t> m_short_writes{0};
+    std::atomic<uint64_t> m_rotations{0};
+
+    std::atomic<producer*> m_producers[MAX_PRODUCERS] = {};
+    std::atomic<uint32_t> m_producer_cnt{0};
+    std::atomic<uint64_t> m_unregistered_drops{0};
 };
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/**
+  Deferred format log records, used by the ERRORF/WARNF/TRACEF/DEBUGF macros in log.h.
+
+  Each call site has a static log_site holding everything that never changes (level, function, file, line,
+  format string), the record a thread logs is just
+      [const log_site*][uint64_t ms][type byte, value]...
+  so the producer's cost is copying a few scalars into a stack buffer and that into its log ring.
+  The log writer thread turns it into the same text line the stream macros produce with render_log_record(),
+  each {} in the format is replaced by the next argument.
+
+  The site pointer is only meaningful inside the process that logged it, records are rendered before they
+  leave the process rather than written raw for an offline decoder.
+
+  Arguments can be integers, floating point, char, bool, pointers and strings (const char*, std::string,
+  std::string_view), strings are copied in and cut at MAX_LOG_STRING bytes.
+  */
+
+struct log_site
+{
+    const char *level;   // " ERROR ", " WARN ", " TRACE " or " DEBUG"
+    int debug_level;     // printed after " DEBUG", -1 for the others
+    const char *func;
+    const char *file;
+    int line;
+    const char *format;
+};
+
+enum log_arg_type : uint8_t { LOG_I64, LOG_U64, LOG_F64, LOG_CHAR, LOG_BOOL, LOG_PTR, LOG_STR };
+
+static constexpr size_t MAX_LOG_RECORD = 512;
+static constexpr size_t MAX_LOG_STRING = 128;
+
+struct log_record_buffer
+{
+    char data[MAX_LOG_RECORD];
+    size_t len = 0;
+
+    // anything that doesn't fit is dropped, the record is still rendered with what made it in
+    bool put(const void *src, size_t sz)
+    {
+        if (len + sz > sizeof(data))
+            return false;
+        ::memcpy(data + len, src, sz);
+        len += sz;
+        return true;
+    }
+
+    template<typename T>
+    bool put_typed(log_arg_type type, T val)
+    {
+        if (len + 1 + sizeof(val) > sizeof(data))
+            return false;
+        data[len++] = type;
+        return put(&val, sizeof(val));
+    }
+
+    bool put_str(std::string_view str)
+    {
+        uint16_t sz = std::min(str.size(), MAX_LOG_STRING);
+        if (len + 1 + sizeof(sz) + sz > sizeof(data))
+            return false;
+        data[len++] = LOG_STR;
+        put(&sz, sizeof(sz));
+        return put(str.data(), sz);
+    }
+};
+
+template<typename T>
+inline void encode_log_arg(log_record_buffer &buf, const T &val)
+{
+    using TYPE = std::decay_t<T>;
+    if constexpr (std::is_same_v<TYPE, bool>)
+        buf.put_typed(LOG_BOOL, static_cast<uint8_t>(val));
+    else if constexpr (std::is_same_v<TYPE, char>)
+        buf.put_typed(LOG_CHAR, val);
+    else if constexpr (std::is_enum_v<TYPE>)
+        buf.put_typed(LOG_I64, static_cast<int64_t>(val));
+    else if constexpr (std::is_integral_v<TYPE> && std::is_signed_v<TYPE>)
+        buf.put_typed(LOG_I64, static_cast<int64_t>(val));
+    else if constexpr (std::is_integral_v<TYPE>)
+        buf.put_typed(LOG_U64, static_cast<uint64_t>(val));
+    else if constexpr (std::is_floating_point_v<TYPE>)
+        buf.put_typed(LOG_F64, static_cast<double>(val));
+    else if constexpr (std::is_convertible_v<TYPE, std::string_view>)
+    {
+        if constexpr (std::is_pointer_v<TYPE>)
+            buf.put_str(val ? std::string_view(val) : std::string_view());
+        else
+            buf.put_str(std::string_view(val));
+    }
+    else if constexpr (std::is_pointer_v<TYPE>)
+        buf.put_typed(LOG_PTR, reinterpret_cast<uintptr_t>(val));
+    else
+        static_assert(std::is_pointer_v<TYPE>, "DEBUGF and friends take scalars, pointers and strings");
+}
+
+template<typename... ARGS>
+inline void encode_log_record(log_record_buffer &buf, const log_site *site, uint64_t ms, const ARGS&... args)
+{
+    buf.put(&site, sizeof(site));
+    buf.put(&ms, sizeof(ms));
+    (encode_log_arg(buf, args), ...);
+}
+
+// record -> text line, the same shape as the stream macros produce
+inline void render_log_record(std::string_view record, std::string &out)
+{
+    const log_site *site = nullptr;
+    uint64_t ms = 0;
+    if (record.size() < sizeof(site) + sizeof(ms))
+        return;
+
+    const char *pos = record.data();
+    const char *end = pos + record.size();
+    ::memcpy(&site, pos, sizeof(site));
+    pos += sizeof(site);
+    ::memcpy(&ms, pos, sizeof(ms));
+    pos += sizeof(ms);
+
+    char num[32];
+    auto append_num = [&](auto val) {
+        auto res = std::to_chars(num, num + sizeof(num), val);
+        out.append(num, res.ptr - num);
+    };
+
+    append_num(ms);
+    out.append(site->level);
+    if (site->debug_level >= 0)
+    {
+        append_num(site->debug_level);
+        out.push_back(' ');
+    }
+    out.append(site->func);
+    out.push_back(' ');
+    out.append(site->file);
+    out.push_back(':');
+    append_num(site->line);
+    out.push_back(' ');
+
+    std::string_view format(site->format);
+    while (!format.empty())
+    {
+        size_t brace = format.find("{}");
+        out.append(format.substr(0, brace));
+        if (brace == std::string_view::npos)
+            break;
+        format.remove_prefix(brace + 2);
+
+        if (pos >= end)
+        {
+            out.append("{}"); // ran out of arguments, most likely the record was cut short
+            continue;
+        }
+
+        log_arg_type type = static_cast<log_arg_type>(*pos++);
+        switch (type) {
+        case LOG_I64: { int64_t val; ::memcpy(&val, pos, sizeof(val)); pos += sizeof(val); append_num(val); break; }
+        case LOG_U64: { uint64_t val; ::memcpy(&val, pos, sizeof(val)); pos += sizeof(val); append_num(val); break; }
+        case LOG_F64: { double val; ::memcpy(&val, pos, sizeof(val)); pos += sizeof(val); append_num(val); break; }
+        case LOG_CHAR: out.push_back(*pos++); break;
+        case LOG_BOOL: out.push_back(*pos++ ? '1' : '0'); break;
+        case LOG_PTR:
+        {
+            uintptr_t val;
+            ::memcpy(&val, pos, sizeof(val));
+            pos += sizeof(val);
+            out.append("0x");
+            auto res = std::to_chars(num, num + sizeof(num), val, 16);
+            out.append(num, res.ptr - num);
+            break;
+        }
+        case LOG_STR:
+        {
+            uint16_t sz;
+            ::memcpy(&sz, pos, sizeof(sz));
+            pos += sizeof(sz);
+            out.append(pos, sz);
+            pos += sz;
+            break;
+        }
+        default:
+            pos = end; // garbage, stop decoding
+            break;
+        };
+    }
+
+    out.push_back('\n');
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <charconv>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "get_nanoseconds.h"
+#include "hdr_histogram.h"
+#include "io_uring_stats.h"
+#include "log.h"
+
+/**
+  Live metrics in the Prometheus text format, sampled while the process runs.
+
+  Sources are callbacks that append their metrics to a string, each owns its metric names and writes the
+  # TYPE line once followed by every labelled sample, see the metric_*() helpers below.
+  They are called on the exporter's thread, so they can only read things that are safe to read from
+  another thread: atomics, hdr_histograms (io_uring_stats, time_tracker::snapshot()), the log counters.
+
+  start() runs one thread that
+     - rewrites file_path every interval_ms: written to file_path.tmp and renamed over it, a reader
+       (node_exporter's textfile collector, watch cat) never sees half a file
+     - answers connections on the unix socket socket_path with a fresh dump then closes them:
+           socat - UNIX-CONNECT:/tmp/copy.metrics
+  Either path can be empty. stop() writes the file one last time so it ends with the final numbers.
+  */
+
+inline void metric_header(std::string &out, std::string_view name, std::string_view type, std::string_view help)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+// labels is the inside of the braces: worker="1",op="READ", or empty
+inline void metric_value(std::string &out, std::string_view name, std::string_view labels, uint64_t val)
+{
+    out.append(name);
+    if (!labels.empty())
+        out.append("{").append(labels).append("}");
+    out.push_back(' ');
+    char num[32];
+    auto res = std::to_chars(num, num + sizeof(num), val);
+    out.append(num, res.ptr - num).append("\n");
+}
+
+// a summary: quantiles 0.5 to 0.999 plus the max as quantile 1, then _sum and _count
+inline void metric_summary(std::string &out, std::string_view name, std::string_view labels, const hdr_histogram &hist)
+{
+    static constexpr std::pair<const char*, double> QUANTILES[] = {
+        {"0.5", 50}, {"0.9", 90}, {"0.99", 99}, {"0.999", 99.9}, {"1", 100},
+    };
+
+    std::string with_quantile;
+    for (auto &[quantile, pct] : QUANTILES)
+    {
+        with_quantile.assign(labels);
+        if (!labels.empty())
+            with_quantile.push_back(',');
+        with_quantile.append("quantile=\"").append(quantile).append("\"");
+        metric_value(out, name, with_quantile, pct < 100 ? hist.value_at_percentile(pct) : hist.max());
+    }
+    metric_value(out, std::string(name) + "_sum", labels, hist.sum());
+    metric_value(out, std::string(name) + "_count", labels, hist.total());
+}
+
+// the log writer's counters, log_*
+inline void append_log_metrics(std::string &out)
+{
+    log_counters counters = get_error_log_counters();
+    metric_header(out, "log_dropped_total", "counter", "log entries thrown away because a thread's ring was full");
+    metric_value(out, "log_dropped_total", "", counters.dropped);
+    metric_header(out, "log_blocked_total", "counter", "times a logging thread waited for room in its ring");
+    metric_value(out, "log_blocked_total", "", counters.blocked);
+    metric_header(out, "log_bytes_written_total", "counter", "bytes written to the log file");
+    metric_value(out, "log_bytes_written_total", "", counters.bytes_written);
+    metric_header(out, "log_rotations_total", "counter", "log file rotations");
+    metric_value(out, "log_rotations_total", "", counters.rotations);
+}
+
+/**
+  io_uring_stats for a set of rings, io_*. Each ring is (labels, stats), labels like worker="0",
+  samples are grouped by metric name across the rings as the text format wants.
+  */
+inline void append_io_uring_metrics(std::string &out, const std::vector<std::pair<std::string, const io_uring_stats*>> &rings)
+{
+    auto counter = [&](std::string_view name, std::string_view help, auto get) {
+        metric_header(out, name, "counter", help);
+        for (auto &[labels, stats] : rings)
+            metric_value(out, name, labels, get(*stats));
+    };
+    auto summary = [&](std::string_view name, std::string_view help, auto get) {
+        metric_header(out, name, "summary", help);
+        for (auto &[labels, stats] : rings)
+            metric_summary(out, name, labels, get(*stats));
+    };
+
+    metric_header(out, "io_in_flight", "gauge", "ops submitted and not yet reaped");
+    for (auto &[labels, stats] : rings)
+        metric_value(out, "io_in_flight", labels, stats->in_flight.load(std::memory_order_relaxed));
+
+    counter("io_submits_total", "io_uring_submit calls with something to submit",
+            [](const io_uring_stats &st) { return st.submits.load(std::memory_order_relaxed); });
+    counter("io_sq_full_total", "get_sqe found the SQ full",
+            [](const io_uring_stats &st) { return st.sq_full.load(std::memory_order_relaxed); });
+    summary("io_sq_wait_ns", "prep to submit",
+            [](const io_uring_stats &st) -> const hdr_histogram& { return st.sq_wait; });
+    summary("io_service_ns", "submit to reap",
+            [](const io_uring_stats &st) -> const hdr_histogram& { return st.service; });
+    summary("io_cq_batch", "CQEs reaped per batch",
+            [](const io_uring_stats &st) -> const hdr_histogram& { return st.cq_batch; });
+
+    metric_header(out, "io_op_latency_ns", "summary", "prep to reap by opcode");
+    std::string labels_op;
+    for (auto &[labels, stats] : rings)
+    {
+        for (uint32_t op = 0; op < io_uring_stats::OP_CNT; op++)
+        {
+            hdr_histogram *hist = stats->op_latency[op].load(std::memory_order_acquire);
+            if (!hist)
+                continue;
+            labels_op.assign(labels);
+            if (!labels.empty())
+                labels_op.push_back(',');
+            labels_op.append("op=\"").append(io_uring_stats::to_str(op)).append("\"");
+            metric_summary(out, "io_op_latency_ns", labels_op, *hist);
+        }
+    }
+}
+
+class metrics_exporter
+{
+public:
+    using source = std::function<void(std::string &out)>;
+
+    metrics_exporter() = default;
+
+    metrics_exporter(const metrics_exporter&) = delete;
+    metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+    ~metrics_exporter()
+    {
+        stop();
+    }
+
+    // before start()
+    void add_source(source fn) { m_sources.push_back(std::move(fn)); }
+
+    bool start(std::string_view file_path, std::string_view socket_path, uint32_t interval_ms)
+    {
+        m_file_path = file_path;
+        m_socket_path = socket_path;
+        m_interval_ms = interval_ms ? interval_ms : 1000;
+
+        if (!m_socket_path.empty() && !listen_on(m_socket_path))
+            return false;
+
+        m_stop_fd = ::eventfd(0, EFD_CLOEXEC);
+        if (m_stop_fd < 0)
+        {
+            ERROR << "eventfd: " << ::strerror(errno) << ENDL;
+            return false;
+        }
+
+        m_thread = std::thread(&metrics_exporter::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (!m_thread.joinable())
+            return;
+
+        m_stop.store(true, std::memory_order_relaxed);
+        ::eventfd_write(m_stop_fd, 1);
+        m_thread.join();
+
+        if (!m_file_path.empty())
+            write_file(render());
+
+        if (m_listen_fd >= 0)
+        {
+            ::close(m_listen_fd);
+            ::unlink(m_socket_path.c_str());
+            m_listen_fd = -1;
+        }
+        ::close(m_stop_fd);
+        m_stop_fd = -1;
+    }
+
+    std::string render() const
+    {
+        std::string out;
+        for (auto &src : m_sources)
+            src(out);
+        return out;
+    }
+
+private:
+    bool listen_on(const std::string &path)
+    {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            ERROR << "metrics socket path too long: " << path << ENDL;
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        ::memcpy(addr.sun_path, path.data(), path.size());
+
+        m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_listen_fd < 0)
+        {
+            ERROR << "socket: " << ::strerror(errno) << ENDL;
+            return false;
+        }
+
+        // left over from a previous run
+        ::unlink(path.c_str());
+        if (::bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || ::listen(m_listen_fd, 8))
+        {
+            ERROR << "metrics socket " << path << ": " << ::strerror(errno) << ENDL;
+            ::close(m_listen_fd);
+            m_listen_fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void run()
+    {
+        uint64_t next_write = 0;
+        while (!m_stop.load(std::memory_order_relaxed))
+        {
+            uint64_t now = get_nanoseconds();
+            if (!m_file_path.empty() && now >= next_write)
+            {
+                write_file(render());
+                next_write = now + m_interval_ms * 1000000ULL;
+            }
+
+            pollfd fds[2] = {{m_stop_fd, POLLIN, 0}, {m_listen_fd, POLLIN, 0}};
+            int timeout = m_file_path.empty() ? -1 : static_cast<int>((next_write - now) / 1000000 + 1);
+            int ret = ::poll(fds, m_listen_fd >= 0 ? 2 : 1, timeout);
+            if (ret < 0 && errno != EINTR)
+            {
+                ERROR << "poll: " << ::strerror(errno) << ENDL;
+                return;
+            }
+            if (ret > 0 && (fds[1].revents & POLLIN))
+                answer();
+        }
+    }
+
+    // one dump per connection, a scraper that stops reading for a second is cut off
+    void answer()
+    {
+        int fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        timeval tv{1, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        std::string text = render();
+        write_all(fd, text);
+        ::close(fd);
+    }
+
+    bool write_file(const std::string &text)
+    {
+        std::string tmp = m_file_path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            ERROR << "open " << tmp << ": " << ::strerror(errno) << ENDL;
+            return false;
+        }
+        bool ok = write_all(fd, text);
+        ::close(fd);
+        if (ok && ::rename(tmp.c_str(), m_file_path.c_str()))
+        {
+            ERROR << "rename " << tmp << ": " << ::strerror(errno) << ENDL;
+            ok = false;
+        }
+        return ok;
+    }
+
+    static bool write_all(int fd, std::string_view text)
+    {
+        while (!text.empty())
+        {
+            ssize_t ret = ::write(fd, text.data(), text.size());
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            text.remove_prefix(ret);
+        }
+        return true;
+    }
+
+private:
+    std::vector<source> m_sources;
+    std::string m_file_path;
+    std::string m_socket_path;
+    uint32_t m_interval_ms = 1000;
+    int m_listen_fd = -1;
+    int m_stop_fd = -1;
+    std::atomic<bool> m_stop{false};
+    std::thread m_thread;
+};
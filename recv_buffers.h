@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "buffer_ring.h"
+#include "log.h"
+
+/**
+  Receive buffers for multishot recvs, in a few size classes, a provided buffer ring (buffer_ring.h) each.
+  A connection trickling small requests holds small buffers, one streaming a body holds big ones, the memory
+  a connection ties up follows what it's actually receiving rather than the worst case.
+
+  Classes are added smallest first, class i is buffer group first_group + i. fit() moves a connection between
+  classes from the running average of its recv sizes, with some slack so it doesn't flap at a boundary.
+
+  -ENOBUFS is handled here too: a connection whose recv ran dry calls wait(), which hands it
+  buffers_available() right away if any class has room, or once a recycle() makes some. The consumer then
+  re-arms on pick(), its own class if it has room or whichever has the most.
+
+  CONSUMER needs void buffers_available(). Not thread safe, one per ring.
+  */
+template<class CONSUMER>
+class recv_buffers
+{
+public:
+    recv_buffers() = default;
+
+    recv_buffers(const recv_buffers&) = delete;
+    recv_buffers& operator=(const recv_buffers&) = delete;
+
+    // before setup(), buffer sizes going up
+    void add_class(uint32_t cnt, size_t buf_size, buffer_arena::page_kind pages = buffer_arena::NORMAL, int node = -1)
+    {
+        m_classes.push_back(std::make_unique<buffer_ring>(cnt, buf_size, pages, node));
+    }
+
+    // the ring has to outlive us
+    template<class RING>
+    bool setup(RING &ring, uint16_t first_group)
+    {
+        for (uint32_t cls = 0; cls < m_classes.size(); cls++)
+        {
+            if (!m_classes[cls]->setup(ring, first_group + cls))
+                return false;
+        }
+        return !m_classes.empty();
+    }
+
+    uint32_t classes() const { return m_classes.size(); }
+    buffer_ring& get(uint32_t cls) { return *m_classes[cls]; }
+    char* buffer(uint32_t cls, uint16_t bid) { return m_classes[cls]->buffer(bid); }
+
+    // the class a connection on cls whose recvs average avg bytes belongs in
+    uint32_t fit(uint32_t cls, size_t avg) const
+    {
+        // up as soon as the average doesn't fit a buffer, down only once it would fit a quarter of a smaller one
+        if (cls + 1 < m_classes.size() && avg > m_classes[cls]->buf_size())
+            return cls + 1;
+        if (cls > 0 && avg * 4 <= m_classes[cls - 1]->buf_size())
+            return cls - 1;
+        return cls;
+    }
+
+    // the smallest class whose buffers hold bytes, the biggest if none does
+    uint32_t fit(size_t bytes) const
+    {
+        uint32_t cls = 0;
+        while (cls + 1 < m_classes.size() && bytes > m_classes[cls]->buf_size())
+            cls++;
+        return cls;
+    }
+
+    // where to arm a recv that wants cls, -1 when every class is about out
+    int pick(uint32_t cls) const
+    {
+        if (has_room(cls))
+            return cls;
+        int best = -1;
+        for (uint32_t other = 0; other < m_classes.size(); other++)
+        {
+            if (has_room(other) && (best < 0 || m_classes[other]->available() > m_classes[best]->available()))
+                best = other;
+        }
+        return best;
+    }
+
+    // a recv CQE on cls with res > 0, f(bid, len) for each buffer it filled
+    template<class F>
+    void received(uint32_t cls, int res, uint32_t flags, F f)
+    {
+        m_classes[cls]->for_each(buffer_ring::buffer_id(flags), res, f);
+    }
+
+    void recycle(uint32_t cls, uint16_t bid)
+    {
+        m_classes[cls]->recycle(bid);
+        // re-arm parked connections once there's a little room, not on every single buffer
+        while (!m_waiters.empty() && has_room(cls))
+        {
+            CONSUMER *consumer = m_waiters.front();
+            m_waiters.pop_front();
+            consumer->buffers_available();
+        }
+    }
+
+    // consumer's recv ended with -ENOBUFS
+    void wait(CONSUMER *consumer)
+    {
+        // buffers may have come back between the kernel running dry and us seeing it
+        if (pick(0) >= 0)
+            consumer->buffers_available();
+        else
+            m_waiters.push_back(consumer);
+    }
+
+    void forget(CONSUMER *consumer) { std::erase(m_waiters, consumer); }
+
+private:
+    bool has_room(uint32_t cls) const { return m_classes[cls]->available() * 16 >= m_classes[cls]->cnt(); }
+
+    std::vector<std::unique_ptr<buffer_ring>> m_classes;
+    std::deque<CONSUMER*> m_waiters;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <string_view>
+
+/**
+ A fixed length meta data written before each file
+ Between the fixed length data and the file data we write variable
+ length vals like file name and description
+  */
+struct file_meta_data
+{
+public:
+    uint64_t file_size = 0;
+    uint64_t file_hash = 0;
+    time_t   write_time = 0;
+    uint16_t file_name_len = 0;
+    uint16_t file_desc_len = 0;
+    // some room built into the fixed length buffer for future uses like tags
+    uint16_t future_1_len = 0;
+    uint16_t future_2_len = 0;
+    uint16_t future_3_len = 0;
+    uint16_t future_4_len = 0;
+};
+
+/**
+  A spool record is the meta data, the name, the description then the file itself, nothing between them.
+  copy_file_simple lays records out at fixed strides, http_server appends them one after another.
+  http_server writes the header as an upload starts, file_hash 0, and the hash once the body is down, a record
+  whose data doesn't hash to file_hash is an upload that never finished.
+  */
+inline uint64_t spool_header_size(std::string_view name, std::string_view desc)
+{
+    return sizeof(file_meta_data) + name.size() + desc.size();
+}
+
+// the meta data, name and description as one buffer, written in one go
+inline void spool_header(std::string &out, const file_meta_data &meta, std::string_view name, std::string_view desc)
+{
+    out.assign(reinterpret_cast<const char*>(&meta), sizeof(meta));
+    out.append(name);
+    out.append(desc);
+}
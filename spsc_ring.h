@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+  Single producer / single consumer ring of variable length records.
+
+  Each record is a uint32_t length followed by the bytes, a record can wrap around the end of the buffer.
+  Head and tail only ever grow, the index into the buffer is (pos & mask).
+  The producer keeps a cached copy of the consumer's head and the consumer a cached copy of the tail,
+  so the shared cache lines are only touched when the cached values say the ring is full/empty.
+
+  No locks, no allocation after construction, a full ring just fails the write
+  and the caller decides whether to drop or wait.
+
+  A record can be marked (the top bit of its length), drain() hands marked records to a render
+  function instead of copying them, that is how the logger keeps binary records next to text ones.
+  */
+class spsc_ring
+{
+public:
+    spsc_ring(size_t capacity = 64 * 1024)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_buffer.reset(new char[m_capacity]);
+    }
+
+    static constexpr uint32_t MARK_BIT = 1U << 31;
+
+    // producer only
+    bool try_write(std::string_view record, bool marked = false)
+    {
+        uint32_t len = record.size();
+        size_t need = sizeof(len) + len;
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (need > m_capacity || (len & MARK_BIT))
+            return false;
+
+        if (tail + need - m_cached_head > m_capacity)
+        {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if (tail + need - m_cached_head > m_capacity)
+                return false;
+        }
+
+        uint32_t header = marked ? (len | MARK_BIT) : len;
+        copy_in(tail, reinterpret_cast<const char*>(&header), sizeof(header));
+        copy_in(tail + sizeof(len), record.data(), len);
+        m_tail.store(tail + need, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only, appends every complete record to out, returns the number of records
+    uint32_t drain(std::string &out, size_t max_bytes = SIZE_MAX)
+    {
+        return drain(out, max_bytes, [](std::string_view record, std::string &out) { out.append(record); });
+    }
+
+    // same but marked records go through render(std::string_view record, std::string &out)
+    template<class RENDER>
+    uint32_t drain(std::string &out, size_t max_bytes, RENDER &&render)
+    {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        uint32_t cnt = 0;
+
+        while (out.size() < max_bytes)
+        {
+            if (head == m_cached_tail)
+            {
+                m_cached_tail = m_tail.load(std::memory_order_acquire);
+                if (head == m_cached_tail)
+                    break;
+            }
+
+            uint32_t header = 0;
+            copy_out(head, reinterpret_cast<char*>(&header), sizeof(header));
+            uint32_t len = header & ~MARK_BIT;
+            if (header & MARK_BIT)
+            {
+                // render wants it in one piece, it may wrap in the ring
+                size_t idx = (head + sizeof(header)) & m_mask;
+                if (idx + len <= m_capacity)
+                {
+                    render(std::string_view(m_buffer.get() + idx, len), out);
+                }
+                else
+                {
+                    m_scratch.resize(len);
+                    copy_out(head + sizeof(header), m_scratch.data(), len);
+                    render(std::string_view(m_scratch.data(), len), out);
+                }
+            }
+            else
+            {
+                size_t at = out.size();
+                out.resize(at + len);
+                copy_out(head + sizeof(header), out.data() + at, len);
+            }
+            head += sizeof(header) + len;
+            cnt++;
+        }
+
+        m_head.store(head, std::memory_order_release);
+        return cnt;
+    }
+
+    // approximate from the producer side
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t used() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    void copy_in(uint64_t pos, const char *src, size_t len)
+    {
+        size_t idx = pos & m_mask;
+        size_t first = std::min(len, m_capacity - idx);
+        ::memcpy(m_buffer.get() + idx, src, first);
+        ::memcpy(m_buffer.get(), src + first, len - first);
+    }
+
+    void copy_out(uint64_t pos, char *dst, size_t len) const
+    {
+        size_t idx = pos & m_mask;
+        size_t first = std::min(len, m_capacity - idx);
+        ::memcpy(dst, m_buffer.get() + idx, first);
+        ::memcpy(dst + first, m_buffer.get(), len - first);
+    }
+
+private:
+    // producer side
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+    uint64_t m_cached_head = 0;
+
+    // consumer side
+    alignas(64) std::atomic<uint64_t> m_head{0};
+    uint64_t m_cached_tail = 0;
+    std::string m_scratch;
+
+    alignas(64) size_t m_capacity = 0;
+    size_t m_mask = 0;
+    std::unique_ptr<char[]> m_buffer;
+};
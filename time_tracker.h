@@ -2,20 +2,23 @@
 
 
 #include "get_nanoseconds.h"
+#include "hdr_histogram.h"
 #include "log.h"
-#include "scoped_lock.h"
 
-#include <mutex>
+#include <charconv>
 #include <string_view>
-#include <vector>
 
+/**
+  Collects per request latencies and traces throughput and percentiles at the end.
+  add_delta() goes into the calling thread's shard of an hdr_histogram, no lock and no allocation,
+  memory stays the same however many requests there are. The shards are merged when reporting.
+  */
 class time_tracker
 {
 public:
-    time_tracker(size_t reserve_size = 10000)
+    time_tracker()
     {
         m_start = get_nanoseconds();
-        m_times.reserve(reserve_size);
     }
 
     ~time_tracker()
@@ -24,50 +27,66 @@ public:
 
     void add_delta(uint64_t delta)
     {
-        dsy::scoped_lock alock(&m_mutex, true);
-        m_times.push_back(delta);
+        m_times.record(delta);
     }
 
-    void trace_total_ns_percentile(uint32_t pct, uint64_t bytes, std::string_view unit)
+    // merged copy of everything recorded so far
+    hdr_histogram snapshot() const { return m_times.snapshot(); }
+
+    void trace_total_ns_percentile(const hdr_histogram &times, double pct, uint64_t bytes, std::string_view unit)
     {
-        size_t pN = m_times.size() * pct / 100;
-        uint64_t val = m_times[pN];
-        // sz      NN
-        // ---  = ---
-        // val    1000000000
-        double secs = 1000000000 / val;
-        uint64_t bytes_per_sec = bytes * 1000000000 / val;
-        uint64_t mb_per_sec = bytes_per_sec / 1024 / 1024;
-        TRACE << "p" << pct
-              << ", " << unit << ": " << commas(val)
-              << ", MB/s: " << commas(mb_per_sec)
-              << ENDL;
+        // shortest form, p5 and p99.9 rather than the stream's fixed p5.000000
+        char label[32] = "p";
+        auto res = std::to_chars(label + 1, label + sizeof(label), pct);
+        trace_total_ns_value(times.value_at_percentile(pct), bytes, unit, std::string_view(label, res.ptr - label));
     }
 
     void trace_total_ns(uint64_t bytes, std::string_view unit)
     {
         m_end = get_nanoseconds();
         uint64_t ns = m_end - m_start;
-        uint64_t bytes_copied = bytes * m_times.size();
-        uint64_t bytes_per_sec = bytes_copied * 1000000000 / ns;
-        uint64_t mb_per_sec = bytes_per_sec / 1024 / 1024;
+        hdr_histogram times = snapshot();
+        uint64_t bytes_copied = bytes * times.total();
+        uint64_t bytes_per_sec = ns ? bytes_copied * 1000000000 / ns : 0;
 
-        std::sort(m_times.begin(), m_times.end());
-        TRACE << "Total Requests: " << m_times.size()
+        TRACE << "Total Requests: " << times.total()
               << ", total bytes: " << commas(bytes_copied)
               << ", bytes each: " << bytes
-              << ", MB/s: " << commas(mb_per_sec) << ENDL;
+              << ", MB/s: " << commas(bytes_per_sec / 1024 / 1024) << ENDL;
+        if (!times.total())
+            return;
 
-        trace_total_ns_percentile(5, bytes, unit);
-        trace_total_ns_percentile(50, bytes, unit);
-        trace_total_ns_percentile(95, bytes, unit);
+        trace_total_ns_value(times.min(), bytes, unit, "min");
+        trace_total_ns_percentile(times, 5, bytes, unit);
+        trace_total_ns_percentile(times, 50, bytes, unit);
+        trace_total_ns_percentile(times, 95, bytes, unit);
+        trace_total_ns_percentile(times, 99, bytes, unit);
+        trace_total_ns_percentile(times, 99.9, bytes, unit);
+        trace_total_ns_value(times.max(), bytes, unit, "max");
+        trace_total_ns_value(times.mean(), bytes, unit, "mean");
     }
 
 
 private:
 
-    std::vector<uint64_t> m_times;
-    std::mutex m_mutex;
+    static uint64_t mb_per_sec(uint64_t val, uint64_t bytes)
+    {
+        // sz      NN
+        // ---  = ---
+        // val    1000000000
+        uint64_t bytes_per_sec = val ? bytes * 1000000000 / val : 0;
+        return bytes_per_sec / 1024 / 1024;
+    }
+
+    void trace_total_ns_value(uint64_t val, uint64_t bytes, std::string_view unit, std::string_view label)
+    {
+        TRACE << label
+              << ", " << unit << ": " << commas(val)
+              << ", MB/s: " << commas(mb_per_sec(val, bytes))
+              << ENDL;
+    }
+
+    sharded_histogram m_times;
     uint64_t m_start = 0;
     uint64_t m_end = 0;
 };
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <errno.h>
+#include <liburing.h>
+#include <stdint.h>
+
+#include "get_nanoseconds.h"
+#include "log.h"
+
+/**
+  Deadlines by the hundred thousand without a kernel timeout each: a hierarchical timer wheel
+  (Varghese & Lauck, the scheme the Linux kernel used for years) advanced by one recurring ring timeout.
+
+  Timers are intrusive, embedded in whatever has the deadline (a connection), so arm(), re-arm and cancel()
+  are a list unlink and link, no allocation, no search. That is cheap enough to push an idle deadline back
+  on every recv. Resolution is one tick: a timer fires on the first tick at or after its deadline.
+
+  Level 0 has a slot per tick for the next 256 ticks, each level above has 64 slots each covering all of
+  the level below. Timers further out sit in a coarse slot and are cascaded down a level whenever the level
+  below wraps, ending up in their exact level 0 slot. Deadlines past 2^32 ticks are clamped.
+
+  An expired timer's event gets process_io_uring(-ETIME, 0), the same call a CQE makes, so a
+  connection handles its idle timeout next to its other completions.
+
+  The tick is a multishot IORING_OP_TIMEOUT (6.4 and up), every tick_ns a CQE that is routed back here
+  through on_tick(). Older kernels say -EINVAL, the wheel then re-arms a one shot timeout every tick.
+  Not thread safe, one per ring.
+  */
+template<class EVENT_CLASS>
+class timer_wheel
+{
+    struct link
+    {
+        link *prev = nullptr;
+        link *next = nullptr;
+    };
+
+public:
+    class timer : private link
+    {
+    public:
+        explicit timer(EVENT_CLASS *event = nullptr) : m_event(event) {}
+        // never left behind in a slot
+        ~timer() { unlink(); }
+
+        timer(const timer&) = delete;
+        timer& operator=(const timer&) = delete;
+
+        void set_event(EVENT_CLASS *event) { m_event = event; }
+        bool armed() const { return this->next != nullptr; }
+
+    private:
+        friend class timer_wheel;
+
+        void unlink()
+        {
+            if (!this->next)
+                return;
+            this->prev->next = this->next;
+            this->next->prev = this->prev;
+            this->prev = this->next = nullptr;
+        }
+
+        EVENT_CLASS *m_event = nullptr;
+        uint64_t m_expires = 0; // in ticks
+    };
+
+    template<class RING>
+    timer_wheel(RING &ring, EVENT_CLASS *tick_event, uint64_t tick_ns)
+        : m_tick_ns(tick_ns ? tick_ns : 1),
+          m_tick_event(tick_event)
+    {
+        m_ring = &ring;
+        m_prep = [](void *ring, __kernel_timespec *ts, bool multishot, EVENT_CLASS *data) {
+            return multishot ? static_cast<RING*>(ring)->prep_timeout_multishot(ts, data)
+                             : static_cast<RING*>(ring)->prep_timeout(ts, 0, data);
+        };
+        m_ts.tv_sec = m_tick_ns / 1000000000;
+        m_ts.tv_nsec = m_tick_ns % 1000000000;
+        for (auto &level : m_slots)
+        {
+            for (link &slot : level)
+                slot.prev = slot.next = &slot;
+        }
+    }
+
+    ~timer_wheel()
+    {
+        // whatever still points into our slots must not unlink from them later
+        for (auto &level : m_slots)
+        {
+            for (link &slot : level)
+            {
+                while (slot.next != &slot)
+                    static_cast<timer*>(slot.next)->unlink();
+            }
+        }
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    // preps the tick, the caller submits
+    bool start()
+    {
+        m_start_ns = get_nanoseconds();
+        m_now = 0;
+        return arm_tick();
+    }
+
+    uint64_t tick_ns() const { return m_tick_ns; }
+
+    // fire delay_ns from now, an armed timer is moved
+    void arm(timer &t, uint64_t delay_ns)
+    {
+        t.unlink();
+        // rounded up, never early
+        t.m_expires = m_now + (delay_ns + m_tick_ns - 1) / m_tick_ns;
+        add(t);
+    }
+
+    void cancel(timer &t) { t.unlink(); }
+
+    /**
+      The tick's CQE, routed here by the tick event's process_io_uring. Catches up to the clock rather than
+      counting CQEs, a late or merged tick still fires everything that's due.
+      Returns the events the expiries prepped, for the ring to decide whether to submit.
+      */
+    uint32_t on_tick(int res, uint32_t flags)
+    {
+        uint32_t events = 0;
+        if (res == -EINVAL && m_multishot)
+        {
+            DEBUG(1) << "no multishot timeouts, re-arming the wheel's tick every time" << ENDL;
+            m_multishot = false;
+            return arm_tick();
+        }
+        if (res != -ETIME && res != 0)
+            WARN << "timer wheel tick: " << ::strerror(-res) << ENDL;
+
+        uint64_t now = (get_nanoseconds() - m_start_ns) / m_tick_ns;
+        while (m_now < now)
+            events += step();
+
+        // a multishot timeout keeps going as long as it says F_MORE
+        if (!m_multishot || !(flags & IORING_CQE_F_MORE))
+            events += arm_tick();
+        return events;
+    }
+
+private:
+    static constexpr log_module s_log_module = LOG_GENERAL;
+
+    static constexpr uint32_t L0_BITS = 8;
+    static constexpr uint32_t LN_BITS = 6;
+    static constexpr uint32_t LEVELS = 5;
+    static constexpr uint64_t MAX_TICKS = 0xffffffffull;
+
+    // level 0 has 256 slots, the rest 64 each, only the first 64 of their slots are used
+    static uint32_t shift(uint32_t level) { return level ? L0_BITS + (level - 1) * LN_BITS : 0; }
+    static uint32_t slot_mask(uint32_t level) { return level ? (1u << LN_BITS) - 1 : (1u << L0_BITS) - 1; }
+
+    bool arm_tick()
+    {
+        return m_prep(m_ring, &m_ts, m_multishot, m_tick_event);
+    }
+
+    void add(timer &t)
+    {
+        if (t.m_expires < m_now)
+            t.m_expires = m_now;
+        uint64_t delta = t.m_expires - m_now;
+        if (delta > MAX_TICKS)
+        {
+            t.m_expires = m_now + MAX_TICKS;
+            delta = MAX_TICKS;
+        }
+
+        uint32_t level = 0;
+        while (level + 1 < LEVELS && delta >= (1ull << shift(level + 1)))
+            level++;
+        link &slot = m_slots[level][(t.m_expires >> shift(level)) & slot_mask(level)];
+
+        t.prev = slot.prev;
+        t.next = &slot;
+        slot.prev->next = &t;
+        slot.prev = &t;
+    }
+
+    // everything in a level's slot goes one level down (or further, add() decides), back to where it belongs
+    void cascade(uint32_t level)
+    {
+        link &slot = m_slots[level][(m_now >> shift(level)) & slot_mask(level)];
+        while (slot.next != &slot)
+        {
+            timer *t = static_cast<timer*>(slot.next);
+            t->unlink();
+            add(*t);
+        }
+    }
+
+    uint32_t step()
+    {
+        // when level 0 wraps the next slot of level 1 is due to be spread over it, and so on up
+        for (uint32_t level = 1; level < LEVELS; level++)
+        {
+            if (m_now & ((1ull << shift(level)) - 1))
+                break;
+            cascade(level);
+        }
+
+        // take the slot's list first, handlers re-arm and cancel as they please
+        link &slot = m_slots[0][m_now & slot_mask(0)];
+        link due;
+        if (slot.next != &slot)
+        {
+            due.next = slot.next;
+            due.prev = slot.prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            slot.prev = slot.next = &slot;
+        }
+        else
+        {
+            due.prev = due.next = &due;
+        }
+        m_now++;
+
+        uint32_t events = 0;
+        while (due.next != &due)
+        {
+            timer *t = static_cast<timer*>(due.next);
+            t->unlink();
+            events += dispatch(t->m_event, -ETIME, 0);
+        }
+        return events;
+    }
+
+    // same as io_uring_wrapper's, handlers that care about CQE flags take them as a second argument
+    static uint32_t dispatch(EVENT_CLASS *event, int32_t res, uint32_t flags)
+    {
+        if constexpr (requires { event->process_io_uring(res, flags); })
+            return event->process_io_uring(res, flags);
+        else
+            return event->process_io_uring(res);
+    }
+
+    uint64_t m_tick_ns;
+    EVENT_CLASS *m_tick_event;
+    void *m_ring = nullptr;
+    bool (*m_prep)(void *ring, __kernel_timespec *ts, bool multishot, EVENT_CLASS *data) = nullptr;
+    __kernel_timespec m_ts{};
+    bool m_multishot = true;
+    uint64_t m_start_ns = 0;
+    uint64_t m_now = 0;      // ticks since start(), the next one to run
+    link m_slots[LEVELS][1u << L0_BITS];
+};
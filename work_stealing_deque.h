@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+/**
+  Fixed capacity Chase-Lev work stealing deque.
+
+  The owning thread pushes and pops at the bottom (LIFO, no contention unless the deque is down to one item).
+  Any other thread can steal from the top (FIFO), a failed CAS just means someone else got that item.
+
+  Capacity is fixed, push() returns false when full, so the owner keeps the rest of its work elsewhere
+  and tops the deque up as it drains. That keeps memory bounded no matter how big --cnt gets.
+
+  TYPE has to be trivially copyable, it is stored in std::atomic slots. Indexes or pointers work well.
+
+  Based on "Correct and Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli)
+  */
+template<typename TYPE>
+class work_stealing_deque
+{
+    static_assert(std::is_trivially_copyable_v<TYPE>, "work_stealing_deque items must be trivially copyable");
+
+public:
+    work_stealing_deque(size_t capacity = 1024)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_items.reset(new std::atomic<TYPE>[m_capacity]);
+    }
+
+    // owner thread only
+    bool push(TYPE val)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+
+        if (b - t >= static_cast<int64_t>(m_capacity))
+            return false;
+
+        m_items[b & m_mask].store(val, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // owner thread only
+    bool pop(TYPE &val)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            // empty
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        val = m_items[b & m_mask].load(std::memory_order_relaxed);
+
+        if (t == b)
+        {
+            // last item, race the thieves for it
+            bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // any thread
+    bool steal(TYPE &val)
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return false;
+
+        val = m_items[t & m_mask].load(std::memory_order_relaxed);
+        return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // approximate when called from a thread other than the owner
+    size_t size() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        return b > t ? b - t : 0;
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    size_t m_capacity = 0;
+    size_t m_mask = 0;
+    std::unique_ptr<std::atomic<TYPE>[]> m_items;
+};